@@ -40,6 +40,10 @@ MainWindow::MainWindow(QWidget *parent)
                 // "port=..." конвертируем строку в число
                 port = line.mid(sizeof("port=") - 1).toInt();
             }
+            else if (line.startsWith("compress=")) {
+                //"compress=0..9" — уровень сжатия крупных ответов сервера, 0 — без сжатия
+                compressLevel = qBound(0, line.mid(sizeof("compress=") - 1).toInt(), 9);
+            }
         }
     }
 
@@ -75,6 +79,24 @@ MainWindow::MainWindow(QWidget *parent)
         }
     );
 
+    //Как только TLS установлен, предлагаем серверу бинарный протокол (ответ ещё текстом)
+    connect(socket, &QSslSocket::encrypted, this, [this]() {
+        socket->write("PROTO BIN\n");
+        saveSessionTicket(); //TLS 1.2 выдаёт билет в самом рукопожатии
+    });
+    //TLS 1.3 присылает билет уже после рукопожатия
+    connect(socket, &QSslSocket::newSessionTicketReceived, this, &MainWindow::saveSessionTicket);
+
+    //Возобновление TLS-сессии: с билетом прошлого подключения сервер пропускает полное рукопожатие
+    //Билет лежит рядом с config.ini; нет файла или билет устарел — обычное рукопожатие
+    sessionPath = QCoreApplication::applicationDirPath() + "/tls_session.bin";
+    QSslConfiguration tlsCfg = socket->sslConfiguration();
+    tlsCfg.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    QFile ticketFile(sessionPath);
+    if (ticketFile.open(QIODevice::ReadOnly))
+        tlsCfg.setSessionTicket(ticketFile.readAll());
+    socket->setSslConfiguration(tlsCfg);
+
     //Когда на сокете появляются данные — передаём их в onSocketReadyRead()
     connect(socket, &QSslSocket::readyRead, this, &MainWindow::onSocketReadyRead);
 
@@ -175,7 +197,7 @@ MainWindow::MainWindow(QWidget *parent)
                 return;
             pendingPeerName = name;
             expectingUserId = true;
-            sendCmd("GET_USER_ID " + name);
+            send(Request("GET_USER_ID", Request::GetUserId).str(name));
         });
         connect(newGroupButton, &QPushButton::clicked, this, [this](){
             bool ok;
@@ -197,11 +219,23 @@ MainWindow::MainWindow(QWidget *parent)
             //Сохраняем список юзернеймов для получения их ID
             pendingGroupNames = members.split(' ', Qt::SkipEmptyParts);
             pendingGroupIds.clear();
+            groupLookups.clear();
             creatingGroup = true;
-            expectingUserId = true;
+
+            if (proto == Proto::Binary && !pendingGroupNames.isEmpty()) {
+                //Запрашиваем ID всех участников сразу: сервер выполнит запросы параллельно
+                pendingGroupIds.fill(0, pendingGroupNames.size());
+                for (int i = 0; i < pendingGroupNames.size(); ++i) {
+                    quint32 tag = nextTag++;
+                    groupLookups.insert(tag, i);
+                    send(Request("GET_USER_ID", Request::GetUserId).str(pendingGroupNames[i]).tagged(tag));
+                }
+                return;
+            }
 
             //Запрашиваем ID первого пользователя
-            sendCmd("GET_USER_ID " + pendingGroupNames.first());
+            expectingUserId = true;
+            send(Request("GET_USER_ID", Request::GetUserId).str(pendingGroupNames.first()));
         });
 
         //Основная область: список чатов + окно сообщений + ввод сообщения
@@ -213,6 +247,10 @@ MainWindow::MainWindow(QWidget *parent)
         h->addWidget(chatsList, 1);
 
         auto *r = new QVBoxLayout();
+        olderButton = new QPushButton("Более ранние сообщения", pageChats);
+        olderButton->setEnabled(false);
+        connect(olderButton, &QPushButton::clicked, this, &MainWindow::onLoadOlder);
+        r->addWidget(olderButton);
         chatView = new QTextEdit(pageChats);
         chatView->setReadOnly(true);
         chatView->setContextMenuPolicy(Qt::CustomContextMenu);
@@ -243,11 +281,144 @@ MainWindow::MainWindow(QWidget *parent)
     stack->setCurrentWidget(pageLogin);
 }
 
-//Отправка произвольной команды на сервер по SSL-сокету
-//cmd: строка команды без завершающего '\n'
-void MainWindow::sendCmd(const QString &cmd) {
-    //Добавляем символ новой строки и отправляем байты
-    socket->write(cmd.toUtf8() + "\n"); //UTF-8 !!!
+namespace {
+
+//Целое переменной длины (LEB128): по 7 бит в байте, старший бит — «дальше есть ещё байт»
+void appendVarint(QByteArray &out, quint64 v) {
+    while (v >= 0x80) {
+        out.append(char(v | 0x80));
+        v >>= 7;
+    }
+    out.append(char(v));
+}
+
+//Старший бит кода команды/типа кадра: за ним идёт varint-тег запроса (TAG_FLAG сервера)
+constexpr quint8 TagFlag = 0x80;
+
+//Типы кадров сервера (enum ReplyType в server/src/protocol.h)
+enum ReplyType : quint8 {
+    ReplyOk = 1, ReplyError, ReplySent, ReplyUserId, ReplyChats,
+    ReplyNewChat, ReplyNewMessage, ReplyHistory, ReplyMsgDeleted, ReplyUserLeft
+};
+
+//Чтение полей кадра; на обрезанном кадре поля становятся пустыми/нулевыми
+struct FrameReader {
+    const QByteArray &d;
+    int pos = 1; //d[0] — тип кадра
+
+    quint64 num() {
+        quint64 v = 0;
+        for (int shift = 0; pos < d.size() && shift < 64; shift += 7) {
+            quint8 b = static_cast<quint8>(d[pos++]);
+            v |= quint64(b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+        return v;
+    }
+    bool flag() { return pos < d.size() && d[pos++] != 0; }
+    QString str() {
+        int n = int(qMin<quint64>(num(), quint64(d.size() - pos)));
+        QString s = QString::fromUtf8(d.constData() + pos, n);
+        pos += n;
+        return s;
+    }
+    //Время: zigzag-varint секунд — время стены сервера, закодированное как UTC
+    QString time() {
+        quint64 z = num();
+        qint64 secs = qint64(z >> 1) ^ -qint64(z & 1);
+        return QDateTime::fromSecsSinceEpoch(secs, Qt::UTC).toString("yyyy-MM-dd hh:mm");
+    }
+};
+
+}  // namespace
+
+MainWindow::Request::Request(const char *name, Code code)
+    : text(QString::fromLatin1(name))
+{
+    body.append(char(code));
+}
+
+//Число: в тексте через пробел, в кадре — varint (отрицательные значения протоколу не нужны)
+MainWindow::Request &MainWindow::Request::num(qint64 v) {
+    text += " " + QString::number(v);
+    appendVarint(body, quint64(qMax<qint64>(v, 0)));
+    return *this;
+}
+
+//Строка: в тексте через пробел, в кадре — varint-длина и байты UTF-8
+MainWindow::Request &MainWindow::Request::str(const QString &s) {
+    text += " " + s;
+    QByteArray utf8 = s.toUtf8();
+    appendVarint(body, quint64(utf8.size()));
+    body.append(utf8);
+    return *this;
+}
+
+MainWindow::Request &MainWindow::Request::tagged(quint32 t) {
+    tag = t;
+    return *this;
+}
+
+//Текст до конца команды кодируется так же, как строка; в тексте он идёт последним
+MainWindow::Request &MainWindow::Request::tail(const QString &s) {
+    return str(s);
+}
+
+//Отправка команды на сервер по SSL-сокету в текущем протоколе
+void MainWindow::send(const Request &req) {
+    switch (proto) {
+    case Proto::Negotiating:
+        //Сервер ещё не ответил на PROTO BIN — отправим, когда станет ясно, в каком виде
+        pendingRequests.append(req);
+        break;
+    case Proto::Text: {
+        //Тег, если есть, — перед именем команды: "#<тег> ИМЯ ..."
+        QByteArray line;
+        if (req.tag) line = "#" + QByteArray::number(req.tag) + " ";
+        //Добавляем символ новой строки и отправляем байты
+        line += req.text.toUtf8() + "\n"; //UTF-8 !!!
+        socket->write(line);
+        break;
+    }
+    case Proto::Binary: {
+        //Тег идёт сразу за кодом команды, старший бит кода говорит о нём
+        QByteArray body = req.body;
+        if (req.tag) {
+            QByteArray tag;
+            appendVarint(tag, req.tag);
+            body[0] = char(quint8(body[0]) | TagFlag);
+            body.insert(1, tag);
+        }
+        //Кадр: varint-длина тела и само тело
+        QByteArray frame;
+        appendVarint(frame, quint64(body.size()));
+        socket->write(frame + body);
+        break;
+    }
+    }
+}
+
+//Сервер ответил на PROTO BIN: дальше общаемся кадрами или (старый сервер) остаёмся на тексте
+void MainWindow::finishNegotiation(bool binary) {
+    proto = binary ? Proto::Binary : Proto::Text;
+    //Просим сжимать крупные ответы (историю, список чатов) до остальных команд
+    //Ответ нам не нужен — сжатые блоки узнаются по первому байту, — поэтому запрос с тегом,
+    //на который никто не ждёт ответа
+    if (binary && compressLevel > 0)
+        send(Request("COMPRESS", Request::Compress).str("ZLIB").num(compressLevel).tagged(nextTag++));
+    const auto queued = std::move(pendingRequests);
+    pendingRequests.clear();
+    for (const Request &req : queued) send(req);
+}
+
+//Сохраняет билет TLS-сессии для следующего запуска
+void MainWindow::saveSessionTicket() {
+    QByteArray ticket = socket->sslConfiguration().sessionTicket();
+    if (ticket.isEmpty())
+        return;
+    QFile f(sessionPath);
+    if (f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        f.write(ticket);
 }
 
 //Вставляет HTML‑строку в конец окна чата и переходит на новую строку (история так выводится)
@@ -319,7 +490,7 @@ void MainWindow::onChatsListContextMenu(const QPoint &pt) {
                 QMessageBox::Yes | QMessageBox::No) == QMessageBox::Yes)
         {
             int cid = item->data(Qt::UserRole).toInt(); //chat_id
-            sendCmd(QString("LEAVE_CHAT %1").arg(cid)); //отправка на сервер
+            send(Request("LEAVE_CHAT", Request::LeaveChat).num(cid)); //отправка на сервер
             chatView->clear(); //очищаем окно сообщений
             delete item; //убираем из списка чатов
         }
@@ -352,7 +523,7 @@ void MainWindow::onChatViewContextMenu(const QPoint &pt) {
                 "Вы уверены, что хотите удалить это сообщение у себя?",
                 QMessageBox::Yes | QMessageBox::No) == QMessageBox::Yes)
         {
-            sendCmd(QString("DELETE %1").arg(msgId));
+            send(Request("DELETE", Request::Delete).num(msgId));
         }
     }
     else if (act == delAll) {
@@ -362,7 +533,7 @@ void MainWindow::onChatViewContextMenu(const QPoint &pt) {
                 "Вы уверены, что хотите удалить это сообщение у всех участников?",
                 QMessageBox::Yes | QMessageBox::No) == QMessageBox::Yes)
         {
-            sendCmd(QString("DELETE_GLOBAL %1").arg(msgId));
+            send(Request("DELETE_GLOBAL", Request::DeleteGlobal).num(msgId));
         }
     }
 }
@@ -384,7 +555,7 @@ void MainWindow::onRegister() {
     }
 
     //Формируем команду и отправляем на сервер
-    sendCmd(QString("REGISTER %1 %2").arg(u, p));
+    send(Request("REGISTER", Request::Register).str(u).str(p));
 }
 
 //Слот для входа в существующий аккаунт
@@ -405,7 +576,7 @@ void MainWindow::onLogin() {
     //Сохраняем локально имя для отображения
     myUsername = u;
     //Отправляем команду входа
-    sendCmd(QString("LOGIN %1 %2").arg(u, p));
+    send(Request("LOGIN", Request::Login).str(u).str(p));
 }
 
 //Слот для выхода из аккаунта
@@ -424,6 +595,8 @@ void MainWindow::onLogout() {
 
     //Очищаем локальный кеш
     cache.clear();
+    hasMoreHistory.clear();
+    olderButton->setEnabled(false);
 
     //Показываем страницу логина
     stack->setCurrentWidget(pageLogin);
@@ -436,14 +609,31 @@ void MainWindow::onChatSelected() {
 
     //Получаем chat_id из данных элемента
     currentChatId = it->data(Qt::UserRole).toInt();
+    //Открытый чат считается прочитанным — убираем счётчик
+    if (it->data(Qt::UserRole + 4).isValid()) {
+        it->setText(it->data(Qt::UserRole + 4).toString());
+    }
 
     //Если история чата уже закэширована — рисуем её
     if (cache.contains(currentChatId)) {
         redrawChatFromCache();
     }
-    //Иначе запрашиваем историю у сервера
+    //Иначе запрашиваем у сервера последнюю страницу истории
     else {
-        sendCmd(QString("HISTORY %1").arg(currentChatId));
+        send(Request("HISTORY", Request::History).num(currentChatId));
+    }
+    olderButton->setEnabled(hasMoreHistory.value(currentChatId, false));
+}
+
+//Слот: подгрузить страницу истории, предшествующую самому раннему загруженному сообщению
+void MainWindow::onLoadOlder() {
+    if (currentChatId < 0) return;
+    for (const ChatEntry &e : cache[currentChatId]) {
+        if (e.type == ChatEntry::Message && e.id > 0) {
+            olderButton->setEnabled(false); //до прихода ответа
+            send(Request("HISTORY", Request::History).num(currentChatId).num(e.id));
+            return;
+        }
     }
 }
 
@@ -480,7 +670,7 @@ void MainWindow::onSend() {
     );
 
     //5) Отправляем сообщение серверу
-    sendCmd(QString("SEND %1 ").arg(currentChatId) + msg);
+    send(Request("SEND", Request::Send).num(currentChatId).tail(msg));
 
     //6) Очищаем поле ввода
     messageEdit->clear();
@@ -488,320 +678,574 @@ void MainWindow::onSend() {
 
 //Слот: пришли данные от сервера
 void MainWindow::onSocketReadyRead() {
-    //Читаем все доступные данные из SSL‑сокета
-    QByteArray data = socket->readAll();
-    //Разбиваем на строки по символу '\n', игнорируем пустые
-    QStringList lines = QString::fromUtf8(data)
-                          .split('\n', Qt::SkipEmptyParts);
-
-    //Обрабатываем каждую строку отдельно
-    for (const QString &line : lines) {
-        //1) Ответ на GET_USER_ID — следующий ответ мы ожидаем после запроса GET_USER_ID
-        if (line.startsWith("USER_ID")) {
-            //Сбрасываем флаг ожидания ответа
-            expectingUserId = false;
-
-            //Пытаемся преобразовать строку в число user_id
-            int uid = line.split(' ')[1].toInt();
-            if (uid <= 0) {
-                //Если не удалось — показываем предупреждение
-                QMessageBox::warning(
-                    this,
-                    "Ошибка",
-                    "Пользователь \"" + pendingPeerName + "\" не найден!"
-                );
-            } else {
-                //Если успешно нашли ID
-                if (creatingGroup) {
-                    //(мы в процессе создания группы)
-                    //сохраняем новый user_id
-                    pendingGroupIds.append(uid);
-
-                    if (pendingGroupIds.size() < pendingGroupNames.size()) {
-                        //Если ещё остались имена для поиска,
-                        //продолжаем запрашивать ID следующего участника
-                        expectingUserId = true;
-                        sendCmd("GET_USER_ID " + pendingGroupNames[pendingGroupIds.size()]);
-                    } else {
-                        //Все ID участников получены — отправляем CREATE_CHAT для группы
-                        QString cmd = "CREATE_CHAT 1 " + pendingGroupName;
-                        for (int x : pendingGroupIds) {
-                            cmd += " " + QString::number(x);
-                        }
-                        sendCmd(cmd);
-                        creatingGroup = false;
-                    }
-                } else {
-                    //Обычный приватный чат — отправляем CREATE_CHAT с флагом 0 и peer ID
-                    sendCmd(QString("CREATE_CHAT 0 %1").arg(uid));
+    //Копим байты: строка или кадр могут прийти по частям
+    inBuf += socket->readAll();
+
+    while (true) {
+        //Сжатый блок: 0x00 <varint n> <n байт в формате qCompress> — внутри одна строка или кадр
+        //Обычные строки и кадры с нулевого байта не начинаются
+        if (!inBuf.isEmpty() && inBuf[0] == '\0') {
+            quint64 len = 0;
+            int pos = 1;
+            bool done = false;
+            for (int shift = 0; pos < inBuf.size() && shift < 64; shift += 7) {
+                quint8 b = static_cast<quint8>(inBuf[pos++]);
+                len |= quint64(b & 0x7f) << shift;
+                if (!(b & 0x80)) {
+                    done = true;
+                    break;
                 }
             }
-            //После обработки GET_USER_ID переходим к следующей строке
-            continue;
+            if (!done || quint64(inBuf.size() - pos) < len) break; //блок ещё не дошёл целиком
+            QByteArray raw = qUncompress(inBuf.mid(pos, int(len)));
+            //Распакованное сообщение разбираем дальше как обычно, на его законном месте в потоке
+            inBuf.replace(0, pos + int(len), raw);
+            if (raw.isEmpty()) continue;
         }
 
-        //2) Обработка ошибок создания приватного чата
-        if (line.startsWith("ERROR CHAT_EXISTS")) {
-            QMessageBox::warning(
-                this, 
-                "Ошибка",
-                "Личный чат с данным пользователем уже существует"
-            );
+        if (proto == Proto::Binary) {
+            //Кадр: <varint длина><тело>
+            quint64 len = 0;
+            int pos = 0;
+            bool done = false;
+            for (int shift = 0; pos < inBuf.size() && shift < 64; shift += 7) {
+                quint8 b = static_cast<quint8>(inBuf[pos++]);
+                len |= quint64(b & 0x7f) << shift;
+                if (!(b & 0x80)) {
+                    done = true;
+                    break;
+                }
+            }
+            if (!done || quint64(inBuf.size() - pos) < len) break; //кадр ещё не дошёл целиком
+            QByteArray frame = inBuf.mid(pos, int(len));
+            inBuf.remove(0, pos + int(len));
+            handleFrame(frame);
             continue;
         }
 
-        //3) Успешный логин — сервер вернул "OK LOGIN <user_id>"
-        if (line.startsWith("OK LOGIN")) {
-            //Извлекаем наш user_id
-            myUserId = line.split(' ')[1].toInt();
-            //Обновляем лейбл в UI
-            userLabel->setText(QString("Пользователь: %1").arg(myUsername));
-            //Показываем страницу со списком чатов
-            stack->setCurrentWidget(pageChats);
-            //Запрашиваем список чатов
-            sendCmd("LIST_CHATS");
+        //Текстовый протокол: строки по '\n'
+        int nl = inBuf.indexOf('\n');
+        if (nl < 0) break;
+        QString line = QString::fromUtf8(inBuf.left(nl));
+        inBuf.remove(0, nl + 1);
+        if (line.endsWith('\r')) line.chop(1);
+        if (line.isEmpty()) continue;
+
+        if (proto == Proto::Negotiating) {
+            //Первая строка — ответ на PROTO BIN; старый сервер ответит ERROR UNKNOWN
+            finishNegotiation(line == "OK PROTO BIN");
             continue;
         }
+        handleLine(line);
+    }
+}
 
-        //4) Успешная регистрация — сервер вернул "OK REG"
-        if (line.startsWith("OK REG")) {
-            QMessageBox::information(
-                this,
-                "Успешная регистрация!",
-                "Теперь заходим в аккаунт..."
-            );
-            //Автоматически вызываем onLogin для входа
-            onLogin();
-            continue;
-        }
+//Разбор одной строки текстового протокола
+void MainWindow::handleLine(const QString &line) {
+    //0) Ответ на запрос с тегом — "#<тег> <ответ>"; ждём их только на GET_USER_ID участников группы
+    if (line.startsWith('#')) {
+        int sp = line.indexOf(' ');
+        if (sp < 0) return;
+        QString rest = line.mid(sp + 1);
+        int uid = rest.startsWith("USER_ID ") ? rest.section(' ', 1, 1).toInt() : 0;
+        handleGroupMemberId(line.mid(1, sp - 1).toUInt(), uid);
+        return;
+    }
 
-        //5) Подтверждение отправки сообщения — "OK SENT <msg_id>"
-        if (line.startsWith("OK SENT")) {
-            bool ok;
-            int mid = line.mid(QString("OK SENT ").length()).toInt(&ok);
-            if (!ok) {
-                //Не смогли распознать msg_id — выходим
-                return;
-            }
+    //1) Ответ на GET_USER_ID — следующий ответ мы ожидаем после запроса GET_USER_ID
+    if (line.startsWith("USER_ID")) {
+        handleUserId(line.split(' ')[1].toInt());
+        return;
+    }
 
-            //Находим в кэше последний наш локальный ChatEntry с id = -1
-            auto &vec = cache[currentChatId];
-            for (int i = vec.size() - 1; i >= 0; --i) {
-                if (vec[i].id == -1 && vec[i].author == myUsername) {
-                    //Присваиваем ему настоящий msg_id
-                    vec[i].id = mid;
-                    break;
-                }
-            }
+    //2) Успешный логин — сервер вернул "OK LOGIN <user_id>"
+    if (line.startsWith("OK LOGIN")) {
+        //Извлекаем наш user_id
+        myUserId = line.split(' ')[1].toInt();
+        handleLoggedIn();
+        return;
+    }
 
-            //UI уже содержит сообщение, перерисовывать не нужно
-            continue;
+    //3) Успешная регистрация — сервер вернул "OK REG"
+    if (line.startsWith("OK REG")) {
+        handleRegistered();
+        return;
+    }
+
+    //4) Подтверждение отправки сообщения — "OK SENT <msg_id>"
+    if (line.startsWith("OK SENT")) {
+        bool ok;
+        int mid = line.mid(QString("OK SENT ").length()).toInt(&ok);
+        //Не смогли распознать msg_id — пропускаем
+        if (ok) handleSent(mid);
+        return;
+    }
+
+    //5) Уведомление о создании нового чата — "NEW_CHAT"
+    if (line.startsWith("NEW_CHAT")) {
+        //Формат: NEW_CHAT <cid> <is_group> <name_or_member1, member2>
+        QStringList parts = line.split(' ');
+        handleNewChat(parts[1].toInt(), parts[2] == "1", parts[3]);
+        return;
+    }
+
+    //6) Уведомление о новом сообщении
+    if (line.startsWith("NEW_MESSAGE")) {
+        //Формат: NEW_MESSAGE <chat_id> <msg_id> <YYYY-MM-DD> <HH:MM> <from> <content>
+        //Разобъём по пробелам, но content может содержать пробелы, поэтому делаем так:
+        QString payload = line.mid(QString("NEW_MESSAGE ").length());
+        QStringList parts = payload.split(' ');
+        ChatEntry e;
+        e.type   = ChatEntry::Message;
+        e.id     = parts[1].toInt();
+        e.date   = parts[2] + " " + parts[3];
+        e.author = parts[4];
+        //Всё остальное — content
+        e.text   = parts.mid(5).join(' ');
+        handleNewMessage(parts[0].toInt(), e);
+        return;
+    }
+
+    //7) Обработка списка чатов — "CHATS <cid>:<is_group>:<name>:<members>:<unread>:<last_from>:<last_text>;..."
+    if (line.startsWith("CHATS")) {
+        QVector<ChatInfo> chats;
+        //Убираем префикс "CHATS " и разбиваем на куски по ';'
+        auto chunks = line.mid(6).split(';', Qt::SkipEmptyParts);
+        for (auto &chunk : chunks) {
+            //Каждый chunk: "cid:is_group:name:member1,member2,...:unread:last_from:last_text"
+            auto p = chunk.split(':');
+            if (p.size() < 4) continue;
+            ChatInfo ci;
+            ci.cid = p[0].toInt();
+            ci.isGroup = (p[1] == "1");
+            ci.name = p[2];
+            ci.members = p[3].split(',');
+            ci.unread = p.size() > 4 ? p[4].toInt() : 0;
+            ci.lastFrom = p.size() > 5 ? p[5] : QString();
+            //Текст последнего сообщения может сам содержать ':'
+            ci.lastText = p.size() > 6 ? p.mid(6).join(':') : QString();
+            chats.append(ci);
         }
+        handleChats(chats);
+        return;
+    }
 
-        //6) Уведомление о создании нового чата — "NEW_CHAT"
-        if (line.startsWith("NEW_CHAT")) {
-            //Формат: NEW_CHAT <cid> <is_group> <name_or_member1, member2>
-            QStringList parts = line.split(' ');
-            int cid = parts[1].toInt();
-            bool isGroup = (parts[2] == "1");
-            QString nameOrList = parts[3];
-            nameOrList.replace("_", " ");
-            QString display;
-            if (isGroup) {
-                display = QString("👥: %1").arg(nameOrList);
-            } else {
-                //[3] == "viktor,aleksey"
-                QStringList m = nameOrList.split(',');
-                QString other = (m[0] == myUsername ? m[1] : m[0]);
-                display = QString("👤: %1").arg(other);
+    //8) Обработка страницы истории — "HISTORY <chat_id> <before_msg_id> <has_more> <entries>;"
+    if (line.startsWith("HISTORY ")) {
+        auto head = line.section(' ', 1, 3).split(' ');
+        if (head.size() < 3) return;
+        QVector<ChatEntry> entries;
+        //Отрезаем заголовок и разбиваем записи по ';'
+        auto chunks = line.section(' ', 4).split(";", Qt::SkipEmptyParts);
+
+        //Регэкспы для сообщений и системных событий
+        QRegularExpression reMsg(R"(\[([^\]]+)\]\s+([^:]+):\s+(.+)\s+\(id=(\d+)\))");
+        QRegularExpression reEvt(R"(\[([^\]]+)\]\s+\*\s+(.+))");
+
+        //Проходим по каждому фрагменту
+        for (const QString &chunk : chunks) {
+            if (auto m = reMsg.match(chunk); m.hasMatch()) {
+                //Сообщение: [timestamp] author: content (id=msg_id)
+                ChatEntry e;
+                e.type = ChatEntry::Message;
+                e.date = m.captured(1);
+                e.author = m.captured(2);
+                e.text = m.captured(3);
+                e.id = m.captured(4).toInt();
+                entries.append(e);
+            }
+            else if (auto m = reEvt.match(chunk); m.hasMatch()) {
+                //Событие: [timestamp] * description
+                ChatEntry e;
+                e.type = ChatEntry::Event;
+                e.date = m.captured(1);
+                e.text = m.captured(2);
+                entries.append(e);
             }
-            auto *item = new QListWidgetItem(display);
-            item->setData(Qt::UserRole, cid);
-            item->setData(Qt::UserRole+1, nameOrList);
-            item->setData(Qt::UserRole+3, isGroup);
-            chatsList->addItem(item);
-            continue;
         }
+        handleHistory(head[0].toInt(), head[1].toInt(), head[2] == "1", std::move(entries));
+        return;
+    }
+
+    //9) Уведомление о выходе пользователя — "USER_LEFT <chat_id> <username> <YYYY-MM-DD> <HH:MM>"
+    if (line.startsWith("USER_LEFT")) {
+        auto parts = line.split(' ');
+        handleUserLeft(parts[1].toInt(), parts[2], parts[3] + " " + parts[4]);
+        return;
+    }
 
-        //7) Уведомление о новом сообщении
-        if (line.startsWith("NEW_MESSAGE")) {
-            //Формат: NEW_MESSAGE <chat_id> <msg_id> <YYYY-MM-DD> <HH:MM> <from> <content>
-            //Разобъём по пробелам, но content может содержать пробелы, поэтому делаем так:
-            QString payload = line.mid(QString("NEW_MESSAGE ").length());
-            QStringList parts = payload.split(' ');
-            int cid  = parts[0].toInt();
-            int mid  = parts[1].toInt();
-            QString date = parts[2] + " " + parts[3];
-            QString from = parts[4];
-            //Всё остальное — content
-            QString content = parts.mid(5).join(' ');
-
-            //Добавляем в кэш
+    //10) Глобальное удаление сообщения — "MSG_DELETED <chat_id> <msg_id>"
+    if (line.startsWith("MSG_DELETED")) {
+        auto parts = line.split(' ');
+        handleMsgDeleted(parts[1].toInt(), parts[2].toInt());
+        return;
+    }
+
+    //11) Ошибки от сервера — "ERROR [<код>]"
+    if (line.startsWith("ERROR")) {
+        handleError(line.mid(6));
+        return;
+    }
+}
+
+//Разбор одного кадра бинарного протокола: поля уже типизированы, текст сообщений — как есть
+void MainWindow::handleFrame(const QByteArray &frame) {
+    if (frame.isEmpty()) return;
+    FrameReader r{frame};
+    quint8 type = static_cast<quint8>(frame[0]);
+    if (type & TagFlag) {
+        //Ответ на запрос с тегом: тег сразу за типом
+        quint32 tag = quint32(r.num());
+        int uid = (type & ~TagFlag) == ReplyUserId ? int(r.num()) : 0;
+        handleGroupMemberId(tag, uid);
+        return;
+    }
+    switch (type) {
+    case ReplyOk: {
+        QString what = r.str();
+        if (what == "LOGIN") handleLoggedIn();
+        else if (what == "REG") handleRegistered();
+        break;
+    }
+    case ReplyError:
+        handleError(r.str());
+        break;
+    case ReplySent:
+        handleSent(int(r.num()));
+        break;
+    case ReplyUserId:
+        handleUserId(int(r.num()));
+        break;
+    case ReplyChats: {
+        QVector<ChatInfo> chats;
+        int n = int(r.num());
+        for (int i = 0; i < n && r.pos < frame.size(); ++i) {
+            ChatInfo ci;
+            ci.cid = int(r.num());
+            ci.isGroup = r.flag();
+            ci.name = r.str();
+            int m = int(r.num());
+            for (int j = 0; j < m && r.pos < frame.size(); ++j) ci.members.append(r.str());
+            ci.unread = int(r.num());
+            ci.lastFrom = r.str();
+            ci.lastText = r.str();
+            chats.append(ci);
+        }
+        handleChats(chats);
+        break;
+    }
+    case ReplyNewChat: {
+        int cid = int(r.num());
+        bool isGroup = r.flag();
+        handleNewChat(cid, isGroup, r.str());
+        break;
+    }
+    case ReplyNewMessage: {
+        int cid = int(r.num());
+        ChatEntry e;
+        e.type = ChatEntry::Message;
+        e.id = int(r.num());
+        e.date = r.time();
+        e.author = r.str();
+        e.text = r.str();
+        handleNewMessage(cid, e);
+        break;
+    }
+    case ReplyHistory: {
+        int cid = int(r.num());
+        int before = int(r.num());
+        bool more = r.flag();
+        int n = int(r.num());
+        QVector<ChatEntry> entries;
+        for (int i = 0; i < n && r.pos < frame.size(); ++i) {
             ChatEntry e;
-            e.type   = ChatEntry::Message;
-            e.date   = date;
-            e.author = from;
-            e.text   = content;
-            e.id     = mid;
-            cache[cid].append(e);
-
-            //Если это текущий открытый чат — выводим прямо сейчас
-            if (cid == currentChatId) {
-                appendHtmlLine(
-                    QString("<span style='font-size:small;color:#666;'>[%1]</span> "
-                            "<b>%2:</b> %3")
-                        .arg(e.date, e.author.toHtmlEscaped(), e.text.toHtmlEscaped())
-                );
+            e.id = int(r.num());
+            e.date = r.time();
+            QString from = r.str();
+            QString text = r.str();
+            if (e.id > 0) {
+                e.type = ChatEntry::Message;
+                e.author = from;
+                e.text = text;
+            } else {
+                //Событие: «<участник> <что произошло>»
+                e.type = ChatEntry::Event;
+                e.id = -1;
+                e.text = from + " " + text;
             }
-            continue;
+            entries.append(e);
         }
+        handleHistory(cid, before, more, std::move(entries));
+        break;
+    }
+    case ReplyMsgDeleted: {
+        int cid = int(r.num());
+        handleMsgDeleted(cid, int(r.num()));
+        break;
+    }
+    case ReplyUserLeft: {
+        int cid = int(r.num());
+        QString who = r.str();
+        handleUserLeft(cid, who, r.time());
+        break;
+    }
+    default:
+        break; //неизвестный кадр от более нового сервера пропускаем
+    }
+}
 
-        //8) Обработка списка чатов — "CHATS <cid>:<is_group>:<name>:<members>;..."
-        if (line.startsWith("CHATS")) {
-            chatsList->clear();
-
-            //Убираем префикс "CHATS " и разбиваем на куски по ';'
-            auto chunks = line.mid(6).split(';', Qt::SkipEmptyParts);
-            for (auto &chunk : chunks) {
-                //Каждый chunk: "cid:is_group:name:member1,member2,..."
-                auto p = chunk.split(':');
-                int cid = p[0].toInt();
-                bool isGroup = (p[1] == "1");
-                QString name = p[2];
-                name.replace("_", " ");
-                auto members = p[3].split(',');
-
-                //Для личного чата показываем имя «с кем», для группы — саму группу
-                QString display;
-                if (isGroup) {
-                    display = QString("👥: %1").arg(name);
-                } else {
-                    //Находим имя другого участника
-                    for (const QString &m : members) {
-                        if (m != myUsername) {
-                            display = QString("👤: %1").arg(m);
-                            break;
-                        }
-                    }
-                }
+//Ответ на GET_USER_ID
+void MainWindow::handleUserId(int uid) {
+    //Сбрасываем флаг ожидания ответа
+    expectingUserId = false;
 
-                //Создаём элемент списка и сохраняем метаданные (потом удобно знать информацию о чате)
-                auto *item = new QListWidgetItem(display);
-                item->setData(Qt::UserRole + 0, cid);
-                item->setData(Qt::UserRole + 1, name);
-                item->setData(Qt::UserRole + 2, members);
-                item->setData(Qt::UserRole + 3, isGroup);
-                chatsList->addItem(item);
-            }
+    if (uid <= 0) {
+        //Если не удалось — показываем предупреждение
+        QMessageBox::warning(
+            this,
+            "Ошибка",
+            "Пользователь \"" + pendingPeerName + "\" не найден!"
+        );
+        return;
+    }
 
-            //Если список не пустой, выбираем первый чат
-            if (!chunks.isEmpty()) {
-                onChatSelected();
+    //Если успешно нашли ID
+    if (creatingGroup) {
+        //(мы в процессе создания группы)
+        //сохраняем новый user_id
+        pendingGroupIds.append(uid);
+
+        if (pendingGroupIds.size() < pendingGroupNames.size()) {
+            //Если ещё остались имена для поиска,
+            //продолжаем запрашивать ID следующего участника
+            expectingUserId = true;
+            send(Request("GET_USER_ID", Request::GetUserId).str(pendingGroupNames[pendingGroupIds.size()]));
+        } else {
+            //Все ID участников получены — отправляем CREATE_CHAT для группы
+            Request req("CREATE_CHAT", Request::CreateChat);
+            req.num(1).str(pendingGroupName);
+            for (int x : pendingGroupIds) {
+                req.num(x);
             }
-            continue;
+            send(req);
+            creatingGroup = false;
         }
+    } else {
+        //Обычный приватный чат — отправляем CREATE_CHAT с флагом 0 и peer ID
+        send(Request("CREATE_CHAT", Request::CreateChat).num(0).num(uid));
+    }
+}
 
-        //9) Обработка истории сообщений — "HISTORY <entries>;"
-        if (line.startsWith("HISTORY")) {
-            chatView->clear();
-            QVector<ChatEntry> entries;
-            //Отрезаем "HISTORY " и разбиваем по ';'
-            auto chunks = line.mid(8).split(";", Qt::SkipEmptyParts);
-
-            //Регэкспы для сообщений и системных событий
-            QRegularExpression reMsg(R"(\[([^\]]+)\]\s+([^:]+):\s+(.+)\s+\(id=(\d+)\))");
-            QRegularExpression reEvt(R"(\[([^\]]+)\]\s+\*\s+(.+))");
-
-            //Проходим по каждому фрагменту
-            for (const QString &chunk : chunks) {
-                if (auto m = reMsg.match(chunk); m.hasMatch()) {
-                    //Сообщение: [timestamp] author: content (id=msg_id)
-                    ChatEntry e;
-                    e.type = ChatEntry::Message;
-                    e.date = m.captured(1);
-                    e.author = m.captured(2);
-                    e.text = m.captured(3);
-                    e.id = m.captured(4).toInt();
-                    entries.append(e);
-                }
-                else if (auto m = reEvt.match(chunk); m.hasMatch()) {
-                    //Событие: [timestamp] * description
-                    ChatEntry e;
-                    e.type = ChatEntry::Event;
-                    e.date = m.captured(1);
-                    e.text = m.captured(2);
-                    entries.append(e);
-                }
-            }
+//Ответ на один из параллельных GET_USER_ID при создании группы
+void MainWindow::handleGroupMemberId(quint32 tag, int uid) {
+    //Тега нет — создание группы уже отменено, запоздавший ответ не нужен
+    auto it = groupLookups.find(tag);
+    if (it == groupLookups.end()) return;
+    int index = it.value();
+    groupLookups.erase(it);
+
+    if (uid <= 0) {
+        //Остальные ответы больше не ждём: группа не будет создана
+        groupLookups.clear();
+        creatingGroup = false;
+        QMessageBox::warning(
+            this,
+            "Ошибка",
+            "Пользователь \"" + pendingGroupNames.value(index) + "\" не найден!"
+        );
+        return;
+    }
+    pendingGroupIds[index] = uid;
+    if (!groupLookups.isEmpty()) return;
+
+    //Все ID участников получены — отправляем CREATE_CHAT для группы
+    Request req("CREATE_CHAT", Request::CreateChat);
+    req.num(1).str(pendingGroupName);
+    for (int x : pendingGroupIds) {
+        req.num(x);
+    }
+    send(req);
+    creatingGroup = false;
+}
 
-            //Сохраняем полную историю в кэш
-            cache[currentChatId] = std::move(entries);
-            //И перерисуем
-            redrawChatFromCache();
-            continue;
-        }
+//Успешный вход
+void MainWindow::handleLoggedIn() {
+    //Обновляем лейбл в UI
+    userLabel->setText(QString("Пользователь: %1").arg(myUsername));
+    //Показываем страницу со списком чатов
+    stack->setCurrentWidget(pageChats);
+    //Запрашиваем список чатов
+    send(Request("LIST_CHATS", Request::ListChats));
+}
 
-        //10) Уведомление о выходе пользователя — "USER_LEFT <chat_id> <username> <YYYY-MM-DD> <HH:MM>"
-        if (line.startsWith("USER_LEFT")) {
-            auto parts = line.split(' ');
-            int cid = parts[1].toInt();
-            QString who = parts[2];
-            QString ts = parts[3] + " " + parts[4];
+//Успешная регистрация
+void MainWindow::handleRegistered() {
+    QMessageBox::information(
+        this,
+        "Успешная регистрация!",
+        "Теперь заходим в аккаунт..."
+    );
+    //Автоматически вызываем onLogin для входа
+    onLogin();
+}
 
-            ChatEntry e;
-            e.type = ChatEntry::Event;
-            e.date = ts;
-            e.text = QString("%1 покинул(а) чат").arg(who);
-
-            //Добавляем в кэш и, если открыт этот чат — отображаем сразу
-            cache[cid].append(e);
-            if (cid == currentChatId) {
-                redrawChatFromCache();
-            }
-            continue;
+//Подтверждение отправки сообщения
+void MainWindow::handleSent(int mid) {
+    //Находим в кэше последний наш локальный ChatEntry с id = -1
+    auto &vec = cache[currentChatId];
+    for (int i = vec.size() - 1; i >= 0; --i) {
+        if (vec[i].id == -1 && vec[i].author == myUsername) {
+            //Присваиваем ему настоящий msg_id
+            vec[i].id = mid;
+            break;
         }
+    }
+    //UI уже содержит сообщение, перерисовывать не нужно
+}
+
+//Уведомление о создании нового чата
+void MainWindow::handleNewChat(int cid, bool isGroup, QString nameOrList) {
+    nameOrList.replace("_", " ");
+    QString display;
+    if (isGroup) {
+        display = QString("👥: %1").arg(nameOrList);
+    } else {
+        //"viktor,aleksey"
+        QStringList m = nameOrList.split(',');
+        QString other = (m[0] == myUsername ? m.value(1) : m[0]);
+        display = QString("👤: %1").arg(other);
+    }
+    auto *item = new QListWidgetItem(display);
+    item->setData(Qt::UserRole, cid);
+    item->setData(Qt::UserRole+1, nameOrList);
+    item->setData(Qt::UserRole+3, isGroup);
+    chatsList->addItem(item);
+}
+
+//Уведомление о новом сообщении
+void MainWindow::handleNewMessage(int cid, const ChatEntry &e) {
+    //Добавляем в кэш
+    cache[cid].append(e);
+
+    //Если это текущий открытый чат — выводим прямо сейчас
+    if (cid == currentChatId) {
+        appendHtmlLine(
+            QString("<span style='font-size:small;color:#666;'>[%1]</span> "
+                    "<b>%2:</b> %3")
+                .arg(e.date, e.author.toHtmlEscaped(), e.text.toHtmlEscaped())
+        );
+    }
+}
+
+//Список чатов
+void MainWindow::handleChats(const QVector<ChatInfo> &chats) {
+    chatsList->clear();
+
+    for (const ChatInfo &ci : chats) {
+        QString name = ci.name;
+        name.replace("_", " ");
 
-        //11) Глобальное удаление сообщения — "MSG_DELETED <chat_id> <msg_id>"
-        if (line.startsWith("MSG_DELETED")) {
-            auto parts = line.split(' ');
-            int cid = parts[1].toInt();
-            int msg_id = parts[2].toInt();
-
-            //Удаляем запись из локального кэша
-            auto &vec = cache[cid];
-            for (int i = 0; i < vec.size(); ++i) {
-                if (vec[i].id == msg_id) {
-                    vec.remove(i);
+        //Для личного чата показываем имя «с кем», для группы — саму группу
+        QString display;
+        if (ci.isGroup) {
+            display = QString("👥: %1").arg(name);
+        } else {
+            //Находим имя другого участника
+            for (const QString &m : ci.members) {
+                if (m != myUsername) {
+                    display = QString("👤: %1").arg(m);
                     break;
                 }
             }
-
-            if (cid == currentChatId) {
-                //Перерисовываем окно чата
-                redrawChatFromCache();
-            }
-
-            continue;
         }
 
-        //12) Информационные ошибки от сервера
-        if (line == "ERROR USER_EXISTS") {
-            QMessageBox::warning(this, "Ошибка", "Такой пользователь уже существует!");
-            continue;
-        }
-        if (line == "ERROR NOT_CORRECT") {
-            QMessageBox::warning(this, "Ошибка", "Неверное имя пользователя или пароль!");
-            continue;
+        //Счётчик непрочитанных рядом с названием, последнее сообщение — во всплывающей подсказке
+        QString title = display;
+        if (ci.unread > 0) {
+            display += ci.unread > 99 ? QString("  (99+)") : QString("  (%1)").arg(ci.unread);
         }
-        if (line == "ERROR NO_RIGHTS") {
-            QMessageBox::warning(this, "Ошибка", "Вы можете удалять только собственные сообщения!");
-            continue;
+
+        //Создаём элемент списка и сохраняем метаданные (потом удобно знать информацию о чате)
+        auto *item = new QListWidgetItem(display);
+        if (!ci.lastFrom.isEmpty()) {
+            item->setToolTip(QString("%1: %2").arg(ci.lastFrom, ci.lastText));
         }
+        item->setData(Qt::UserRole + 0, ci.cid);
+        item->setData(Qt::UserRole + 1, name);
+        item->setData(Qt::UserRole + 2, ci.members);
+        item->setData(Qt::UserRole + 3, ci.isGroup);
+        item->setData(Qt::UserRole + 4, title); //название без счётчика непрочитанных
+        chatsList->addItem(item);
+    }
 
-        // 13) Любая другая ошибка — показываем текст ошибки
-        if (line.startsWith("ERROR")) {
-            QMessageBox::warning(this, "Ошибка", line);
-            continue;
+    //Если список не пустой, выбираем первый чат
+    if (!chats.isEmpty()) {
+        onChatSelected();
+    }
+}
+
+//Страница истории; before = 0 — последняя страница, иначе страница перед уже загруженными сообщениями
+void MainWindow::handleHistory(int cid, int before, bool more, QVector<ChatEntry> entries) {
+    //Последняя страница заменяет кэш, более ранняя дописывается в его начало
+    if (before == 0) {
+        cache[cid] = std::move(entries);
+    } else {
+        entries += cache[cid];
+        cache[cid] = std::move(entries);
+    }
+    hasMoreHistory[cid] = more;
+    //И перерисуем, если это открытый чат
+    if (cid == currentChatId) {
+        olderButton->setEnabled(more);
+        redrawChatFromCache();
+    }
+}
+
+//Уведомление о выходе пользователя из чата
+void MainWindow::handleUserLeft(int cid, const QString &who, const QString &ts) {
+    ChatEntry e;
+    e.type = ChatEntry::Event;
+    e.date = ts;
+    e.text = QString("%1 покинул(а) чат").arg(who);
+
+    //Добавляем в кэш и, если открыт этот чат — отображаем сразу
+    cache[cid].append(e);
+    if (cid == currentChatId) {
+        redrawChatFromCache();
+    }
+}
+
+//Глобальное удаление сообщения
+void MainWindow::handleMsgDeleted(int cid, int msgId) {
+    //Удаляем запись из локального кэша
+    auto &vec = cache[cid];
+    for (int i = 0; i < vec.size(); ++i) {
+        if (vec[i].id == msgId) {
+            vec.remove(i);
+            break;
         }
     }
-}
\ No newline at end of file
+
+    if (cid == currentChatId) {
+        //Перерисовываем окно чата
+        redrawChatFromCache();
+    }
+}
+
+//Информационные ошибки от сервера (code — без префикса "ERROR ")
+void MainWindow::handleError(const QString &code) {
+    if (code == "CHAT_EXISTS") {
+        QMessageBox::warning(this, "Ошибка", "Личный чат с данным пользователем уже существует");
+    } else if (code == "USER_EXISTS") {
+        QMessageBox::warning(this, "Ошибка", "Такой пользователь уже существует!");
+    } else if (code == "BAD_NAME") {
+        QMessageBox::warning(this, "Ошибка", "Имя не должно содержать переводов строк, пробелов и символов , : ;");
+    } else if (code == "NOT_CORRECT") {
+        QMessageBox::warning(this, "Ошибка", "Неверное имя пользователя или пароль!");
+    } else if (code == "NO_RIGHTS") {
+        QMessageBox::warning(this, "Ошибка", "Вы можете удалять только собственные сообщения!");
+    } else {
+        //Любая другая ошибка — показываем текст ошибки
+        QMessageBox::warning(this, "Ошибка", code.isEmpty() ? QString("ERROR") : "ERROR " + code);
+    }
+}
@@ -31,6 +31,7 @@ private slots:
     void onLogout(); //при нажатии «Выйти из профиля»
     void onChatSelected(); //при выборе чата в списке
     void onSend(); //при нажатии «Отправить»
+    void onLoadOlder(); //при нажатии «Более ранние сообщения»
     void onSocketReadyRead(); //данные от сервера готовы к чтению
     void onChatViewContextMenu(const QPoint &pt); //контекстное меню внутри окна чата
     void onChatsListContextMenu(const QPoint &pt); //контекстное меню для списка чатов
@@ -53,12 +54,20 @@ private:
     QPushButton *newChatButton; //кнопка «Новый личный чат»
     QPushButton *newGroupButton; //кнопка «Новая группа»
     QListWidget *chatsList; //список доступных чатов
+    QPushButton *olderButton; //кнопка «Более ранние сообщения» (подгрузка следующей страницы истории)
     QTextEdit *chatView; //окно истории сообщений
     QLineEdit *messageEdit; //ввод нового сообщения
     QPushButton *sendButton; //кнопка «Отправить»
 
     //Сеть и протокол
     QSslSocket *socket; //шифрованный TCP-сокет (SSL)
+    QString sessionPath; //файл с билетом TLS-сессии для быстрого повторного подключения
+    //Сразу после подключения просим сервер перейти на бинарный протокол (PROTO BIN);
+    //пока ответа нет, команды копятся в pendingRequests, старый сервер оставит нас на текстовом
+    enum class Proto { Negotiating, Text, Binary };
+    Proto proto = Proto::Negotiating;
+    int compressLevel = 1; //уровень zlib, которым сервер сжимает крупные ответы (0 — не просить сжатия)
+    QByteArray inBuf; //принятые от сервера байты, ещё не разобранные на строки/кадры
     int myUserId = -1; //идентификатор текущего пользователя
     QString myUsername; //его имя
     int currentChatId = -1; //выбранный chat_id
@@ -70,6 +79,10 @@ private:
     QString pendingGroupName; // временно: имя создаваемой группы
     QStringList pendingGroupNames; //имена участников группы
     QVector<int> pendingGroupIds; //уже готовые ID пользователей, добавляемых в группу
+    //Бинарный протокол: ID участников запрашиваются разом, запросами с тегами,
+    //ответы приходят в любом порядке; тег GET_USER_ID -> номер участника в pendingGroupNames
+    QHash<quint32, int> groupLookups;
+    quint32 nextTag = 1; //тег следующего запроса
 
     //Запись чата: либо пользовательское сообщение, либо событие 
     struct ChatEntry {
@@ -80,12 +93,67 @@ private:
         int id = -1; //message_id, для Event не используется
     };
 
+    //Чат из списка LIST_CHATS
+    struct ChatInfo {
+        int cid = 0;
+        bool isGroup = false;
+        QString name;
+        QStringList members;
+        int unread = 0;
+        QString lastFrom; //автор последнего сообщения
+        QString lastText; //начало последнего сообщения
+    };
+
+    //Команда серверу сразу в обоих видах протокола
+    //Текстом: "ИМЯ поле поле ..."; кадром: <varint длина><u8 код><поля>,
+    //число — varint, строка — varint-длина и байты UTF-8 (коды совпадают с enum Command сервера)
+    //Запрос с тегом сервер может выполнить параллельно с другими и ответит с тем же тегом
+    struct Request {
+        enum Code : quint8 {
+            Register = 1, Login, ListChats, CreateChat, Send,
+            History, Delete, DeleteGlobal, LeaveChat, GetUserId,
+            Compress = 12
+        };
+        QString text;
+        QByteArray body;
+        quint32 tag = 0; //0 — без тега, ответ придёт по порядку
+        Request() = default;
+        Request(const char *name, Code code);
+        Request &tagged(quint32 t);
+        Request &num(qint64 v);
+        Request &str(const QString &s); //слово без пробелов
+        Request &tail(const QString &s); //текст до конца команды (может содержать пробелы)
+    };
+    QVector<Request> pendingRequests; //команды, отправленные до ответа на PROTO BIN
+
     //Локальный кэш истории: для каждого chat_id — вектор ChatEntry
     QHash<int, QVector<ChatEntry>> cache;
+    //Есть ли на сервере более ранние сообщения, чем уже загруженные
+    QHash<int, bool> hasMoreHistory;
 
     //Вспомогательные методы
-    void sendCmd(const QString &cmd); //отправляет команду серверу по сокету
+    void send(const Request &req); //отправляет команду серверу в текущем протоколе
+    void finishNegotiation(bool binary); //ответ на PROTO BIN получен
     void appendHtmlLine(const QString &html); //вставляет HTML в chatView
+    void saveSessionTicket(); //сохраняет билет TLS-сессии, выданный сервером
+
+    //Разбор ответов сервера: текстовая строка или бинарный кадр
+    void handleLine(const QString &line);
+    void handleFrame(const QByteArray &frame);
+
+    //Обработка ответов, общая для обоих протоколов
+    void handleUserId(int uid);
+    void handleGroupMemberId(quint32 tag, int uid); //ответ на GET_USER_ID с тегом (0 — не найден)
+    void handleLoggedIn();
+    void handleRegistered();
+    void handleSent(int mid);
+    void handleNewChat(int cid, bool isGroup, QString nameOrList);
+    void handleNewMessage(int cid, const ChatEntry &e);
+    void handleChats(const QVector<ChatInfo> &chats);
+    void handleHistory(int cid, int before, bool more, QVector<ChatEntry> entries);
+    void handleUserLeft(int cid, const QString &who, const QString &ts);
+    void handleMsgDeleted(int cid, int msgId);
+    void handleError(const QString &code);
 
     //Контекстные меню
     //Для удаления конкретного сообщения по позиции в chatView
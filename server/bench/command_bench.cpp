@@ -0,0 +1,118 @@
+//Разбор и диспетчеризация команд: CommandArgs + lookupCommand против прежнего способа
+//(std::istringstream, имя команды в std::string и цепочка сравнений if/else)
+//
+//  make bench && bench/command_bench
+//Печатает команд в секунду и выделений памяти на команду для смеси типичных строк
+#include "../src/command.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//Считаем выделения памяти во всей программе
+static size_t allocations = 0;
+void* operator new(size_t n) {
+  allocations++;
+  if (void* p = std::malloc(n ? n : 1)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+const int COMMANDS = 2000000;
+
+const std::vector<std::string> MIX = {
+  "SEND 42 hello world this is a message",
+  "HISTORY 7 1234 50",
+  "LOGIN alice secret",
+  "CREATE_CHAT 1 team 2 3 4 5",
+  "DELETE_GLOBAL 99",
+  "LIST_CHATS",
+  "#17 GET_USER_ID bob",
+  "BOGUS x y",
+};
+
+//Разбирает аргументы так же, как это делают обработчики; возвращает что-нибудь от каждого поля,
+//чтобы компилятор не выбросил разбор
+long parseNew(std::string_view line) {
+  CommandArgs args(line, false);
+  Command c = args.command();
+  long sink = static_cast<long>(c) + static_cast<long>(args.tag());
+  int x;
+  switch (c) {
+    case Command::Send:
+      args.integer(x);
+      sink += x + static_cast<long>(args.rest().size());
+      break;
+    case Command::Login:
+    case Command::Register:
+    case Command::GetUserId:
+      sink += static_cast<long>(args.word().size() + args.word().size());
+      break;
+    case Command::CreateChat:
+      args.integer(x);
+      sink += x + static_cast<long>(args.word().size());
+      while (args.integer(x)) sink += x;
+      break;
+    default:
+      while (args.integer(x)) sink += x;
+      break;
+  }
+  return sink;
+}
+
+long parseOld(const std::string& line) {
+  std::istringstream iss(line);
+  std::string cmd;
+  iss >> cmd;
+  long sink = 0;
+  if (!cmd.empty() && cmd[0] == '#') {
+    sink += std::atol(cmd.c_str() + 1);
+    iss >> cmd;
+  }
+  int x;
+  if (cmd == "SEND") {
+    std::string text;
+    iss >> x;
+    std::getline(iss, text);
+    sink += x + static_cast<long>(text.size());
+  } else if (cmd == "LOGIN" || cmd == "REGISTER" || cmd == "GET_USER_ID") {
+    std::string a, b;
+    iss >> a >> b;
+    sink += static_cast<long>(a.size() + b.size());
+  } else if (cmd == "CREATE_CHAT") {
+    std::string name;
+    iss >> x >> name;
+    sink += x + static_cast<long>(name.size());
+    while (iss >> x) sink += x;
+  } else if (cmd == "HISTORY" || cmd == "DELETE" || cmd == "DELETE_GLOBAL" || cmd == "LEAVE_CHAT"
+             || cmd == "LIST_CHATS") {
+    while (iss >> x) sink += x;
+  }
+  return sink;
+}
+
+template <class F>
+void run(const char* name, F parse) {
+  size_t a0 = allocations;
+  long sink = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < COMMANDS; ++i) sink += parse(MIX[i % MIX.size()]);
+  double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  std::printf("%-26s %6.1f Mcmd/s %8.3f allocs/cmd  (%ld)\n", name, COMMANDS / s / 1e6,
+              double(allocations - a0) / COMMANDS, sink & 1);
+}
+
+} // namespace
+
+int main() {
+  run("CommandArgs + lookup", [](const std::string& l) { return parseNew(l); });
+  run("istringstream + if/else", [](const std::string& l) { return parseOld(l); });
+  return 0;
+}
@@ -0,0 +1,107 @@
+//Разбор входного потока на строки: LineBuffer против прежнего способа
+//(std::string + find('\n') + substr + erase на каждую строку)
+//
+//  make bench && bench/line_buffer_bench
+//Для каждого набора данных — пропускная способность, строк в секунду и выделений памяти на строку
+#include "../src/line_buffer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+
+//Считаем выделения памяти во всей программе
+static size_t allocations = 0;
+void* operator new(size_t n) {
+  allocations++;
+  if (void* p = std::malloc(n ? n : 1)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+const int PASSES = 20;
+const size_t MAX_LINE = 64 * 1024;
+
+struct Result {
+  double seconds;
+  size_t lines;
+  size_t allocs;
+};
+
+//Поток приходит кусками по chunk байт, как из read()
+Result runLineBuffer(const std::string& in, size_t chunk) {
+  size_t lines = 0, bytes = 0, a0 = allocations;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < PASSES; ++pass) {
+    LineBuffer b(MAX_LINE);
+    for (size_t off = 0; off < in.size(); off += chunk) {
+      size_t n = std::min(chunk, in.size() - off);
+      std::memcpy(b.prepare(n), in.data() + off, n);
+      b.commit(n);
+      std::string_view line;
+      while (b.next(line)) {
+        lines++;
+        bytes += line.size();
+      }
+    }
+  }
+  double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  if (bytes == 0 && lines > 0) std::puts(""); //не даём выбросить разбор
+  return {s, lines, allocations - a0};
+}
+
+Result runStringErase(const std::string& in, size_t chunk) {
+  size_t lines = 0, bytes = 0, a0 = allocations;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < PASSES; ++pass) {
+    std::string b;
+    for (size_t off = 0; off < in.size(); off += chunk) {
+      b.append(in.data() + off, std::min(chunk, in.size() - off));
+      size_t pos;
+      while ((pos = b.find('\n')) != std::string::npos) {
+        std::string line = b.substr(0, pos);
+        b.erase(0, pos + 1);
+        lines++;
+        bytes += line.size();
+      }
+    }
+  }
+  double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  if (bytes == 0 && lines > 0) std::puts("");
+  return {s, lines, allocations - a0};
+}
+
+void report(const char* name, const char* impl, const std::string& in, const Result& r) {
+  std::printf("%-24s %-14s %8.0f MB/s %8.1f Mlines/s %8.3f allocs/line\n", name, impl,
+              double(PASSES) * in.size() / r.seconds / 1e6, r.lines / r.seconds / 1e6,
+              r.lines ? double(r.allocs) / r.lines : 0.0);
+}
+
+void compare(const char* name, const std::string& in, size_t chunk) {
+  report(name, "LineBuffer", in, runLineBuffer(in, chunk));
+  report(name, "string+erase", in, runStringErase(in, chunk));
+}
+
+} // namespace
+
+int main() {
+  std::string typical;
+  for (int i = 0; i < 200000; ++i) typical += "SEND 42 hello world message number " + std::to_string(i) + "\n";
+  std::string tiny;
+  for (int i = 0; i < 2000000; ++i) tiny += "A\n";
+  std::string longLines;
+  for (int i = 0; i < 400; ++i) longLines += std::string(60000, 'x') + "\n";
+
+  compare("typical SEND, 16K reads", typical, 16384);
+  compare("2-byte lines, 16K reads", tiny, 16384);
+  compare("60K lines, 16K reads", longLines, 16384);
+  //Враждебный случай: длинная строка приходит по байту
+  compare("60K lines, 1B reads", longLines.substr(0, 600000), 1);
+  return 0;
+}
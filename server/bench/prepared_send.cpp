@@ -0,0 +1,127 @@
+//Задержка записи SEND в БД: один и тот же запрос без подготовки (PQexecParams — Postgres каждый раз
+//разбирает и планирует его) и подготовленный (PQprepare один раз, дальше PQexecPrepared)
+//
+//Запускать против тестовой базы со схемой sql/init_schema.sql:
+//  make bench && bench/prepared_send "host=... dbname=... user=... password=..." [итераций]
+//Пользователь, чат и сообщения создаются в одной транзакции, которая в конце откатывается, —
+//в базе ничего не остаётся (кроме сдвинутых последовательностей)
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <postgresql/libpq-fe.h>
+
+namespace {
+
+//Тот же запрос, что messages_store_batch в db.cpp (SEND идёт через него пачкой из одной строки)
+const char* SEND_SQL = R"(
+    WITH b AS (
+      SELECT nextval(pg_get_serial_sequence('messages', 'msg_id'))::int4 AS msg_id,
+             t.ord::int4 AS ord, t.chat_id, t.sender_id, t.content
+        FROM unnest($1::int4[], $2::int4[], $3::text[])
+             WITH ORDINALITY AS t(chat_id, sender_id, content, ord)
+       WHERE EXISTS (SELECT 1 FROM chat_members m
+                      WHERE m.chat_id = t.chat_id AND m.user_id = t.sender_id)
+       ORDER BY t.ord
+    ), ins AS (
+      INSERT INTO messages(msg_id, chat_id, sender_id, content)
+      SELECT msg_id, chat_id, sender_id, content FROM b
+    )
+    SELECT b.ord, b.msg_id, u.username
+      FROM b JOIN users u ON u.user_id = b.sender_id
+  )";
+
+[[noreturn]] void fail(PGconn* conn, const char* what) {
+  std::fprintf(stderr, "%s: %s", what, PQerrorMessage(conn));
+  PQfinish(conn);
+  std::exit(1);
+}
+
+//Выполняет служебный запрос и возвращает первое поле первой строки (или пустую строку)
+std::string execScalar(PGconn* conn, const char* sql) {
+  PGresult* r = PQexec(conn, sql);
+  ExecStatusType st = PQresultStatus(r);
+  if (st != PGRES_TUPLES_OK && st != PGRES_COMMAND_OK) {
+    PQclear(r);
+    fail(conn, sql);
+  }
+  std::string v = (st == PGRES_TUPLES_OK && PQntuples(r) > 0) ? PQgetvalue(r, 0, 0) : "";
+  PQclear(r);
+  return v;
+}
+
+void checkRow(PGconn* conn, PGresult* r) {
+  bool ok = PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) == 1;
+  PQclear(r);
+  if (!ok) fail(conn, "SEND");
+}
+
+void report(const char* name, std::vector<double>& us) {
+  std::sort(us.begin(), us.end());
+  double sum = 0;
+  for (double x : us) sum += x;
+  auto pct = [&](double p) { return us[std::min(us.size() - 1, static_cast<size_t>(p * us.size()))]; };
+  std::printf("%-12s mean %8.1f us   p50 %8.1f   p90 %8.1f   p99 %8.1f\n",
+              name, sum / us.size(), pct(0.50), pct(0.90), pct(0.99));
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "usage: %s <conninfo> [iterations]\n", argv[0]);
+    return 2;
+  }
+  int iterations = argc > 2 ? std::atoi(argv[2]) : 5000;
+  if (iterations < 1) iterations = 1;
+  const int warmup = 100;
+
+  PGconn* conn = PQconnectdb(argv[1]);
+  if (PQstatus(conn) != CONNECTION_OK) fail(conn, "connect");
+
+  execScalar(conn, "BEGIN");
+  std::string user = execScalar(conn,
+    "INSERT INTO users(username, password_hash) VALUES('bench_' || pg_backend_pid(), 'x') RETURNING user_id");
+  std::string chat = execScalar(conn,
+    "INSERT INTO chats(is_group, chat_name) VALUES(FALSE, NULL) RETURNING chat_id");
+  std::string member = "INSERT INTO chat_members(chat_id, user_id) VALUES(" + chat + ", " + user + ")";
+  execScalar(conn, member.c_str());
+
+  //Параметры в текстовом виде в обоих вариантах — различие только в подготовке запроса
+  std::string chats = "{" + chat + "}", senders = "{" + user + "}";
+  std::string text = "{\"hello from the prepared statement benchmark\"}";
+  const char* values[3] = {chats.c_str(), senders.c_str(), text.c_str()};
+  const Oid types[3] = {1007, 1007, 1009}; //int4[], int4[], text[]
+
+  PGresult* prep = PQprepare(conn, "bench_send", SEND_SQL, 3, types);
+  if (PQresultStatus(prep) != PGRES_COMMAND_OK) {
+    PQclear(prep);
+    fail(conn, "PQprepare");
+  }
+  PQclear(prep);
+
+  //Варианты чередуются на каждой итерации, чтобы дрейф нагрузки на сервере делился поровну
+  std::vector<double> adHoc, prepared;
+  adHoc.reserve(iterations);
+  prepared.reserve(iterations);
+  for (int i = 0; i < warmup + iterations; ++i) {
+    auto t0 = std::chrono::steady_clock::now();
+    checkRow(conn, PQexecParams(conn, SEND_SQL, 3, types, values, nullptr, nullptr, 0));
+    auto t1 = std::chrono::steady_clock::now();
+    checkRow(conn, PQexecPrepared(conn, "bench_send", 3, values, nullptr, nullptr, 0));
+    auto t2 = std::chrono::steady_clock::now();
+    if (i < warmup) continue;
+    adHoc.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+    prepared.push_back(std::chrono::duration<double, std::micro>(t2 - t1).count());
+  }
+
+  execScalar(conn, "ROLLBACK");
+  PQfinish(conn);
+
+  std::printf("SEND round trip, %d iterations each (after %d warm-up)\n", iterations, warmup);
+  report("unprepared", adHoc);
+  report("prepared", prepared);
+  return 0;
+}
@@ -0,0 +1,138 @@
+#include "command.h"
+#include "varint.h"
+
+#include <charconv>
+#include <climits>
+#include <iterator>
+
+namespace {
+
+struct CommandName {
+  std::string_view name;
+  Command cmd;
+};
+
+constexpr CommandName COMMANDS[] = {
+  {"REGISTER", Command::Register},
+  {"LOGIN", Command::Login},
+  {"LIST_CHATS", Command::ListChats},
+  {"CREATE_CHAT", Command::CreateChat},
+  {"SEND", Command::Send},
+  {"HISTORY", Command::History},
+  {"DELETE", Command::Delete},
+  {"DELETE_GLOBAL", Command::DeleteGlobal},
+  {"LEAVE_CHAT", Command::LeaveChat},
+  {"GET_USER_ID", Command::GetUserId},
+  {"PROTO", Command::Proto},
+  {"COMPRESS", Command::Compress},
+};
+
+constexpr size_t TABLE_SIZE = 32;
+
+//Длина и второй символ различают все имена команд (LIST_CHATS/LEAVE_CHAT, CREATE_CHAT/GET_USER_ID и т.д.)
+constexpr size_t hashName(std::string_view name) {
+  return (name.size() * 18 + static_cast<unsigned char>(name[1])) % TABLE_SIZE;
+}
+
+//Ячейка хранит номер в COMMANDS + 1, 0 — пусто
+struct Table {
+  uint8_t slots[TABLE_SIZE] = {};
+  bool collision = false;
+};
+
+constexpr Table buildTable() {
+  Table t;
+  for (size_t i = 0; i < std::size(COMMANDS); ++i) {
+    size_t h = hashName(COMMANDS[i].name);
+    if (t.slots[h] != 0) t.collision = true;
+    t.slots[h] = static_cast<uint8_t>(i + 1);
+  }
+  return t;
+}
+
+constexpr Table TABLE = buildTable();
+static_assert(!TABLE.collision, "hashName is not perfect for the command set");
+
+}  // namespace
+
+Command lookupCommand(std::string_view name) {
+  if (name.size() < 2) return Command::Unknown;
+  uint8_t slot = TABLE.slots[hashName(name)];
+  if (slot == 0) return Command::Unknown;
+  //Хеш совершенен только на известных именах — чужое слово сверяем с найденным
+  const CommandName& c = COMMANDS[slot - 1];
+  return c.name == name ? c.cmd : Command::Unknown;
+}
+
+Command CommandArgs::command() {
+  if (!binary) {
+    std::string_view name = word();
+    if (!name.empty() && name[0] == '#') {
+      //"#<тег>" перед именем команды
+      uint64_t v = 0;
+      auto [p, ec] = std::from_chars(name.data() + 1, name.data() + name.size(), v);
+      if (name.size() < 2 || ec != std::errc() || p != name.data() + name.size()) return Command::Unknown;
+      hasTag = true;
+      tagValue = v;
+      name = word();
+    }
+    return lookupCommand(name);
+  }
+  if (pos >= s.size()) return Command::Unknown;
+  uint8_t code = static_cast<uint8_t>(s[pos++]);
+  if (code & TAG_FLAG) {
+    uint64_t v = 0;
+    if (!getVarint(s, pos, v)) return Command::Unknown;
+    hasTag = true;
+    tagValue = v;
+    code &= ~TAG_FLAG;
+  }
+  return code < static_cast<uint8_t>(Command::Count) ? static_cast<Command>(code) : Command::Unknown;
+}
+
+void CommandArgs::skipSpaces() {
+  while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t')) ++pos;
+}
+
+std::string_view CommandArgs::word() {
+  if (binary) {
+    uint64_t len = 0;
+    size_t p = pos;
+    if (!getVarint(s, p, len) || len > s.size() - p) {
+      pos = s.size(); //битое поле — дальше читать нечего
+      return {};
+    }
+    pos = p + len;
+    return s.substr(p, len);
+  }
+  skipSpaces();
+  size_t start = pos;
+  while (pos < s.size() && s[pos] != ' ' && s[pos] != '\t') ++pos;
+  return s.substr(start, pos - start);
+}
+
+std::string_view CommandArgs::rest() {
+  if (binary) return word();
+  return s.substr(pos);
+}
+
+bool CommandArgs::integer(int& out) {
+  if (binary) {
+    uint64_t v = 0;
+    size_t p = pos;
+    if (!getVarint(s, p, v) || v > static_cast<uint64_t>(INT_MAX)) return false;
+    pos = p;
+    out = static_cast<int>(v);
+    return true;
+  }
+  size_t saved = pos;
+  std::string_view w = word();
+  int v = 0;
+  auto [p, ec] = std::from_chars(w.data(), w.data() + w.size(), v);
+  if (w.empty() || ec != std::errc() || p != w.data() + w.size()) {
+    pos = saved;
+    return false;
+  }
+  out = v;
+  return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+//Команды клиентского протокола
+//Числовые значения — коды команд бинарного протокола, поэтому существующие не перенумеровываются
+enum class Command : uint8_t {
+    Unknown,
+    Register,
+    Login,
+    ListChats,
+    CreateChat,
+    Send,
+    History,
+    Delete,
+    DeleteGlobal,
+    LeaveChat,
+    GetUserId,
+    Proto,
+    Compress,
+    Count
+};
+
+//Старший бит кода команды (и типа ответа) в кадре: за ним идёт varint-тег запроса
+constexpr uint8_t TAG_FLAG = 0x80;
+
+//Команда по её имени: совершенный хеш по длине и второму символу, таблица строится при компиляции
+Command lookupCommand(std::string_view name);
+
+//Разбор команды прямо по данным из входного буфера, без копий и выделений памяти
+//Возвращаемые string_view указывают в исходную строку/кадр
+//
+//Текстовый протокол: имя команды и токены через пробелы/табуляции
+//Бинарный: кадр <u8 код Command><поля>, число — varint, строка — varint-длина и байты;
+//поля идут в том же порядке, что и токены текстовой команды, поэтому обработчики общие
+//
+//Тег запроса (необязательный) сервер повторяет в ответе: текстом — "#<тег> КОМАНДА ...",
+//в кадре — старший бит кода команды и varint-тег сразу за кодом
+class CommandArgs {
+public:
+    CommandArgs(std::string_view data, bool binary) : s(data), binary(binary) {}
+
+    //Команда: имя в начале строки или код в первом байте кадра (тег, если есть, снимается)
+    Command command();
+    //Был ли у команды тег запроса и его значение (после command())
+    bool tagged() const { return hasTag; }
+    uint64_t tag() const { return tagValue; }
+    //Следующее слово (строковое поле); пустое — слова больше нет
+    std::string_view word();
+    //Следующее слово как целое; false — слова нет или это не число (тогда оно не снимается)
+    bool integer(int& out);
+    //Текст до конца команды: в текстовом протоколе всё, что осталось после последнего
+    //разобранного токена, как есть (с ведущим пробелом); в бинарном — очередное строковое поле
+    std::string_view rest();
+
+private:
+    void skipSpaces();
+
+    std::string_view s;
+    bool binary;
+    size_t pos = 0;
+    bool hasTag = false;
+    uint64_t tagValue = 0;
+};
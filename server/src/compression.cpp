@@ -0,0 +1,64 @@
+#include "compression.h"
+#include "varint.h"
+
+#include <zlib.h>
+
+#include <chrono>
+
+namespace {
+
+std::atomic<uint64_t> messages{0};
+std::atomic<uint64_t> skipped{0};
+std::atomic<uint64_t> rawBytes{0};
+std::atomic<uint64_t> compressedBytes{0};
+std::atomic<uint64_t> cpuUs{0};
+
+//Заголовок блока: маркер и varint-длина, 4 байта исходной длины
+constexpr size_t HEADER_MAX = 1 + VARINT_MAX_BYTES + 4;
+
+}  // namespace
+
+bool compressMessage(std::string_view msg, int level, std::string& out) {
+  auto start = std::chrono::steady_clock::now();
+
+  //Сжимаем сразу на место после заголовка максимальной длины, заголовок ставим вплотную потом
+  uLongf zlen = compressBound(msg.size());
+  std::string buf(HEADER_MAX + zlen, '\0');
+  int rc = compress2(reinterpret_cast<Bytef*>(&buf[HEADER_MAX]), &zlen,
+                     reinterpret_cast<const Bytef*>(msg.data()), msg.size(), level);
+
+  cpuUs += std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  if (rc != Z_OK || zlen + HEADER_MAX >= msg.size()) {
+    skipped++;
+    return false;
+  }
+
+  std::string head(1, '\0');
+  putVarint(head, 4 + zlen);
+  uint32_t n = static_cast<uint32_t>(msg.size());
+  head.push_back(static_cast<char>(n >> 24));
+  head.push_back(static_cast<char>(n >> 16));
+  head.push_back(static_cast<char>(n >> 8));
+  head.push_back(static_cast<char>(n));
+  size_t from = HEADER_MAX - head.size();
+  buf.replace(from, head.size(), head);
+  buf.erase(0, from);
+  buf.resize(head.size() + zlen);
+
+  messages++;
+  rawBytes += msg.size();
+  compressedBytes += buf.size();
+  out = std::move(buf);
+  return true;
+}
+
+CompressionStats compressionStats() {
+  CompressionStats st;
+  st.messages = messages.load();
+  st.skipped = skipped.load();
+  st.rawBytes = rawBytes.load();
+  st.compressedBytes = compressedBytes.load();
+  st.cpuUs = cpuUs.load();
+  return st;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+//Сжатие крупных ответов сервера (COMPRESS ZLIB)
+//
+//Сжатый блок заменяет одно сообщение целиком (строку текстового протокола с '\n' или кадр):
+//  0x00 <varint n> <n байт: u32 big-endian длина исходного, поток zlib>
+//Ни строка, ни кадр с нулевого байта не начинаются, поэтому клиент отличает блок по первому байту;
+//содержимое n байт — ровно формат qCompress/qUncompress Qt
+//Каждый блок сжимается отдельно: состояние deflate на соединение (сотни КБ) простаивающим
+//клиентам держать не нужно
+
+//Метрики для STATS
+struct CompressionStats {
+    uint64_t messages = 0; //сжато сообщений
+    uint64_t skipped = 0; //сжатие не дало выигрыша — ушли как есть
+    uint64_t rawBytes = 0; //их исходный размер
+    uint64_t compressedBytes = 0; //размер отправленных блоков
+    uint64_t cpuUs = 0; //время в compress2
+};
+
+//Сжимает msg с уровнем level (1..9) в блок; false — блок не меньше исходного, out не тронут
+bool compressMessage(std::string_view msg, int level, std::string& out);
+
+CompressionStats compressionStats();
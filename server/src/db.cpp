@@ -1,527 +1,910 @@
 #include "db.h"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <coroutine>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <sstream>
+#include <string>
+#include <utility>
+
+namespace {
+
+//OID типов PostgreSQL для параметров подготовленных запросов (см. pg_type)
+constexpr Oid BOOL_OID = 16;
+constexpr Oid INT4_OID = 23;
+constexpr Oid TEXT_OID = 25;
+constexpr Oid TEXT_ARRAY_OID = 1009;
+constexpr Oid INT4_ARRAY_OID = 1007;
+
+//Описание подготовленного запроса: имя, текст и типы параметров
+struct Statement {
+  const char* name;
+  const char* sql;
+  int nParams;
+  Oid types[4];
+};
+
+//Все запросы Database; готовятся один раз на каждом неблокирующем соединении (PQprepare)
+//После этого Postgres не разбирает и не планирует их заново на каждый вызов
+const Statement STATEMENTS[] = {
+  {"user_exists",
+    "SELECT 1 FROM users WHERE username = $1",
+    1, {TEXT_OID}},
+  {"user_insert",
+    "INSERT INTO users(username, password_hash) VALUES($1, $2) RETURNING user_id",
+    2, {TEXT_OID, TEXT_OID}},
+  {"user_auth",
+    "SELECT user_id FROM users WHERE username=$1 AND password_hash=$2",
+    2, {TEXT_OID, TEXT_OID}},
+  //ищем чат, в котором оба пользователя и is_group = false
+  {"chat_find_private", R"(
+      SELECT c.chat_id
+        FROM chats c
+        JOIN chat_members m1 ON c.chat_id = m1.chat_id AND m1.user_id = $1
+        JOIN chat_members m2 ON c.chat_id = m2.chat_id AND m2.user_id = $2
+      WHERE c.is_group = FALSE
+      GROUP BY c.chat_id
+    )",
+    2, {INT4_OID, INT4_OID}},
+  //групповая вставка пачки сообщений (group commit): одна транзакция на всю пачку
+  //строки пачки пронумерованы (ord); сообщение пишется, только если отправитель состоит в чате
+  //msg_id выдаём заранее в порядке ord, чтобы порядок внутри чата совпадал с порядком отправки
+  //возвращаем ord, msg_id и имя отправителя; отсутствующий ord — отправитель не в чате
+  {"messages_store_batch", R"(
+      WITH b AS (
+        SELECT nextval(pg_get_serial_sequence('messages', 'msg_id'))::int4 AS msg_id,
+               t.ord::int4 AS ord, t.chat_id, t.sender_id, t.content
+          FROM unnest($1::int4[], $2::int4[], $3::text[])
+               WITH ORDINALITY AS t(chat_id, sender_id, content, ord)
+         WHERE EXISTS (SELECT 1 FROM chat_members m
+                        WHERE m.chat_id = t.chat_id AND m.user_id = t.sender_id)
+         ORDER BY t.ord
+      ), ins AS (
+        INSERT INTO messages(msg_id, chat_id, sender_id, content)
+        SELECT msg_id, chat_id, sender_id, content FROM b
+      )
+      SELECT b.ord, b.msg_id, u.username
+        FROM b JOIN users u ON u.user_id = b.sender_id
+    )",
+    3, {INT4_ARRAY_OID, INT4_ARRAY_OID, TEXT_ARRAY_OID}},
+  //новый чат вместе с участниками — один запрос, а значит, и одна транзакция
+  //несуществующих участников и повторы пропускаем; строка на каждого добавленного
+  //(user_id NULL — никого не добавили), в каждой chat_id нового чата
+  {"chat_create_with_members", R"(
+      WITH c AS (
+        INSERT INTO chats(is_group, chat_name) VALUES($1, $2) RETURNING chat_id
+      ), m AS (
+        INSERT INTO chat_members(chat_id, user_id)
+        SELECT DISTINCT c.chat_id, u.user_id
+          FROM c, unnest($3::int4[]) AS x(user_id)
+          JOIN users u ON u.user_id = x.user_id
+        ON CONFLICT DO NOTHING
+        RETURNING user_id
+      )
+      SELECT c.chat_id, m.user_id FROM c LEFT JOIN m ON TRUE
+    )",
+    3, {BOOL_OID, TEXT_OID, INT4_ARRAY_OID}},
+  //полный состав чата и полный список чатов пользователя — для индекса участия в памяти
+  {"chat_member_ids",
+    "SELECT user_id FROM chat_members WHERE chat_id=$1",
+    1, {INT4_OID}},
+  {"user_chat_ids",
+    "SELECT chat_id FROM chat_members WHERE user_id=$1",
+    1, {INT4_OID}},
+  //глобальное удаление только своим автором; возвращает чат сообщения
+  {"message_delete_own",
+    "UPDATE messages SET deleted = TRUE WHERE msg_id = $1 AND sender_id = $2 RETURNING chat_id",
+    2, {INT4_OID, INT4_OID}},
+  {"message_sender",
+    "SELECT sender_id FROM messages WHERE msg_id=$1",
+    1, {INT4_OID}},
+  //не ломаем сервер при попытке дважды удалить одно и то же сообщение
+  {"message_hide",
+    "INSERT INTO user_deleted_messages(msg_id, user_id) VALUES($1, $2) ON CONFLICT DO NOTHING",
+    2, {INT4_OID, INT4_OID}},
+  {"user_id_by_name",
+    "SELECT user_id FROM users WHERE username=$1",
+    1, {TEXT_OID}},
+  //Сводка по всем чатам пользователя одним запросом (LIST_CHATS):
+  //участники через запятую, последнее сообщение (автор и начало текста) и число непрочитанных
+  //Непрочитанные — чужие сообщения после last_read_msg_id, счёт ограничен $2, чтобы не зависеть от размера чата
+  {"user_chat_summaries", R"(
+      SELECT c.chat_id, c.is_group, c.chat_name,
+             mem.names,
+             COALESCE(lm.username, ''),
+             COALESCE(lm.preview, ''),
+             ur.unread
+        FROM chat_members me
+        JOIN chats c ON c.chat_id = me.chat_id
+        CROSS JOIN LATERAL (
+          SELECT string_agg(u.username, ',' ORDER BY u.username) AS names
+            FROM chat_members cm
+            JOIN users u ON u.user_id = cm.user_id
+           WHERE cm.chat_id = c.chat_id
+        ) mem
+        LEFT JOIN LATERAL (
+          SELECT m.created_at, m.msg_id, u.username, left(m.content, 64) AS preview
+            FROM messages m
+            JOIN users u ON u.user_id = m.sender_id
+           WHERE m.chat_id = c.chat_id AND NOT m.deleted
+           ORDER BY m.msg_id DESC
+           LIMIT 1
+        ) lm ON true
+        CROSS JOIN LATERAL (
+          SELECT count(*)::int4 AS unread
+            FROM (SELECT 1
+                    FROM messages m
+                   WHERE m.chat_id = c.chat_id
+                     AND m.msg_id > me.last_read_msg_id
+                     AND m.sender_id <> me.user_id
+                     AND NOT m.deleted
+                   LIMIT $2) x
+        ) ur
+       WHERE me.user_id = $1
+       ORDER BY lm.created_at DESC NULLS LAST, lm.msg_id DESC NULLS LAST, c.chat_id
+    )",
+    2, {INT4_OID, INT4_OID}},
+  //Сдвигает отметку прочитанного вперёд (назад не двигаем)
+  {"member_mark_read", R"(
+      UPDATE chat_members
+         SET last_read_msg_id = GREATEST(last_read_msg_id, $3)
+       WHERE chat_id = $1 AND user_id = $2
+    )",
+    3, {INT4_OID, INT4_OID, INT4_OID}},
+  {"username_by_id",
+    "SELECT username FROM users WHERE user_id=$1",
+    1, {INT4_OID}},
+  {"message_chat",
+    "SELECT chat_id FROM messages WHERE msg_id=$1",
+    1, {INT4_OID}},
+  {"member_remove",
+    "DELETE FROM chat_members WHERE chat_id=$1 AND user_id=$2",
+    2, {INT4_OID, INT4_OID}},
+  //событие участника — только пока он ещё в чате; FOR UPDATE держит строку до конца транзакции,
+  //поэтому параллельный выход того же участника дождётся её и события уже не запишет
+  {"member_event_insert", R"(
+      INSERT INTO chat_events(chat_id, user_id, event_type, event_ts)
+      SELECT $1, $2, $3, now()
+       WHERE EXISTS (SELECT 1 FROM chat_members
+                      WHERE chat_id = $1 AND user_id = $2
+                        FOR UPDATE)
+    )",
+    3, {INT4_OID, INT4_OID, TEXT_OID}},
+  //Страница истории (keyset pagination): самые новые сообщения, от новых к старым
+  //Порядок ленты — msg_id: его выдаёт group commit в порядке отправки, и по нему же упорядочено
+  //кольцо HistoryCache (created_at у пачек из разных потоков может идти в другом порядке)
+  //LIMIT идёт по индексу (chat_id, msg_id), поэтому цена не зависит от размера чата
+  //LEFT JOIN — чтобы взять и сообщения без записи в user_deleted_messages (пользователь их не скрывал)
+  {"chat_history_latest", R"(
+      SELECT
+        m.msg_id,
+        to_char(m.created_at,'YYYY-MM-DD HH24:MI') AS ts,
+        u.username,
+        m.content
+      FROM messages m
+      JOIN users u
+        ON m.sender_id = u.user_id
+      LEFT JOIN user_deleted_messages d
+        ON d.msg_id = m.msg_id AND d.user_id = $2
+      WHERE m.chat_id = $1
+        AND NOT m.deleted
+        AND d.msg_id IS NULL
+      ORDER BY m.msg_id DESC
+      LIMIT $3
+    )",
+    3, {INT4_OID, INT4_OID, INT4_OID}},
+  //То же, но строго раньше сообщения-курсора $3
+  //Курсор из другого чата даёт пустую страницу
+  {"chat_history_before", R"(
+      SELECT
+        m.msg_id,
+        to_char(m.created_at,'YYYY-MM-DD HH24:MI') AS ts,
+        u.username,
+        m.content
+      FROM messages m
+      JOIN users u
+        ON m.sender_id = u.user_id
+      LEFT JOIN user_deleted_messages d
+        ON d.msg_id = m.msg_id AND d.user_id = $2
+      WHERE m.chat_id = $1
+        AND m.msg_id < $3
+        AND EXISTS (SELECT 1 FROM messages c WHERE c.msg_id = $3 AND c.chat_id = $1)
+        AND NOT m.deleted
+        AND d.msg_id IS NULL
+      ORDER BY m.msg_id DESC
+      LIMIT $4
+    )",
+    4, {INT4_OID, INT4_OID, INT4_OID, INT4_OID}},
+  //Хвост чата для кэша истории: последние $2 сообщений без фильтра по пользователю,
+  //но со списком тех, кто скрыл сообщение у себя, — фильтрует уже кэш
+  {"chat_tail", R"(
+      SELECT
+        m.msg_id,
+        to_char(m.created_at,'YYYY-MM-DD HH24:MI') AS ts,
+        u.username,
+        m.content,
+        COALESCE((SELECT array_agg(d.user_id) FROM user_deleted_messages d WHERE d.msg_id = m.msg_id),
+                 '{}'::int4[])
+      FROM messages m
+      JOIN users u
+        ON m.sender_id = u.user_id
+      WHERE m.chat_id = $1
+        AND NOT m.deleted
+      ORDER BY m.msg_id DESC
+      LIMIT $2
+    )",
+    2, {INT4_OID, INT4_OID}},
+  //События между двумя сообщениями: [время $2, время $3); несуществующий msg_id (0) — без границы
+  {"chat_events_between", R"(
+      SELECT
+        to_char(event_ts,'YYYY-MM-DD HH24:MI'),
+        user_id,
+        event_type
+      FROM chat_events
+      WHERE chat_id = $1
+        AND event_ts >= COALESCE((SELECT created_at::timestamp FROM messages WHERE msg_id = $2), '-infinity')
+        AND event_ts <  COALESCE((SELECT created_at::timestamp FROM messages WHERE msg_id = $3), 'infinity')
+      ORDER BY event_ts
+    )",
+    3, {INT4_OID, INT4_OID, INT4_OID}},
+};
+
+//Параметры подготовленного запроса
+//Целые передаются в двоичном виде (int4, сетевой порядок байт) — без to_string/ostringstream
+class Params {
+public:
+  //values указывают внутрь самого объекта, поэтому копировать его нельзя
+  Params() = default;
+  Params(const Params&) = delete;
+  Params& operator=(const Params&) = delete;
+
+  Params& addInt(int v) {
+    ints[n] = htonl(static_cast<uint32_t>(v));
+    values[n] = reinterpret_cast<const char*>(&ints[n]);
+    lengths[n] = sizeof(uint32_t);
+    formats[n] = 1;
+    ++n;
+    return *this;
+  }
+  Params& addBool(bool v) {
+    bools[n] = v ? 1 : 0;
+    values[n] = &bools[n];
+    lengths[n] = 1;
+    formats[n] = 1;
+    ++n;
+    return *this;
+  }
+  //Текст идёт в текстовом формате; nullptr — SQL NULL
+  Params& addText(const char* s) {
+    values[n] = s;
+    lengths[n] = 0;
+    formats[n] = 0;
+    ++n;
+    return *this;
+  }
+  Params& addText(const std::string& s) { return addText(s.c_str()); }
+  //Одномерные массивы int4[] и text[] в двоичном формате
+  Params& addIntArray(const std::vector<int>& v) {
+    std::string& buf = beginArray(INT4_OID, v.size());
+    for (int x : v) {
+      put(buf, sizeof(uint32_t));
+      put(buf, static_cast<uint32_t>(x));
+    }
+    return endArray();
+  }
+  Params& addTextArray(const std::vector<const std::string*>& v) {
+    std::string& buf = beginArray(TEXT_OID, v.size());
+    for (const std::string* x : v) {
+      put(buf, static_cast<uint32_t>(x->size()));
+      buf += *x;
+    }
+    return endArray();
+  }
+
+  //Выполняет подготовленный запрос через неблокирующее соединение: результат ждёт сопрограмма (co_await),
+  //а не поток; все столбцы результата приходят в двоичном формате
+  //Params должен жить до получения ответа — временный объект в выражении co_await живёт
+  Task<PGresult*> exec(AsyncPgPool::Lease& lease, const char* stmt) const {
+    return lease.exec(stmt, n, values, lengths, formats);
+  }
+
+  //Запрос для пакета AsyncPgPool::Lease::execPipeline; Params должен жить до получения ответа
+  AsyncPgPool::Lease::Query query(const char* stmt) const {
+    return {stmt, n, values, lengths, formats};
+  }
+
+private:
+  static void put(std::string& buf, uint32_t x) {
+    uint32_t be = htonl(x);
+    buf.append(reinterpret_cast<const char*>(&be), sizeof(be));
+  }
+  //Заголовок массива: одно измерение, без NULL, тип элементов, длина, нижняя граница 1
+  std::string& beginArray(Oid elemType, size_t count) {
+    std::string& buf = arrays[n];
+    buf.clear();
+    put(buf, 1);
+    put(buf, 0);
+    put(buf, elemType);
+    put(buf, static_cast<uint32_t>(count));
+    put(buf, 1);
+    return buf;
+  }
+  Params& endArray() {
+    values[n] = arrays[n].data();
+    lengths[n] = static_cast<int>(arrays[n].size());
+    formats[n] = 1;
+    ++n;
+    return *this;
+  }
+
+  static constexpr int MAX = 4;
+  const char* values[MAX] = {};
+  int lengths[MAX] = {};
+  int formats[MAX] = {};
+  uint32_t ints[MAX] = {};
+  char bools[MAX] = {};
+  std::string arrays[MAX];
+  int n = 0;
+};
+
+//Разбор двоичных значений результата
+int getInt(const PGresult* r, int row, int col) {
+  uint32_t v;
+  std::memcpy(&v, PQgetvalue(r, row, col), sizeof(v));
+  return static_cast<int>(ntohl(v));
+}
+
+bool getBool(const PGresult* r, int row, int col) {
+  return PQgetvalue(r, row, col)[0] != 0;
+}
 
+std::string getText(const PGresult* r, int row, int col) {
+  return std::string(PQgetvalue(r, row, col), PQgetlength(r, row, col));
+}
 
-Database::Database(const std::string& conninfo) {
-  //открываем соединение с базой
-  conn = PQconnectdb(conninfo.c_str());
-  if (PQstatus(conn) != CONNECTION_OK) {
-    std::cerr << "Ошибка подключения к БД: " << PQerrorMessage(conn);
-    std::exit(1);
+//Одномерный int4[] в двоичном формате (без NULL-элементов)
+std::vector<int> getIntArray(const PGresult* r, int row, int col) {
+  auto word = [](const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+  };
+  std::vector<int> out;
+  const char* p = PQgetvalue(r, row, col);
+  if (PQgetlength(r, row, col) < 12 || word(p) == 0) return out; //пустой массив: ndim = 0
+  uint32_t count = word(p + 12);
+  p += 20; //ndim, флаг NULL, тип, длина и нижняя граница измерения
+  out.reserve(count);
+  for (uint32_t i = 0; i < count; ++i, p += 8) {
+    out.push_back(static_cast<int>(word(p + 4))); //длина элемента (4) и само значение
   }
+  return out;
+}
+
+//Один целочисленный столбец из единственной строки или -1
+int singleInt(PGresult* r) {
+  int v = -1;
+  if (PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) == 1)
+    v = getInt(r, 0, 0);
+  PQclear(r);
+  return v;
+}
+
+bool commandOk(PGresult* r) {
+  bool ok = (PQresultStatus(r) == PGRES_COMMAND_OK);
+  PQclear(r);
+  return ok;
+}
+
+//Сколько строк затронула команда (INSERT/UPDATE/DELETE), или -1 при ошибке
+int commandRows(PGresult* r) {
+  int rows = PQresultStatus(r) == PGRES_COMMAND_OK ? std::atoi(PQcmdTuples(r)) : -1;
+  PQclear(r);
+  return rows;
+}
+
+} // namespace
+
+//Готовит все запросы на свежем соединении; AsyncPgPool вызывает это после каждого (пере)подключения
+bool Database::prepareStatements(PGconn* conn) {
+  for (const Statement& st : STATEMENTS) {
+    PGresult* r = PQprepare(conn, st.name, st.sql, st.nParams, st.types);
+    bool ok = (PQresultStatus(r) == PGRES_COMMAND_OK);
+    if (!ok) {
+      std::cerr << "[DB] PQprepare " << st.name << ": " << PQerrorMessage(conn)
+                << "[DB] Схема БД устарела? Обновите её: sql/upgrade_schema.sql\n";
+    }
+    PQclear(r);
+    if (!ok) return false;
+  }
+  return true;
+}
+
+Database::Database(const std::string& conninfo, const PoolConfig& cfg,
+                   const GroupCommitConfig& gc)
+  : pool(conninfo, cfg), conninfo(conninfo),
+    acquireTimeout(cfg.acquireTimeout), gcCfg(gc) {
+  //админские соединения открывает пул; подготовленные запросы им не нужны
+  if (gcCfg.maxBatch < 1) gcCfg.maxBatch = 1;
+  if (gcCfg.lanes < 1) gcCfg.lanes = 1;
 }
 
 Database::~Database() {
-  //закрываем соединение, если оно было открыто
-  if (conn) {
-    PQfinish(conn);
-    conn = nullptr;
+  //соединения закрывают пулы
+}
+
+thread_local Database::Local* Database::local = nullptr;
+
+Database::Local::Local(Reactor& reactor, const std::string& conninfo, int connections,
+                       std::chrono::milliseconds acquireTimeout, int lanes)
+  : reactor(reactor), async(reactor, conninfo, connections, acquireTimeout, &Database::prepareStatements),
+    lanes(lanes) {}
+
+void Database::attach(Reactor& reactor, int connections) {
+  auto l = std::make_unique<Local>(reactor, conninfo, connections, acquireTimeout, gcCfg.lanes);
+  local = l.get();
+  std::lock_guard lk(localsMtx);
+  locals.push_back(std::move(l));
+}
+
+PoolStats Database::asyncPoolStats() const {
+  PoolStats sum;
+  std::lock_guard lk(localsMtx);
+  for (const auto &l : locals) {
+    PoolStats st = l->async.stats();
+    sum.size += st.size;
+    sum.inUse += st.inUse;
+    sum.checkouts += st.checkouts;
+    sum.failures += st.failures;
+    sum.reconnects += st.reconnects;
+    sum.totalWaitUs += st.totalWaitUs;
+    sum.maxWaitUs = std::max(sum.maxWaitUs, st.maxWaitUs);
   }
+  return sum;
 }
 
-bool Database::registerUser(const std::string& username, const std::string& password_hash) {
-  //блокируем на время работы с БД
-  std::lock_guard<std::mutex> lock(dbMtx);
+Task<bool> Database::registerUser(const std::string& username, const std::string& password_hash) {
+  //имя уже есть в справочнике — в БД идти незачем
+  if (users.findId(username) > 0) co_return false;
+
+  //берём соединение из пула на время работы с БД
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return false;
 
   //1) проверяем, что пользователя с таким именем ещё нет
   {
-    const char* params[] = { username.c_str() };
-    PGresult* res = PQexecParams(
-      conn,
-      "SELECT 1 FROM users WHERE username = $1",
-      1, nullptr, params, nullptr, nullptr, 0
-    );
+    PGresult* res = co_await Params().addText(username).exec(lease, "user_exists");
     bool exists = (PQntuples(res) > 0);
     PQclear(res);
     if (exists) {
       //уже есть такой пользователь
-      return false;
+      co_return false;
     }
   }
 
-  //2) вставляем нового пользователя
-  {
-    const char* params[] = {
-      username.c_str(),
-      password_hash.c_str()
-    };
-    PGresult* res = PQexecParams(
-      conn,
-      "INSERT INTO users(username, password_hash) VALUES($1, $2)",
-      2, nullptr, params, nullptr, nullptr, 0
-    );
-    bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK);
-    PQclear(res);
-    return ok;
-  }
+  //2) вставляем нового пользователя и сразу заносим его в справочник
+  int id = singleInt(co_await Params().addText(username).addText(password_hash).exec(lease, "user_insert"));
+  if (id <= 0) co_return false;
+  users.put(id, username);
+  co_return true;
 }
 
-int Database::authenticateUser(const std::string& username, const std::string& password) {
-  std::lock_guard<std::mutex> lk(dbMtx);
-
-  const char* v[2] = { 
-    username.c_str(), 
-    password.c_str() 
-  };
-  PGresult* r = PQexecParams(conn,
-    "SELECT user_id FROM users WHERE username=$1 AND password_hash=$2",
-    2,nullptr,v,nullptr,nullptr,0);
-
-  int id = -1;
-  if (PQntuples(r)==1) 
-    id = std::stoi(PQgetvalue(r,0,0)); //берем id, преобразуем в int
+Task<int> Database::authenticateUser(const std::string& username, const std::string& password) {
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return -1;
 
-  PQclear(r);
-  return id;
+  //берем id, если пара логин/пароль нашлась
+  int id = singleInt(co_await Params().addText(username).addText(password).exec(lease, "user_auth"));
+  users.put(id, username);
+  co_return id;
 }
 
-int Database::findPrivateChat(int u1,int u2) {
-  std::lock_guard<std::mutex> lock(dbMtx);
-
-  //параметры to_string чтобы получить const char*
-  std::string s1 = std::to_string(u1);
-  std::string s2 = std::to_string(u2);
-  const char* params[] = { s1.c_str(), s2.c_str() };
+Task<int> Database::findPrivateChat(int u1,int u2) {
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return -1;
 
-  //ищем чат, в котором оба пользователя и is_group = false
-  PGresult* res = PQexecParams(
-    conn,
-    R"(
-      SELECT c.chat_id
-        FROM chats c
-        JOIN chat_members m1 ON c.chat_id = m1.chat_id AND m1.user_id = $1
-        JOIN chat_members m2 ON c.chat_id = m2.chat_id AND m2.user_id = $2
-      WHERE c.is_group = FALSE
-      GROUP BY c.chat_id
-    )",
-      2, nullptr, params, nullptr, nullptr, 0
-    );
+  co_return singleInt(co_await Params().addInt(u1).addInt(u2).exec(lease, "chat_find_private"));
+}
 
-    int chatId = -1;
-    if (PQntuples(res) == 1)
-        chatId = std::stoi(PQgetvalue(res, 0, 0));
+Task<int> Database::createChatWithMembers(bool is_group, const std::string& chat_name,
+                                          const std::vector<int>& members) {
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return -1;
 
+  //Создание чата и добавление всех участников — один запрос и одна транзакция
+  Params prm;
+  prm.addBool(is_group).addText(is_group ? chat_name.c_str() : nullptr).addIntArray(members);
+  PGresult* res = co_await prm.exec(lease, "chat_create_with_members");
+  if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) < 1) {
     PQclear(res);
-    return chatId;
-}
-
-int Database::createChat(bool is_group, const std::string& chat_name) {
-  std::lock_guard<std::mutex> lock(dbMtx);
-
-  if (is_group) {
-    //создаём групповой чат с названием группы
-    const char* params[] = { "t", chat_name.c_str() };
-    PGresult* res = PQexecParams(
-      conn,
-        "INSERT INTO chats(is_group, chat_name) VALUES($1, $2) RETURNING chat_id",
-          2, nullptr, params, nullptr, nullptr, 0
-        );
-    int cid = -1;
-    if (PQntuples(res) == 1)
-      cid = std::stoi(PQgetvalue(res, 0, 0));
-      
-    PQclear(res);
-    return cid;
-  } else {
-    //создаём приватный чат без имени
-    const char* params[] = { "f" };
-    PGresult* res = PQexecParams(
-      conn,
-       "INSERT INTO chats(is_group, chat_name) VALUES($1, NULL) RETURNING chat_id",
-          1, nullptr, params, nullptr, nullptr, 0
-        );
-    int cid = -1;
-    if (PQntuples(res) == 1)
-            cid = std::stoi(PQgetvalue(res, 0, 0));
+    co_return -1;
+  }
+  int chat_id = getInt(res, 0, 0);
 
-    PQclear(res);
-    return cid;
+  //В индекс участия — ровно тех, кого вставили (несуществующие id отсеяны запросом)
+  std::vector<int> inserted;
+  inserted.reserve(PQntuples(res));
+  for (int i = 0; i < PQntuples(res); ++i) {
+    if (!PQgetisnull(res, i, 1)) inserted.push_back(getInt(res, i, 1));
   }
+  PQclear(res);
+  membership.createChat(chat_id, inserted);
+  co_return chat_id;
 }
 
-bool Database::addUserToChat(int chat_id,int user_id) {
-  std::lock_guard<std::mutex> lock(dbMtx);
-
-  //формируем параметры
-  std::ostringstream a, b;
-  a << chat_id; b << user_id;
-  const char* params[] = { a.str().c_str(), b.str().c_str() };
-
-  //добавляем в chat_members
-  PGresult* res = PQexecParams(
-    conn,
-      "INSERT INTO chat_members(chat_id, user_id) VALUES($1, $2)",
-        2, nullptr, params, nullptr, nullptr, 0
-    );
-  bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK);
+//Выполняет запрос с одним int-параметром и собирает первый столбец всех строк
+static Task<bool> loadIds(AsyncPgPool::Lease& lease, const char* stmt, int arg, std::vector<int>& out) {
+  PGresult* res = co_await Params().addInt(arg).exec(lease, stmt);
+  bool ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+  if (ok) {
+    int rows = PQntuples(res);
+    out.reserve(rows);
+    for (int i = 0; i < rows; ++i) out.push_back(getInt(res, i, 0));
+  }
   PQclear(res);
-  return ok;
+  co_return ok;
 }
 
-bool Database::isUserInChat(int chat_id,int user_id) {
-  std::lock_guard<std::mutex> lock(dbMtx);
+Task<bool> Database::isUserInChat(int chat_id,int user_id) {
+  //обычно ответ уже есть в памяти
+  int known = membership.isMember(chat_id, user_id);
+  if (known >= 0) co_return known == 1;
 
-  std::ostringstream a, b;
-  a << chat_id; b << user_id;
-  const char* params[] = { a.str().c_str(), b.str().c_str() };
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return false;
 
-  //проверяем наличие в chat_members
-  PGresult* res = PQexecParams(
-    conn,
-      "SELECT 1 FROM chat_members WHERE chat_id = $1 AND user_id = $2",
-        2, nullptr, params, nullptr, nullptr, 0
-    );
-  bool found = (PQntuples(res) > 0);
-  PQclear(res);
-  return found;
+  //промах: читаем весь состав чата, чтобы следующие проверки по нему шли из памяти
+  uint64_t since = membership.epoch();
+  std::vector<int> members;
+  if (!co_await loadIds(lease, "chat_member_ids", chat_id, members)) co_return false;
+  membership.installChat(chat_id, members, since);
+  co_return std::find(members.begin(), members.end(), user_id) != members.end();
 }
 
-int Database::storeMessage(int chat_id,int sender_id,const std::string& content) {
-  std::lock_guard<std::mutex> lock(dbMtx);
+Task<std::vector<int>> Database::userChatIds(int user_id) {
+  std::vector<int> chats;
+  if (membership.chatsOf(user_id, chats)) co_return chats;
 
-  std::ostringstream a, b;
-  a << chat_id; b << sender_id;
-  const char* params[] = {
-    a.str().c_str(),
-    b.str().c_str(),
-    content.c_str()
-  };
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return std::vector<int>{};
 
-  //возвращает msg_id после вставки
-  PGresult* res = PQexecParams(
-    conn,
-      "INSERT INTO messages(chat_id, sender_id, content) "
-      "VALUES($1, $2, $3) RETURNING msg_id",
-        3, nullptr, params, nullptr, nullptr, 0
-    );
-
-  int msgId = -1;
-  if (PQntuples(res) == 1)
-        msgId = std::stoi(PQgetvalue(res, 0, 0));
-  
-  PQclear(res);
-  return msgId;
+  uint64_t since = membership.epoch();
+  if (!co_await loadIds(lease, "user_chat_ids", user_id, chats)) co_return std::vector<int>{};
+  membership.installUser(user_id, chats, since);
+  co_return chats;
 }
 
-std::vector<std::tuple<int, std::string,std::string,std::string>>  Database::getChatHistory(int chat_id,int user_id) {
-  std::lock_guard<std::mutex> lock(dbMtx);
-
-  //параметры chat_id и user_id
-  std::string c = std::to_string(chat_id);
-  std::string u = std::to_string(user_id);
-  const char* params[] = { c.c_str(), u.c_str() };
+//Ожидающее записи сообщение в очереди group commit
+struct Database::PendingMessage {
+  int chatId;
+  int senderId;
+  const std::string* content;
+  int msgId = -1; //результат: msg_id, 0 — не участник чата, -1 — ошибка
+  std::string senderName;
+  bool done = false;
+  std::coroutine_handle<> waiter; //ждёт, пока его пачку запишут (или пока полоса освободится)
+};
+
+namespace {
+
+//Приостанавливает сопрограмму; продолжит её тот, кому отдан handle
+struct Park {
+  std::coroutine_handle<>& handle;
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) const noexcept { handle = h; }
+  void await_resume() const noexcept {}
+};
+
+} // namespace
+
+Task<int> Database::sendMessage(int chat_id, int sender_id, const std::string& content,
+                                std::string& senderName) {
+  PendingMessage pm{chat_id, sender_id, &content, -1, {}, false, nullptr};
+
+  //Чат всегда попадает в одну и ту же полосу потока, а полоса пишет пачки строго по очереди —
+  //так сохраняется порядок сообщений внутри чата от клиентов этого потока
+  CommitLane& lane = local->lanes[static_cast<unsigned>(chat_id) % local->lanes.size()];
+  lane.queue.push_back(&pm);
+
+  //Лидер/ведомые: пока пачка полосы пишется, новые сообщения копятся в очереди, а их сопрограммы ждут;
+  //освободившуюся полосу занимает первое из ждущих и пишет всё накопленное одной транзакцией
+  //Без нагрузки лидер пишет сразу, поэтому одиночное сообщение не ждёт
+  while (!pm.done) {
+    if (lane.flushing) {
+      co_await Park{pm.waiter};
+      continue;
+    }
+    lane.flushing = true;
+    if (gcCfg.window.count() > 0 && lane.queue.size() < static_cast<size_t>(gcCfg.maxBatch)) {
+      co_await local->async.sleep(gcCfg.window);
+    }
+    size_t take = std::min(lane.queue.size(), static_cast<size_t>(gcCfg.maxBatch));
+    std::vector<PendingMessage*> batch(lane.queue.begin(), lane.queue.begin() + take);
+    lane.queue.erase(lane.queue.begin(), lane.queue.begin() + take);
+
+    co_await flushMessages(local->async, batch);
+
+    for (PendingMessage* p : batch) p->done = true;
+    lane.flushing = false;
+    //Записанных (и лидера вместе с ними) продолжаем одной задачей реактора строго в порядке пачки —
+    //так подписчики получают сообщения в порядке msg_id; следом будим первого из ещё ждущих,
+    //он станет следующим лидером
+    local->reactor.post([batch = std::move(batch), &lane] {
+      for (PendingMessage* p : batch) std::exchange(p->waiter, {}).resume();
+      if (!lane.flushing && !lane.queue.empty() && lane.queue.front()->waiter)
+        std::exchange(lane.queue.front()->waiter, {}).resume();
+    });
+    co_await Park{pm.waiter};
+  }
 
-  //выбираем все сообщения, не удалённые и не помеченные в user_deleted_messages
+  senderName = std::move(pm.senderName);
+  co_return pm.msgId;
+}
 
-  //используем LEFT JOIN потому что нам нужно выбрать все сообщения из чата, 
-  //даже те, для которых в таблице user_deleted_messages нет записи (то есть их пользователь не удалял)
-  PGresult* res = PQexecParams(
-    conn,
-    R"(
-      SELECT
-        m.msg_id,
-        to_char(m.created_at,'YYYY-MM-DD HH24:MI') AS ts,
-        u.username,
-        m.content
-      FROM messages m
-      JOIN users u 
-        ON m.sender_id = u.user_id
-      LEFT JOIN user_deleted_messages d 
-        ON d.msg_id = m.msg_id AND d.user_id = $2
-      WHERE m.chat_id = $1
-        AND NOT m.deleted
-        AND d.msg_id IS NULL
-      ORDER BY m.created_at
-    )",
-      2, nullptr, params, nullptr, nullptr, 0
-  );
+//Пишет пачку сообщений одним INSERT и раздаёт каждому его msg_id
+Task<void> Database::flushMessages(AsyncPgPool& async, const std::vector<PendingMessage*>& batch) {
+  auto lease = co_await async.acquire();
+  if (!lease) co_return; //msgId у всех остаётся -1
+
+  std::vector<int> chats, senders;
+  std::vector<const std::string*> contents;
+  chats.reserve(batch.size());
+  senders.reserve(batch.size());
+  contents.reserve(batch.size());
+  for (const PendingMessage* p : batch) {
+    chats.push_back(p->chatId);
+    senders.push_back(p->senderId);
+    contents.push_back(p->content);
+  }
 
-  //формируем вектор записей об истории
-  std::vector<std::tuple<int,std::string,std::string,std::string>> out;
+  Params prm;
+  prm.addIntArray(chats).addIntArray(senders).addTextArray(contents);
+  PGresult* res = co_await prm.exec(lease, "messages_store_batch");
   if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+    //Строки, которых нет в ответе, не прошли проверку участия
+    for (PendingMessage* p : batch) p->msgId = 0;
     int rows = PQntuples(res);
-    out.reserve(rows);
     for (int i = 0; i < rows; ++i) {
-      int mid = std::stoi(PQgetvalue(res, i, 0));
-      std::string ts = PQgetvalue(res, i, 1);
-      std::string usr = PQgetvalue(res, i, 2);
-      std::string msg = PQgetvalue(res, i, 3);
-      out.emplace_back(mid, ts, usr, msg);
+      int ord = getInt(res, i, 0);
+      if (ord < 1 || ord > static_cast<int>(batch.size())) continue;
+      PendingMessage* p = batch[ord - 1];
+      p->msgId = getInt(res, i, 1);
+      p->senderName = getText(res, i, 2);
+      users.put(p->senderId, p->senderName);
     }
-  } 
-  
+    batches++;
+    batchedMessages += batch.size();
+  }
   PQclear(res);
-  return out;
 }
 
-int Database::getMessageSender(int msg_id) {
-  std::lock_guard<std::mutex> lk(dbMtx);
+GroupCommitStats Database::groupCommitStats() const {
+  GroupCommitStats st;
+  st.batches = batches.load();
+  st.messages = batchedMessages.load();
+  return st;
+}
 
-  std::string s = std::to_string(msg_id);
-  const char* v[1] = {s.c_str()};
+Task<std::vector<std::tuple<int, std::string,std::string,std::string>>>
+Database::getChatHistoryPage(int chat_id, int user_id, int before_msg_id, int limit, bool& hasMore) {
+  hasMore = false;
+  std::vector<std::tuple<int,std::string,std::string,std::string>> out;
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return out;
 
-  //очень простой запрос из одной таблицы
-  PGresult* r = PQexecParams(conn,
-    "SELECT sender_id FROM messages WHERE msg_id=$1",
-      1,nullptr,v,nullptr,nullptr,0
-    );
+  //Берём на одну строку больше: лишняя строка означает, что есть более ранние сообщения
+  Params prm;
+  prm.addInt(chat_id).addInt(user_id);
+  if (before_msg_id > 0) prm.addInt(before_msg_id);
+  prm.addInt(limit + 1);
+  PGresult* res = co_await prm.exec(lease, before_msg_id > 0 ? "chat_history_before" : "chat_history_latest");
 
-  int id = -1;
-  if (PQntuples(r)==1) 
-    id = std::stoi(PQgetvalue(r,0,0));
+  if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+    int rows = PQntuples(res);
+    hasMore = rows > limit;
+    if (hasMore) rows = limit;
+    out.reserve(rows);
+    //Строки идут от новых к старым, а отдаём по возрастанию msg_id
+    for (int i = rows - 1; i >= 0; --i) {
+      out.emplace_back(getInt(res, i, 0), getText(res, i, 1), getText(res, i, 2), getText(res, i, 3));
+    }
+  }
 
-  PQclear(r);
-  return id;
+  PQclear(res);
+  co_return out;
 }
 
-bool Database::deleteMessageForUser(int msg_id,int user_id) {
-  std::lock_guard<std::mutex> lock(dbMtx);
+Task<std::vector<TailMessage>> Database::getChatTail(int chat_id, int count, bool& complete) {
+  complete = false;
+  std::vector<TailMessage> out;
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return out;
 
-  std::ostringstream a, b;
-  a << msg_id; b << user_id;
-  const char* params[] = { a.str().c_str(), b.str().c_str() };
+  //Лишняя строка — признак, что в чате есть сообщения старше хвоста
+  PGresult* res = co_await Params().addInt(chat_id).addInt(count + 1).exec(lease, "chat_tail");
+
+  if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+    int rows = PQntuples(res);
+    complete = rows <= count;
+    if (!complete) rows = count;
+    out.reserve(rows);
+    for (int i = rows - 1; i >= 0; --i) {
+      TailMessage m;
+      m.msgId = getInt(res, i, 0);
+      m.ts = getText(res, i, 1);
+      m.username = getText(res, i, 2);
+      m.content = getText(res, i, 3);
+      m.hiddenFor = getIntArray(res, i, 4);
+      out.push_back(std::move(m));
+    }
+  }
 
-  //помечаем сообщение как удалённое для данного user_id
-  PGresult* res = PQexecParams(
-    conn,
-      R"(INSERT INTO user_deleted_messages(msg_id, user_id)
-      VALUES($1, $2) ON CONFLICT DO NOTHING)", //не ломаем сервер при попытке дважды удалить одно и то же сообщение
-        2, nullptr, params, nullptr, nullptr, 0
-    );
-
-  bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK);
   PQclear(res);
-  return ok;
+  co_return out;
 }
 
-bool Database::deleteMessageGlobal(int msg_id) {
-  std::lock_guard<std::mutex> lock(dbMtx);
-
-  std::string id_str = std::to_string(msg_id);
-  const char* params[] = { id_str.c_str() };
+Task<int> Database::getMessageSender(int msg_id) {
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return -1;
 
-  //устанавливаем deleted = TRUE
-  PGresult* res = PQexecParams(
-    conn,
-      "UPDATE messages SET deleted = TRUE WHERE msg_id = $1",
-        1, nullptr, params, nullptr, nullptr, 0
-    );
-  
-  bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK);
-  PQclear(res);
-  return ok;
+  //очень простой запрос из одной таблицы
+  co_return singleInt(co_await Params().addInt(msg_id).exec(lease, "message_sender"));
 }
 
-int Database::getUserIdByName(const std::string& username) {
-  std::lock_guard<std::mutex> lk(dbMtx);
-
-  const char* v[1] = {username.c_str()};
+Task<bool> Database::deleteMessageForUser(int msg_id,int user_id) {
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return false;
 
-  PGresult* r = PQexecParams(conn,
-    "SELECT user_id FROM users WHERE username=$1",
-      1,nullptr,v,nullptr,nullptr,0);
+  //помечаем сообщение как удалённое для данного user_id
+  co_return commandOk(co_await Params().addInt(msg_id).addInt(user_id).exec(lease, "message_hide"));
+}
 
-  int id = -1;
-  if (PQntuples(r) == 1) 
-    id = std::stoi(PQgetvalue(r,0,0));
+Task<int> Database::deleteOwnMessageGlobal(int msg_id, int user_id) {
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return -1;
 
+  //Проверка автора, пометка deleted и номер чата — одним запросом
+  PGresult* r = co_await Params().addInt(msg_id).addInt(user_id).exec(lease, "message_delete_own");
+  int chatId = -1;
+  if (PQresultStatus(r) == PGRES_TUPLES_OK)
+    chatId = PQntuples(r) == 1 ? getInt(r, 0, 0) : 0;
   PQclear(r);
-  return id;
+  co_return chatId;
 }
 
-std::vector<std::tuple<int,bool,std::string>> Database::listUserChats(int user_id) {
-  std::lock_guard<std::mutex> lk(dbMtx);
+Task<int> Database::getUserIdByName(const std::string& username) {
+  int id = users.findId(username);
+  if (id > 0) co_return id;
 
-  //передаём user_id как строку
-  std::string uidStr = std::to_string(user_id);
-  const char* params[1] = { uidStr.c_str() };
-
-  //выбираем id, признак группового чата и имя чата для данного пользователя
-  PGresult* res = PQexecParams(
-    conn,
-    R"(
-      SELECT c.chat_id, c.is_group, c.chat_name
-        FROM chats c
-        JOIN chat_members m ON c.chat_id = m.chat_id
-      WHERE m.user_id = $1
-      )",
-        1, nullptr, params, nullptr, nullptr, 0
-    );
-
-
-  //формируем соответствующий вектор кортежей из списка чатов
-  std::vector<std::tuple<int,bool,std::string>> out;
-  if (PQresultStatus(res) == PGRES_TUPLES_OK) {
-    int rowCount = PQntuples(res);
-    out.reserve(rowCount);
-    for (int i = 0; i < rowCount; ++i) {
-      int chatId = std::stoi(PQgetvalue(res, i, 0));
-      bool isGroup = (PQgetvalue(res, i, 1)[0] == 't');
-      std::string name = PQgetvalue(res, i, 2);
-      out.emplace_back(chatId, isGroup, name);
-    }
-  }
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return -1;
 
-  PQclear(res);
-  return out;
+  id = singleInt(co_await Params().addText(username).exec(lease, "user_id_by_name"));
+  users.put(id, username);
+  co_return id;
 }
 
-std::string Database::getUsername(int user_id) {
-  std::lock_guard<std::mutex> lk(dbMtx);
+Task<std::string> Database::getUsername(int user_id) {
+  std::string name;
+  if (users.findName(user_id, name)) co_return name;
 
-  std::string u = std::to_string(user_id);
-  const char* v[1] = {u.c_str()};
-  PGresult* r = PQexecParams(conn,
-      "SELECT username FROM users WHERE user_id=$1",
-      1,nullptr,v,nullptr,nullptr,0);
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return name;
 
-  std::string name;
-  if (PQntuples(r)==1) 
-    name = PQgetvalue(r,0,0);
+  PGresult* r = co_await Params().addInt(user_id).exec(lease, "username_by_id");
+
+  if (PQntuples(r)==1) {
+    name = getText(r, 0, 0);
+    users.put(user_id, name);
+  }
 
   PQclear(r);
-  return name;
+  co_return name;
 }
 
 bool Database::deleteEverything() {
-  std::lock_guard<std::mutex> lk(dbMtx);
-
-  const char* noParams[0] = {};
-
-  //Удаляем данные из всех таблиц
-  PQexecParams(conn, "DELETE FROM users", 0, nullptr, noParams, nullptr, nullptr, 0);
-  PQexecParams(conn, "DELETE FROM chats", 0, nullptr, noParams, nullptr, nullptr, 0);
-  PQexecParams(conn, "DELETE FROM chat_members", 0, nullptr, noParams, nullptr, nullptr, 0);
-  PQexecParams(conn, "DELETE FROM messages", 0, nullptr, noParams, nullptr, nullptr, 0);
-  PQexecParams(conn, "DELETE FROM user_deleted_messages", 0, nullptr, noParams, nullptr, nullptr, 0);
-  PGresult* res = PQexecParams(conn, "DELETE FROM chat_events", 0, nullptr, noParams, nullptr, nullptr, 0);
-
-  bool success = (PQresultStatus(res) == PGRES_COMMAND_OK);
-  PQclear(res);
-  return success;
+  auto lease = pool.acquire();
+  if (!lease) return false;
+  PGconn* conn = lease.get();
+
+  //Удаляем данные из всех таблиц (админская команда, готовить её заранее незачем)
+  PQclear(PQexec(conn, "DELETE FROM users"));
+  PQclear(PQexec(conn, "DELETE FROM chats"));
+  PQclear(PQexec(conn, "DELETE FROM chat_members"));
+  PQclear(PQexec(conn, "DELETE FROM messages"));
+  PQclear(PQexec(conn, "DELETE FROM user_deleted_messages"));
+  bool ok = commandOk(PQexec(conn, "DELETE FROM chat_events"));
+  users.clear();
+  membership.clear();
+  return ok;
 }
 
-std::vector<std::string> Database::chatMembers(int chat_id) {
-  std::lock_guard<std::mutex> lk(dbMtx);
-
-  std::string cidStr = std::to_string(chat_id);
-  const char* params[1] = { cidStr.c_str() };
+Task<std::vector<ChatSummary>> Database::listChatSummaries(int user_id, int unread_cap) {
+  std::vector<ChatSummary> out;
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return out;
 
-  PGresult* res = PQexecParams(
-    conn,
-      R"(
-        SELECT u.username
-        FROM users u
-          JOIN chat_members m ON u.user_id = m.user_id
-        WHERE m.chat_id = $1
-      )",
-        1, nullptr, params, nullptr, nullptr, 0
-    );
+  PGresult* res = co_await Params().addInt(user_id).addInt(unread_cap).exec(lease, "user_chat_summaries");
 
-  std::vector<std::string> members;
   if (PQresultStatus(res) == PGRES_TUPLES_OK) {
     int rowCount = PQntuples(res);
-    members.reserve(rowCount);
+    out.reserve(rowCount);
     for (int i = 0; i < rowCount; ++i) {
-      members.emplace_back(PQgetvalue(res, i, 0));
+      ChatSummary cs;
+      cs.chatId = getInt(res, i, 0);
+      cs.isGroup = getBool(res, i, 1);
+      cs.name = getText(res, i, 2);
+      cs.members = getText(res, i, 3);
+      cs.lastSender = getText(res, i, 4);
+      cs.lastPreview = getText(res, i, 5);
+      cs.unread = getInt(res, i, 6);
+      out.push_back(std::move(cs));
     }
   }
 
   PQclear(res);
-  return members;
+  co_return out;
 }
 
-int Database::getChatIdByMessage(int msg_id) {
-  std::lock_guard<std::mutex> lk(dbMtx);
-
-  std::string midStr = std::to_string(msg_id);
-  const char* params[1] = { midStr.c_str() };
+Task<bool> Database::markChatRead(int chat_id, int user_id, int msg_id) {
+  //Повторный HISTORY той же страницы (обычно из HistoryCache) границу не сдвигает — в БД не ходим
+  if (!membership.readAdvances(chat_id, user_id, msg_id)) co_return true;
 
-  PGresult* res = PQexecParams(
-    conn,
-      "SELECT chat_id FROM messages WHERE msg_id=$1",
-        1, nullptr, params, nullptr, nullptr, 0
-    );
-
-  int chatId = -1;
-  if (PQntuples(res) == 1)
-    chatId = std::stoi(PQgetvalue(res, 0, 0));
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return false;
 
-  PQclear(res);
-  return chatId;
+  bool ok = commandOk(co_await Params().addInt(chat_id).addInt(user_id).addInt(msg_id)
+                        .exec(lease, "member_mark_read"));
+  if (ok) membership.markRead(chat_id, user_id, msg_id);
+  co_return ok;
 }
 
-bool Database::removeUserFromChat(int chat_id, int user_id) {
-  std::lock_guard<std::mutex> lk(dbMtx);
+Task<int> Database::getChatIdByMessage(int msg_id) {
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return -1;
 
-  //1) Удаляем из chat_members
-  {
-    std::ostringstream sc, su;
-    sc << chat_id;
-    su << user_id;
-    const char* params1[2] = { sc.str().c_str(), su.str().c_str() };
-    PGresult* r = PQexecParams(
-      conn,
-        "DELETE FROM chat_members WHERE chat_id=$1 AND user_id=$2",
-          2, nullptr, params1, nullptr, nullptr, 0
-      );
-    PQclear(r);
-  }
+  co_return singleInt(co_await Params().addInt(msg_id).exec(lease, "message_chat"));
+}
 
-  //2) Вставляем запись в chat_events с типом LEFT (покинул чат)
-  {
-    std::ostringstream sc, su;
-    sc << chat_id;
-    su << user_id;
-    const char* params2[3] = { sc.str().c_str(), su.str().c_str(), "LEFT" };
-    PGresult* r = PQexecParams(
-      conn,
-        R"(
-          INSERT INTO chat_events(chat_id, user_id, event_type, event_ts)
-          VALUES($1, $2, $3, now())
-        )",
-          3, nullptr, params2, nullptr, nullptr, 0
-      );
-    
-    bool ok = (PQresultStatus(r) == PGRES_COMMAND_OK);
-    PQclear(r);
-    return ok;
-  }
+Task<bool> Database::removeUserFromChat(int chat_id, int user_id) {
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return false;
+
+  //Запись LEFT (покинул чат) в chat_events и удаление из chat_members — одним проходом
+  //и одной транзакцией; событие пишется, только если участник ещё в чате,
+  //так что выход не-участника или повторный выход не оставляют ни события, ни USER_LEFT
+  Params event, member;
+  event.addInt(chat_id).addInt(user_id).addText("LEFT");
+  member.addInt(chat_id).addInt(user_id);
+  std::vector<AsyncPgPool::Lease::Query> batch = {event.query("member_event_insert"), member.query("member_remove")};
+  std::vector<PGresult*> res = co_await lease.execPipeline(batch);
+  if (res.empty()) co_return false;
+  bool logged = commandRows(res[0]) == 1;
+  bool removed = commandRows(res[1]) == 1;
+  //Из индекса участия — только если строка действительно удалена
+  if (removed) membership.remove(chat_id, user_id);
+  co_return removed && logged;
 }
 
-std::vector<std::tuple<std::string,int,std::string>> Database::getChatEvents(int chat_id) {
-  std::lock_guard<std::mutex> lk(dbMtx);
+Task<std::vector<std::tuple<std::string,int,std::string>>>
+Database::getChatEventsBetween(int chat_id, int from_msg_id, int to_msg_id) {
+  std::vector<std::tuple<std::string,int,std::string>> events;
+  auto lease = co_await local->async.acquire();
+  if (!lease) co_return events;
 
-  std::string cidStr = std::to_string(chat_id);
-  const char* params[1] = { cidStr.c_str() };
+  PGresult* res = co_await Params().addInt(chat_id).addInt(from_msg_id).addInt(to_msg_id)
+                    .exec(lease, "chat_events_between");
 
-  //выбираем timestamp (дату и время), user_id, тип события
-  PGresult* res = PQexecParams(
-    conn,
-    R"(
-      SELECT
-        to_char(event_ts,'YYYY-MM-DD HH24:MI'),
-        user_id,
-        event_type
-      FROM chat_events
-      WHERE chat_id=$1
-      ORDER BY event_ts
-    )",
-      1, nullptr, params, nullptr, nullptr, 0
-    );
-
-  std::vector<std::tuple<std::string,int,std::string>> events;
-  int rowCount = PQntuples(res);
-  events.reserve(rowCount);
-
-  for (int i = 0; i < rowCount; ++i) {
-    std::string ts = PQgetvalue(res, i, 0);
-    int uid = std::stoi(PQgetvalue(res, i, 1));
-    std::string type = PQgetvalue(res, i, 2);
-    events.emplace_back(ts, uid, type);
+  if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+    int rowCount = PQntuples(res);
+    events.reserve(rowCount);
+    for (int i = 0; i < rowCount; ++i) {
+      events.emplace_back(getText(res, i, 0), getInt(res, i, 1), getText(res, i, 2));
+    }
   }
 
   PQclear(res);
-  return events;
-}
\ No newline at end of file
+  co_return events;
+}
+
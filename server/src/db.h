@@ -3,91 +3,200 @@
 #include <string>
 #include <vector>
 #include <tuple>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <mutex>
 #include <postgresql/libpq-fe.h>
 
+#include "pgpool.h"
+#include "pg_async.h"
+#include "membership_cache.h"
+#include "reactor.h"
+#include "task.h"
+#include "user_directory.h"
+
+//Настройки group commit для новых сообщений
+struct GroupCommitConfig {
+    int lanes = 4; //независимых очередей в каждом потоке реактора; чат всегда пишется через одну и ту же
+    int maxBatch = 64; //не больше стольких сообщений в одном INSERT
+    std::chrono::microseconds window{0}; //сколько лидер ждёт добора пачки (0 — не ждёт)
+};
+
+//Строка списка чатов пользователя (LIST_CHATS)
+struct ChatSummary {
+    int chatId = 0;
+    bool isGroup = false;
+    std::string name;
+    std::string members; //имена участников через запятую
+    std::string lastSender; //автор последнего сообщения (пусто, если сообщений нет)
+    std::string lastPreview; //начало текста последнего сообщения
+    int unread = 0; //непрочитанных чужих сообщений (не больше запрошенного предела)
+};
+
+//Сообщение из хвоста чата для кэша истории
+struct TailMessage {
+    int msgId = 0;
+    std::string ts; //"YYYY-MM-DD HH:MM"
+    std::string username;
+    std::string content;
+    std::vector<int> hiddenFor; //кто удалил сообщение только у себя
+};
+
+//Метрики group commit
+struct GroupCommitStats {
+    uint64_t batches = 0; //записанных пачек (транзакций)
+    uint64_t messages = 0; //сообщений в них
+};
+
 //Класс для работы с базой PostgreSQL — регистрация, чаты, сообщения, события
+//Методы, которые вызывают обработчики команд, — сопрограммы (Task): они ждут ответа БД через
+//неблокирующие соединения потока реактора (см. attach) и не занимают поток на время запроса
+//Блокирующий общий пул обслуживает только админскую работу (deleteEverything)
 class Database {
 public:
-    //Подключается к БД по строке соединения
+    //Подключается к БД по строке соединения, открывая админский пул из cfg.size соединений
     //пример: "host=... dbname=... user=... password=..."
-    explicit Database(const std::string& conninfo);
+    explicit Database(const std::string& conninfo, const PoolConfig& cfg = PoolConfig(),
+                      const GroupCommitConfig& gc = GroupCommitConfig());
     //explicit для того, чтобы не было неявного преобразования из string
 
-    //Закрывает соединение с БД
+    //Закрывает соединения с БД
     ~Database();
 
+    //Открывает connections неблокирующих соединений для вызывающего потока и его реактора
+    //Вызывается в потоке реактора до run(); сопрограммы-методы можно вызывать только из таких потоков
+    void attach(Reactor& reactor, int connections);
+
+    //Метрики общего (блокирующего) пула соединений
+    PoolStats poolStats() const { return pool.stats(); }
+
+    //Метрики неблокирующих соединений всех потоков реакторов вместе
+    PoolStats asyncPoolStats() const;
+
+    //Метрики group commit (сколько пачек и сообщений записано)
+    GroupCommitStats groupCommitStats() const;
+
     //Регистрирует нового пользователя
-    bool registerUser(const std::string& username,
-                      const std::string& password);
+    Task<bool> registerUser(const std::string& username,
+                            const std::string& password);
 
     //Проверяет логин/пароль
     //user_id при успехе или -1 при ошибке
-    int authenticateUser(const std::string& username,
-                         const std::string& password_hash);
+    Task<int> authenticateUser(const std::string& username,
+                               const std::string& password_hash);
 
     //Ищет приватный чат между двумя пользователями.
     //return chat_id, или -1 если чат не найден.
-    int findPrivateChat(int user1, int user2);
+    Task<int> findPrivateChat(int user1, int user2);
 
-    //Создаёт чат
+    //Создаёт чат и добавляет участников одним запросом (а значит, и одной транзакцией)
+    //Несуществующие user_id и повторы пропускаются
     //новый chat_id или -1 при ошибке
-    int createChat(bool is_group, const std::string& chat_name);
+    Task<int> createChatWithMembers(bool is_group, const std::string& chat_name,
+                                    const std::vector<int>& members);
+
+    //Проверяет, состоит ли пользователь в чате (по индексу в памяти, при промахе — по БД)
+    Task<bool> isUserInChat(int chat_id, int user_id);
 
-    //Добавляет пользователя в чат
-    bool addUserToChat(int chat_id, int user_id);
+    //Все chat_id, где состоит пользователь (по индексу в памяти, при промахе — по БД)
+    Task<std::vector<int>> userChatIds(int user_id);
 
-    //Проверяет, состоит ли пользователь в чате
-    bool isUserInChat(int chat_id, int user_id);
+    //Сохраняет сообщение, только если отправитель состоит в чате, и заодно берёт его имя
+    //Одновременные вызовы потока объединяются в одну многострочную вставку и одну транзакцию (group commit)
+    //msg_id при успехе, 0 если отправитель не в чате, -1 при ошибке
+    Task<int> sendMessage(int chat_id, int sender_id, const std::string& content,
+                          std::string& senderName);
 
-    //Сохраняет новое сообщение
-    //Возвращает сгенерированный msg_id или -1 при ошибке
-    int storeMessage(int chat_id,
-                     int sender_id,
-                     const std::string& content);
+    //Одна страница истории с фильтрацией по удалённым сообщениям для данного user_id:
+    //не больше limit сообщений строго раньше before_msg_id (0 — самые новые)
+    //Кортежи (msg_id, "YYYY-MM-DD HH:MM", username, content) по возрастанию msg_id;
+    //hasMore — есть ли ещё более ранние сообщения
+    Task<std::vector<std::tuple<int, std::string, std::string, std::string>>>
+        getChatHistoryPage(int chat_id, int user_id, int before_msg_id, int limit, bool& hasMore);
 
-    //Возвращает историю чата с фильтрацией по удалённым сообщениям для данного user_id
-    //Возвращает вектор кортежей (msg_id, "YYYY-MM-DD HH:MM", username, content)
-    std::vector<std::tuple<int, std::string, std::string, std::string>>
-        getChatHistory(int chat_id, int user_id);
+    //Последние count глобально не удалённых сообщений чата по возрастанию msg_id, без фильтра по пользователю
+    //complete — в чате нет сообщений старше возвращённых
+    Task<std::vector<TailMessage>> getChatTail(int chat_id, int count, bool& complete);
 
-    //Помечает сообщение глобально удалённым, вызывать может только автор
-    bool deleteMessageGlobal(int msg_id);
+    //Глобально удаляет сообщение, если user_id — его автор, одним запросом
+    //chat_id сообщения при успехе, 0 если нет прав (или сообщения нет), -1 при ошибке
+    Task<int> deleteOwnMessageGlobal(int msg_id, int user_id);
 
     //Добавляет в user_deleted_messages, чтобы скрыть у одного пользователя (автора)
-    bool deleteMessageForUser(int msg_id, int user_id);
+    Task<bool> deleteMessageForUser(int msg_id, int user_id);
 
-    //Список имён всех участников чата
-    std::vector<std::string> chatMembers(int chat_id);
+    //Все чаты пользователя со сводкой одним запросом, сначала чаты с самыми свежими сообщениями
+    //Непрочитанные считаются не дальше unread_cap
+    Task<std::vector<ChatSummary>> listChatSummaries(int user_id, int unread_cap);
 
-    //Список чатов, в которых участвует пользователь
-    //Возвращает вектор (chat_id, is_group, chat_name)
-    std::vector<std::tuple<int, bool, std::string>> listUserChats(int user_id);
+    //Отмечает сообщения чата до msg_id включительно прочитанными пользователем
+    //UPDATE идёт в БД, только если msg_id сдвигает уже записанную границу
+    Task<bool> markChatRead(int chat_id, int user_id, int msg_id);
 
     //Возвращает user_id по его имени, или -1 если не найден
-    int getUserIdByName(const std::string& username);
+    //Обе функции сначала смотрят справочник в памяти и идут в БД только при промахе
+    Task<int> getUserIdByName(const std::string& username);
 
     //Возвращает имя пользователя по user_id, или пустую строку
-    std::string getUsername(int user_id);
+    Task<std::string> getUsername(int user_id);
 
     //Автор сообщения
-    int getMessageSender(int msg_id);
+    Task<int> getMessageSender(int msg_id);
 
     //Определяет, в каком чате было сообщение.
-    int getChatIdByMessage(int msg_id);
+    Task<int> getChatIdByMessage(int msg_id);
 
     //Удаляет пользователя из чата и фиксирует событие "LEFT"
-    bool removeUserFromChat(int chat_id, int user_id);
+    Task<bool> removeUserFromChat(int chat_id, int user_id);
 
-    //Возвращает список событий чата
+    //События чата, попадающие между временем сообщений from_msg_id и to_msg_id
     //вектор ("YYYY-MM-DD HH:MM", user_id, event_type)
-    std::vector<std::tuple<std::string, int, std::string>>
-        getChatEvents(int chat_id);
+    //0 вместо msg_id снимает соответствующую границу
+    Task<std::vector<std::tuple<std::string, int, std::string>>>
+        getChatEventsBetween(int chat_id, int from_msg_id, int to_msg_id);
 
     //Полностью очищает все таблицы (для админских целей)
     bool deleteEverything();
 
 private:
-    PGconn* conn; //Компонент подключения libpq
-    std::mutex dbMtx; //Защищает доступ к conn и всем методам (иначе крашится сервер при одновременных попытках подключения пользователей)
+    //Готовит все запросы (PQprepare) на свежем неблокирующем соединении
+    static bool prepareStatements(PGconn* conn);
+
+    //Блокирующий пул для админских команд; если свободного соединения нет дольше таймаута,
+    //метод возвращает значение ошибки
+    PgPool pool;
+    std::string conninfo;
+    std::chrono::milliseconds acquireTimeout;
+
+    //Group commit: очередь сообщений одной полосы и признак, что её пачка сейчас пишется
+    //Полосы свои у каждого потока реактора, поэтому без блокировок: ждут сопрограммы, а не потоки
+    struct PendingMessage;
+    struct CommitLane {
+        std::vector<PendingMessage*> queue;
+        bool flushing = false;
+    };
+    Task<void> flushMessages(AsyncPgPool& async, const std::vector<PendingMessage*>& batch);
+
+    //Состояние потока реактора: его неблокирующие соединения и полосы group commit
+    struct Local {
+        Reactor& reactor;
+        AsyncPgPool async;
+        std::vector<CommitLane> lanes;
+        Local(Reactor& reactor, const std::string& conninfo, int connections,
+              std::chrono::milliseconds acquireTimeout, int lanes);
+    };
+    static thread_local Local* local;
+    mutable std::mutex localsMtx;
+    std::vector<std::unique_ptr<Local>> locals;
+
+    //Справочник id <-> имя: getUsername/getUserIdByName без похода в БД
+    UserDirectory users;
+    //Индекс участия chat <-> user: isUserInChat/userChatIds без похода в БД
+    MembershipCache membership;
+
+    GroupCommitConfig gcCfg;
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> batchedMessages{0};
 };
\ No newline at end of file
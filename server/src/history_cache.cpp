@@ -0,0 +1,227 @@
+#include "history_cache.h"
+
+#include <algorithm>
+
+static bool hiddenFrom(const TimelineEntry& e, int user_id) {
+  return std::find(e.hiddenFor.begin(), e.hiddenFor.end(), user_id) != e.hiddenFor.end();
+}
+
+HistoryCache::HistoryCache(size_t perChat, size_t maxEntries)
+  : perChat(perChat > 0 ? perChat : 1),
+    maxPerSection(std::max<size_t>(maxEntries / SECTIONS, this->perChat)) {}
+
+void HistoryCache::touch(Section& s, Ring& r) {
+  s.lru.splice(s.lru.begin(), s.lru, r.lru);
+}
+
+void HistoryCache::trim(Section& s, Ring& r) {
+  while (r.entries.size() > perChat) {
+    r.entries.pop_front();
+    r.complete = false; //самое старое выпало — истории целиком в кольце больше нет
+    s.entries--;
+  }
+  //Вытесняем самые давно использованные чаты, кроме того, с которым сейчас работаем
+  while (s.entries > maxPerSection && s.lru.size() > 1) {
+    int victim = s.lru.back();
+    auto it = s.rings.find(victim);
+    if (&it->second == &r) break;
+    s.entries -= it->second.entries.size();
+    s.lru.pop_back();
+    s.rings.erase(it);
+    evictions++;
+  }
+}
+
+bool HistoryCache::page(int chat_id, int user_id, int before, int limit,
+                        std::vector<TimelineEntry>& out, bool& hasMore) {
+  Section& s = section(chat_id);
+  std::lock_guard lk(s.mtx);
+  auto it = s.rings.find(chat_id);
+  if (it == s.rings.end()) {
+    misses++;
+    return false;
+  }
+  Ring& r = it->second;
+  const auto& e = r.entries;
+
+  //Страница заканчивается перед курсором; курсора нет в кольце — не наш случай
+  size_t end = e.size();
+  if (before > 0) {
+    while (end > 0 && e[end - 1].msgId != before) --end;
+    if (end == 0) {
+      misses++;
+      return false;
+    }
+    --end;
+  }
+
+  //Идём от курсора назад, пока не наберём limit видимых сообщений
+  std::vector<size_t> picked;
+  int visible = 0;
+  size_t i = end;
+  while (i > 0 && visible < limit) {
+    --i;
+    if (e[i].msgId > 0) {
+      if (hiddenFrom(e[i], user_id)) continue;
+      visible++;
+    }
+    picked.push_back(i);
+  }
+
+  if (visible < limit) {
+    //Дошли до начала кольца: годится, только если в нём вся история
+    if (!r.complete) {
+      misses++;
+      return false;
+    }
+    hasMore = false;
+  } else {
+    bool olderVisible = false;
+    for (size_t j = i; j > 0 && !olderVisible; --j) {
+      olderVisible = e[j - 1].msgId > 0 && !hiddenFrom(e[j - 1], user_id);
+    }
+    if (olderVisible || !r.complete) {
+      //Что лежит за пределами кольца, не знаем — следующую страницу клиент запросит у БД
+      hasMore = true;
+    } else {
+      //Старше только события — отдаём их вместе с этой страницей, как и запрос к БД
+      hasMore = false;
+      for (size_t j = i; j > 0; --j) picked.push_back(j - 1);
+    }
+  }
+
+  out.clear();
+  out.reserve(picked.size());
+  for (auto p = picked.rbegin(); p != picked.rend(); ++p) out.push_back(e[*p]);
+  touch(s, r);
+  hits++;
+  return true;
+}
+
+bool HistoryCache::contains(int chat_id) const {
+  const Section& s = section(chat_id);
+  std::lock_guard lk(s.mtx);
+  return s.rings.count(chat_id) > 0;
+}
+
+uint64_t HistoryCache::epoch(int chat_id) const {
+  const Section& s = section(chat_id);
+  std::lock_guard lk(s.mtx);
+  return s.writes[epochSlot(chat_id)];
+}
+
+void HistoryCache::seed(int chat_id, std::vector<TimelineEntry> entries, bool complete, uint64_t since) {
+  Section& s = section(chat_id);
+  std::lock_guard lk(s.mtx);
+  if (s.writes[epochSlot(chat_id)] != since) return; //пока читали из БД, в чат писали — снимок мог устареть
+
+  auto [it, inserted] = s.rings.try_emplace(chat_id);
+  Ring& r = it->second;
+  if (inserted) {
+    s.lru.push_front(chat_id);
+    r.lru = s.lru.begin();
+  } else {
+    s.entries -= r.entries.size();
+    touch(s, r);
+  }
+  r.entries.assign(std::make_move_iterator(entries.begin()), std::make_move_iterator(entries.end()));
+  r.complete = complete;
+  s.entries += r.entries.size();
+  seeds++;
+  trim(s, r);
+}
+
+void HistoryCache::beginWrite(int chat_id) {
+  Section& s = section(chat_id);
+  std::lock_guard lk(s.mtx);
+  s.writes[epochSlot(chat_id)]++;
+}
+
+void HistoryCache::appendMessage(int chat_id, TimelineEntry e) {
+  Section& s = section(chat_id);
+  std::lock_guard lk(s.mtx);
+  s.writes[epochSlot(chat_id)]++;
+  auto it = s.rings.find(chat_id);
+  if (it == s.rings.end()) return;
+  Ring& r = it->second;
+
+  //Отправители из разных потоков могут прийти не в порядке msg_id — вставляем на своё место
+  //Такой msg_id уже может быть в кольце, если снимок из БД успел его прочитать
+  auto pos = r.entries.end();
+  while (pos != r.entries.begin()) {
+    auto prev = std::prev(pos);
+    if (prev->msgId == e.msgId) return;
+    if (prev->msgId < e.msgId) break;
+    pos = prev;
+  }
+  r.entries.insert(pos, std::move(e));
+  s.entries++;
+  touch(s, r);
+  trim(s, r);
+}
+
+void HistoryCache::appendEvent(int chat_id, TimelineEntry e) {
+  Section& s = section(chat_id);
+  std::lock_guard lk(s.mtx);
+  s.writes[epochSlot(chat_id)]++;
+  auto it = s.rings.find(chat_id);
+  if (it == s.rings.end()) return;
+  Ring& r = it->second;
+  e.msgId = 0;
+  r.entries.push_back(std::move(e));
+  s.entries++;
+  touch(s, r);
+  trim(s, r);
+}
+
+void HistoryCache::removeMessage(int chat_id, int msg_id) {
+  Section& s = section(chat_id);
+  std::lock_guard lk(s.mtx);
+  s.writes[epochSlot(chat_id)]++;
+  auto it = s.rings.find(chat_id);
+  if (it == s.rings.end()) return;
+  auto& e = it->second.entries;
+  auto m = std::find_if(e.begin(), e.end(), [&](const TimelineEntry& x) { return x.msgId == msg_id; });
+  if (m != e.end()) {
+    e.erase(m);
+    s.entries--;
+  }
+}
+
+void HistoryCache::hideFor(int chat_id, int msg_id, int user_id) {
+  Section& s = section(chat_id);
+  std::lock_guard lk(s.mtx);
+  s.writes[epochSlot(chat_id)]++;
+  auto it = s.rings.find(chat_id);
+  if (it == s.rings.end()) return;
+  for (auto& x : it->second.entries) {
+    if (x.msgId == msg_id) {
+      if (!hiddenFrom(x, user_id)) x.hiddenFor.push_back(user_id);
+      break;
+    }
+  }
+}
+
+void HistoryCache::clear() {
+  for (auto& s : sections) {
+    std::lock_guard lk(s.mtx);
+    for (auto& w : s.writes) w++;
+    s.rings.clear();
+    s.lru.clear();
+    s.entries = 0;
+  }
+}
+
+HistoryCacheStats HistoryCache::stats() const {
+  HistoryCacheStats st;
+  st.hits = hits.load();
+  st.misses = misses.load();
+  st.seeds = seeds.load();
+  st.evictions = evictions.load();
+  for (const auto& s : sections) {
+    std::lock_guard lk(s.mtx);
+    st.chats += s.rings.size();
+    st.entries += s.entries;
+  }
+  return st;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//Запись ленты чата: сообщение (msgId > 0) или событие входа/выхода (msgId == 0)
+struct TimelineEntry {
+    int msgId = 0;
+    std::string ts; //"YYYY-MM-DD HH:MM"
+    std::string from; //автор сообщения или участник события
+    std::string text; //текст сообщения или описание события
+    std::vector<int> hiddenFor; //кто удалил сообщение только у себя
+};
+
+//Метрики кэша истории
+struct HistoryCacheStats {
+    uint64_t hits = 0; //страниц отдано из памяти
+    uint64_t misses = 0; //страниц, за которыми пришлось идти в БД
+    uint64_t seeds = 0; //колец, заполненных хвостом из БД
+    uint64_t evictions = 0; //чатов, вытесненных по LRU
+    size_t chats = 0; //чатов в кэше
+    size_t entries = 0; //записей во всех кольцах
+};
+
+//Кэш последних записей ленты каждого чата: страница HISTORY отдаётся из памяти,
+//если целиком лежит в кольце
+//Кольцо чата ограничено perChat записями, все кольца вместе — maxEntries (лишние чаты вытесняются по LRU)
+//Чаты разложены по независимым секциям со своей блокировкой
+//
+//Кольцо заполняется из БД (seed) и дальше поддерживается записями SEND/DELETE/LEAVE_CHAT
+//Сообщения в кольце упорядочены по msg_id — тем же ключом, что и страницы истории в БД,
+//поэтому граница между страницей из кэша и страницей из БД не теряет и не повторяет записей
+//Запись, пришедшая во время чтения из БД, увеличивает epoch чата — такой снимок не кладётся
+class HistoryCache {
+public:
+    HistoryCache(size_t perChat, size_t maxEntries);
+
+    HistoryCache(const HistoryCache&) = delete;
+    HistoryCache& operator=(const HistoryCache&) = delete;
+
+    //Страница для user_id: до limit видимых сообщений строго раньше before (0 — самые новые)
+    //и события того же промежутка, по возрастанию времени
+    //false — страницы в кэше нет, нужно идти в БД
+    bool page(int chat_id, int user_id, int before, int limit,
+              std::vector<TimelineEntry>& out, bool& hasMore);
+
+    //Есть ли кольцо чата
+    bool contains(int chat_id) const;
+    //Снимок epoch перед чтением хвоста из БД
+    uint64_t epoch(int chat_id) const;
+    //Кладёт хвост ленты (по возрастанию времени), если с since в чат ничего не писали
+    //complete — старше этих записей в чате ничего нет
+    void seed(int chat_id, std::vector<TimelineEntry> entries, bool complete, uint64_t since);
+
+    //Отмечает запись в чат, результат которой появится в кольце позже (до записи в БД)
+    void beginWrite(int chat_id);
+    //Обновления после успешной записи в БД; если кольца чата нет, только сдвигают epoch
+    void appendMessage(int chat_id, TimelineEntry e);
+    void appendEvent(int chat_id, TimelineEntry e);
+    void removeMessage(int chat_id, int msg_id);
+    void hideFor(int chat_id, int msg_id, int user_id);
+    void clear();
+
+    HistoryCacheStats stats() const;
+
+private:
+    struct Ring {
+        std::deque<TimelineEntry> entries;
+        bool complete = false; //в кольце вся история чата
+        std::list<int>::iterator lru;
+    };
+    struct Section {
+        mutable std::mutex mtx;
+        std::unordered_map<int, Ring> rings;
+        std::list<int> lru; //chat_id, спереди — недавно использованные
+        size_t entries = 0;
+        uint64_t writes[64] = {}; //epoch по корзинам chat_id (есть и у чатов без кольца)
+    };
+    static constexpr size_t SECTIONS = 16;
+
+    static size_t epochSlot(int chat_id) { return (static_cast<unsigned>(chat_id) / SECTIONS) % 64; }
+
+    Section& section(int chat_id) { return sections[static_cast<unsigned>(chat_id) % SECTIONS]; }
+    const Section& section(int chat_id) const { return sections[static_cast<unsigned>(chat_id) % SECTIONS]; }
+    //Обрезает кольцо до perChat и вытесняет старые чаты секции сверх её доли maxEntries
+    void trim(Section& s, Ring& r);
+    void touch(Section& s, Ring& r);
+
+    size_t perChat;
+    size_t maxPerSection;
+    Section sections[SECTIONS];
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> seeds{0};
+    std::atomic<uint64_t> evictions{0};
+};
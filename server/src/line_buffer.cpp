@@ -0,0 +1,102 @@
+#include "line_buffer.h"
+#include "varint.h"
+
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+const char* findNewline(const char* p, size_t n) {
+  const char* end = p + n;
+#if defined(__AVX2__)
+  const __m256i nl32 = _mm256_set1_epi8('\n');
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl32)));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i nl16 = _mm_set1_epi8('\n');
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl16)));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p < end; ++p) {
+    if (*p == '\n') return p;
+  }
+  return nullptr;
+}
+
+LineBuffer::LineBuffer(size_t maxLine) : maxLine(maxLine) {}
+
+char* LineBuffer::prepare(size_t n) {
+  if (cap - tail >= n) return buf.get() + tail;
+
+  //Сначала пробуем обойтись сдвигом неразобранного остатка к началу
+  size_t live = tail - head;
+  if (head > 0 && cap - live >= n) {
+    std::memmove(buf.get(), buf.get() + head, live);
+  } else {
+    //Растём не меньше чем вдвое, чтобы частые мелкие чтения не перевыделяли буфер
+    size_t want = live + n;
+    size_t ncap = cap ? cap : n;
+    while (ncap < want) ncap *= 2;
+    std::unique_ptr<char[]> nbuf(new char[ncap]);
+    if (live) std::memcpy(nbuf.get(), buf.get() + head, live);
+    buf = std::move(nbuf);
+    cap = ncap;
+  }
+  scanned -= head;
+  tail = live;
+  head = 0;
+  return buf.get() + tail;
+}
+
+bool LineBuffer::next(std::string_view& line) {
+  if (framed) return nextFrame(line);
+  const char* base = buf.get();
+  const char* nl = findNewline(base + scanned, tail - scanned);
+  if (!nl) {
+    scanned = tail;
+    return false;
+  }
+  size_t end = nl - base;
+  size_t len = end - head;
+  //Убираем возможный '\r'
+  if (len && base[end - 1] == '\r') --len;
+  line = std::string_view(base + head, len);
+  head = scanned = end + 1;
+  if (head == tail) head = scanned = tail = 0; //всё разобрано — следующее чтение с начала буфера
+  return true;
+}
+
+bool LineBuffer::nextFrame(std::string_view& frame) {
+  if (badFrame) return false;
+  std::string_view avail(buf.get() + head, tail - head);
+  size_t pos = 0;
+  uint64_t len = 0;
+  if (!getVarint(avail, pos, len)) {
+    //Заголовок ещё не дошёл целиком; 10 байт без конца varint — это уже мусор
+    badFrame = avail.size() >= VARINT_MAX_BYTES;
+    return false;
+  }
+  if (len > maxLine) {
+    badFrame = true;
+    return false;
+  }
+  if (avail.size() - pos < len) return false;
+  frame = avail.substr(pos, len);
+  head += pos + len;
+  scanned = head;
+  if (head == tail) head = scanned = tail = 0;
+  return true;
+}
+
+void LineBuffer::clear() {
+  buf.reset();
+  cap = head = scanned = tail = 0;
+}
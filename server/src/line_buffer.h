@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+//Поиск '\n' в [p, p+n): SSE2/AVX2 по 16/32 байта за шаг, на других платформах — побайтно
+//nullptr — перевода строки нет
+const char* findNewline(const char* p, size_t n);
+
+//Входной буфер соединения с разбором на строки без копирования
+//Байты читаются прямо в свободный хвост буфера (prepare/commit), строки отдаются как string_view
+//Разобранное начало не стирается после каждой строки: остаток сдвигается к началу
+//только когда в хвосте не хватает места, поэтому пачка из K команд стоит O(суммы длин)
+//
+//Строка длиннее maxLine без '\n' — ошибка клиента (overflow), буфер дальше не растёт
+//
+//После перехода на бинарный протокол (setFramed) тот же буфер режется на кадры
+//<varint длина><байты>, next отдаёт тело кадра; кадр длиннее maxLine — тоже overflow
+class LineBuffer {
+public:
+    explicit LineBuffer(size_t maxLine);
+
+    LineBuffer(const LineBuffer&) = delete;
+    LineBuffer& operator=(const LineBuffer&) = delete;
+
+    //Свободное место под чтение не меньше n байт; действительно до следующего prepare
+    char* prepare(size_t n);
+    //Фиксирует n байт, записанных в область prepare
+    void commit(size_t n) { tail += n; }
+
+    //Следующая полная строка без '\n' и '\r' (или тело кадра); false — пока не пришла целиком
+    //line указывает внутрь буфера и действительна до следующего prepare/clear
+    bool next(std::string_view& line);
+
+    //Дальше во входных данных кадры, а не строки (уже принятые байты тоже разбираются как кадры)
+    void setFramed() { framed = true; }
+
+    //Незавершённая строка уже длиннее maxLine или пришёл слишком длинный/битый кадр
+    bool overflow() const { return badFrame || (!framed && tail - head > maxLine && scanned == tail); }
+    size_t pending() const { return tail - head; }
+    //Освобождает память (закрытое соединение)
+    void clear();
+
+private:
+    size_t maxLine;
+    std::unique_ptr<char[]> buf;
+    size_t cap = 0;
+    size_t head = 0; //начало неразобранных байт
+    size_t scanned = 0; //до сюда '\n' уже искали — незавершённую строку повторно не сканируем
+    size_t tail = 0; //конец прочитанных байт
+    bool framed = false;
+    bool badFrame = false;
+
+    bool nextFrame(std::string_view& frame);
+};
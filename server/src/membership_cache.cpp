@@ -0,0 +1,130 @@
+#include "membership_cache.h"
+
+#include <mutex>
+
+static uint64_t readKey(int chat_id, int user_id) {
+  return (uint64_t(uint32_t(chat_id)) << 32) | uint32_t(user_id);
+}
+
+template <class K, class V>
+const V* MembershipCache::Bounded<K, V>::find(const K& k) const {
+  auto it = map.find(k);
+  if (it == map.end()) return nullptr;
+  it->second.used.store(true, std::memory_order_relaxed);
+  return &it->second.value;
+}
+
+template <class K, class V>
+V* MembershipCache::Bounded<K, V>::find(const K& k) {
+  auto it = map.find(k);
+  return it == map.end() ? nullptr : &it->second.value;
+}
+
+template <class K, class V>
+V& MembershipCache::Bounded<K, V>::put(const K& k) {
+  auto [slot, inserted] = map.try_emplace(k);
+  if (!inserted) return slot->second.value;
+  order.push_back(k);
+
+  //Новая запись стоит в конце очереди: прежде чем дойти до неё, обход снимет все отметки
+  while (map.size() > cap) {
+    K victim = order.front();
+    order.pop_front();
+    auto it = map.find(victim);
+    if (it->second.used.exchange(false, std::memory_order_relaxed) || victim == k) {
+      order.push_back(victim); //второй шанс
+    } else {
+      map.erase(it);
+    }
+  }
+  return slot->second.value;
+}
+
+template <class K, class V>
+void MembershipCache::Bounded<K, V>::clear() {
+  map.clear();
+  order.clear();
+}
+
+MembershipCache::MembershipCache(size_t maxChats, size_t maxUsers, size_t maxMarks)
+  : chatMembers(maxChats), userChats(maxUsers), lastRead(maxMarks) {}
+
+int MembershipCache::isMember(int chat_id, int user_id) const {
+  std::shared_lock lk(mtx);
+  if (auto c = chatMembers.find(chat_id)) return c->count(user_id) ? 1 : 0;
+  //Список чатов пользователя тоже полный — годится для ответа
+  if (auto u = userChats.find(user_id)) return u->count(chat_id) ? 1 : 0;
+  return -1;
+}
+
+bool MembershipCache::chatsOf(int user_id, std::vector<int>& out) const {
+  std::shared_lock lk(mtx);
+  auto u = userChats.find(user_id);
+  if (!u) return false;
+  out.assign(u->begin(), u->end());
+  return true;
+}
+
+uint64_t MembershipCache::epoch() const {
+  std::shared_lock lk(mtx);
+  return writes;
+}
+
+void MembershipCache::installChat(int chat_id, const std::vector<int>& members, uint64_t since) {
+  if (members.empty()) return;
+  std::unique_lock lk(mtx);
+  if (writes != since) return; //пока читали из БД, состав менялся — снимок мог устареть
+  chatMembers.put(chat_id) = std::unordered_set<int>(members.begin(), members.end());
+}
+
+void MembershipCache::installUser(int user_id, const std::vector<int>& chats, uint64_t since) {
+  std::unique_lock lk(mtx);
+  if (writes != since) return;
+  userChats.put(user_id) = std::unordered_set<int>(chats.begin(), chats.end());
+}
+
+void MembershipCache::createChat(int chat_id, const std::vector<int>& members) {
+  std::unique_lock lk(mtx);
+  writes++;
+  //Чат только что создан, поэтому его состав известен полностью
+  if (!members.empty()) chatMembers.put(chat_id) = std::unordered_set<int>(members.begin(), members.end());
+  for (int u : members) {
+    if (auto chats = userChats.find(u)) chats->insert(chat_id);
+  }
+}
+
+void MembershipCache::add(int chat_id, int user_id) {
+  std::unique_lock lk(mtx);
+  writes++;
+  if (auto c = chatMembers.find(chat_id)) c->insert(user_id);
+  if (auto u = userChats.find(user_id)) u->insert(chat_id);
+}
+
+void MembershipCache::remove(int chat_id, int user_id) {
+  std::unique_lock lk(mtx);
+  writes++;
+  if (auto c = chatMembers.find(chat_id)) c->erase(user_id);
+  if (auto u = userChats.find(user_id)) u->erase(chat_id);
+  //Строка участника удалена вместе с границей; при повторном входе она начнётся с нуля
+  if (auto mark = lastRead.find(readKey(chat_id, user_id))) *mark = 0;
+}
+
+void MembershipCache::clear() {
+  std::unique_lock lk(mtx);
+  writes++;
+  chatMembers.clear();
+  userChats.clear();
+  lastRead.clear();
+}
+
+bool MembershipCache::readAdvances(int chat_id, int user_id, int msg_id) const {
+  std::shared_lock lk(mtx);
+  auto known = lastRead.find(readKey(chat_id, user_id));
+  return !known || msg_id > *known;
+}
+
+void MembershipCache::markRead(int chat_id, int user_id, int msg_id) {
+  std::unique_lock lk(mtx);
+  int& known = lastRead.put(readKey(chat_id, user_id));
+  if (msg_id > known) known = msg_id;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+//Индекс участия в чатах в памяти: chat -> участники и user -> чаты
+//Оба направления загружаются лениво и целиком (из БД), а записи Database обновляют уже загруженное
+//Незагруженный чат/пользователь — "не знаю", тогда Database спрашивает БД и заполняет индекс
+//
+//Гонка "загрузка из БД против записи": каждая запись увеличивает epoch; загрузчик запоминает
+//epoch до запроса и кладёт результат, только если за это время записей не было
+//
+//Размер ограничен: сверх maxChats/maxUsers/maxMarks записи вытесняются "вторым шансом" (CLOCK) —
+//чтение под разделяемой блокировкой лишь отмечает запись использованной, а уходит первая по очереди
+//неотмеченная. Вытесненная запись снова "неизвестна", и следующий запрос просто сходит в БД
+class MembershipCache {
+public:
+    explicit MembershipCache(size_t maxChats = 65536, size_t maxUsers = 65536, size_t maxMarks = 262144);
+
+    MembershipCache(const MembershipCache&) = delete;
+    MembershipCache& operator=(const MembershipCache&) = delete;
+
+    //1 — участник, 0 — нет, -1 — неизвестно (ни чат, ни пользователь не загружены)
+    int isMember(int chat_id, int user_id) const;
+    //Все чаты пользователя; false — пользователь не загружен
+    bool chatsOf(int user_id, std::vector<int>& out) const;
+
+    //Снимок счётчика записей для загрузчика
+    uint64_t epoch() const;
+    //Кладут полный список, прочитанный из БД, если с момента since ничего не менялось
+    //Пустой состав чата не кладётся: так выглядит и несуществующий chat_id, а его помнить незачем
+    void installChat(int chat_id, const std::vector<int>& members, uint64_t since);
+    void installUser(int user_id, const std::vector<int>& chats, uint64_t since);
+
+    //Изменения после успешной записи в БД
+    void createChat(int chat_id, const std::vector<int>& members);
+    void add(int chat_id, int user_id);
+    void remove(int chat_id, int user_id);
+    void clear();
+
+    //Граница прочитанного (last_read_msg_id), уже записанная в БД этим процессом
+    //true — msg_id её сдвигает (или она неизвестна) и UPDATE нужен
+    bool readAdvances(int chat_id, int user_id, int msg_id) const;
+    //Запоминает границу после успешного UPDATE; меньшее значение не откатывает её назад
+    void markRead(int chat_id, int user_id, int msg_id);
+
+private:
+    //Ограниченная таблица с вытеснением CLOCK; order — очередь вытеснения, в ней ровно ключи map
+    template <class K, class V>
+    struct Bounded {
+        struct Slot {
+            V value{};
+            mutable std::atomic<bool> used{false};
+        };
+        std::unordered_map<K, Slot> map;
+        std::deque<K> order;
+        size_t cap;
+
+        explicit Bounded(size_t cap) : cap(cap > 0 ? cap : 1) {}
+        //Поиск под разделяемой блокировкой: только отмечает запись использованной
+        const V* find(const K& k) const;
+        V* find(const K& k);
+        //Вставка под эксклюзивной блокировкой; вытесняет лишнее, но не саму k
+        V& put(const K& k);
+        void clear();
+    };
+
+    mutable std::shared_mutex mtx;
+    uint64_t writes = 0; //epoch, меняется только под эксклюзивной блокировкой
+    Bounded<int, std::unordered_set<int>> chatMembers; //загруженные чаты
+    Bounded<int, std::unordered_set<int>> userChats; //загруженные пользователи
+    Bounded<uint64_t, int> lastRead; //(chat << 32 | user) -> last_read_msg_id
+};
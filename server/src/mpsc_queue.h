@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+//Очередь без блокировок: много производителей, один потребитель (алгоритм Вьюкова)
+//push — wait-free из любого потока, pop — только из потока-потребителя
+//pop может временно вернуть false, пока производитель не дописал ссылку на свой узел;
+//поэтому производитель после push обязан сам разбудить потребителя (см. Reactor::post)
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() : head(&stub), tail(&stub) {}
+
+    ~MpscQueue() {
+        T tmp;
+        while (pop(tmp)) {}
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T value) {
+        pushNode(new Node(std::move(value)));
+    }
+
+    bool pop(T& out) {
+        Node* t = tail;
+        Node* next = t->next.load(std::memory_order_acquire);
+        //Пропускаем служебный узел
+        if (t == &stub) {
+            if (!next) return false;
+            tail = next;
+            t = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            out = std::move(t->value);
+            tail = next;
+            delete t;
+            return true;
+        }
+        //t — последний видимый узел; если голова ушла дальше, производитель ещё не дописал next
+        if (t != head.load(std::memory_order_acquire)) return false;
+        //Возвращаем служебный узел в конец, чтобы можно было забрать t
+        pushNode(&stub);
+        next = t->next.load(std::memory_order_acquire);
+        if (next) {
+            out = std::move(t->value);
+            tail = next;
+            delete t;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    struct Node {
+        Node() = default;
+        explicit Node(T v) : value(std::move(v)) {}
+        std::atomic<Node*> next{nullptr};
+        T value;
+    };
+
+    void pushNode(Node* n) {
+        n->next.store(nullptr, std::memory_order_relaxed);
+        Node* prev = head.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+    }
+
+    Node stub; //служебный узел, чтобы очередь никогда не была пустой физически
+    std::atomic<Node*> head; //сюда добавляют производители
+    Node* tail; //отсюда забирает потребитель
+};
@@ -0,0 +1,404 @@
+#include "pg_async.h"
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <utility>
+
+//Через сколько повторяем неудавшееся переподключение
+static constexpr std::chrono::milliseconds RECONNECT_DELAY{1000};
+
+struct AsyncPgPool::Slot {
+  PGconn* conn = nullptr;
+  int fd = -1; //сокет, зарегистрированный в реакторе; -1 — снят (соединение сломано)
+  uint32_t events = 0; //текущая подписка в epoll
+  bool leased = false;
+  bool broken = false; //состояние сессии неизвестно — переподключить при возврате в пул
+  bool reconnecting = false; //идёт PQresetPoll, события сокета — его
+  std::coroutine_handle<> waiter; //сопрограмма, ждущая ответа на запрос
+  bool pipelined = false; //ждём ответа на пакет (pipeline mode), а не на один запрос
+  bool queryStart = true; //следующий результат пакета — первый у очередного запроса
+  std::vector<PGresult*> results; //первый результат каждого запроса
+};
+
+//Сопрограмма, ждущая свободное соединение
+struct AsyncPgPool::Waiter {
+  std::coroutine_handle<> handle;
+  Slot* slot = nullptr; //выданное соединение; nullptr — не дождались
+  TimerMap::iterator timer;
+};
+
+namespace {
+
+//Приостанавливает сопрограмму; продолжит её тот, кому отдан handle
+struct Park {
+  std::coroutine_handle<>& handle;
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) const noexcept { handle = h; }
+  void await_resume() const noexcept {}
+};
+
+} // namespace
+
+AsyncPgPool::Lease& AsyncPgPool::Lease::operator=(Lease&& o) noexcept {
+  if (this != &o) {
+    reset();
+    pool = o.pool;
+    slot = o.slot;
+    o.slot = nullptr;
+  }
+  return *this;
+}
+
+PGconn* AsyncPgPool::Lease::get() const {
+  return slot ? slot->conn : nullptr;
+}
+
+void AsyncPgPool::Lease::reset() {
+  if (slot) {
+    pool->release(slot);
+    slot = nullptr;
+  }
+}
+
+Task<PGresult*> AsyncPgPool::Lease::exec(const char* stmt, int nParams, const char* const* values,
+                                         const int* lengths, const int* formats) {
+  Slot& s = *slot;
+  if (s.fd < 0 || PQsendQueryPrepared(s.conn, stmt, nParams, values, lengths, formats, 1) != 1) {
+    s.broken = true;
+    co_return nullptr;
+  }
+  //Запрос мог не поместиться в сокет целиком — остаток допишем по EPOLLOUT
+  int pending = PQflush(s.conn);
+  if (pending < 0) {
+    s.broken = true;
+    co_return nullptr;
+  }
+  s.pipelined = false;
+  s.queryStart = true;
+  pool->watch(s, EPOLLIN | (pending ? static_cast<uint32_t>(EPOLLOUT) : 0u));
+  co_await Park{s.waiter};
+  std::vector<PGresult*> results = std::exchange(s.results, {});
+  co_return results.empty() ? nullptr : results.front();
+}
+
+Task<std::vector<PGresult*>> AsyncPgPool::Lease::execPipeline(const std::vector<Query>& queries) {
+  Slot& s = *slot;
+  bool sent = s.fd >= 0 && PQenterPipelineMode(s.conn) == 1;
+  for (const Query& q : queries) {
+    sent = sent && PQsendQueryPrepared(s.conn, q.stmt, q.nParams, q.values, q.lengths, q.formats, 1) == 1;
+  }
+  if (!sent || PQpipelineSync(s.conn) != 1) {
+    s.broken = true;
+    co_return std::vector<PGresult*>{};
+  }
+  int pending = PQflush(s.conn);
+  if (pending < 0) {
+    s.broken = true;
+    co_return std::vector<PGresult*>{};
+  }
+  s.pipelined = true;
+  s.queryStart = true;
+  pool->watch(s, EPOLLIN | (pending ? static_cast<uint32_t>(EPOLLOUT) : 0u));
+  co_await Park{s.waiter};
+
+  std::vector<PGresult*> results = std::exchange(s.results, {});
+  if (results.size() != queries.size()) {
+    for (PGresult* r : results) PQclear(r);
+    s.broken = true;
+    results.clear();
+  }
+  co_return results;
+}
+
+AsyncPgPool::AsyncPgPool(Reactor& reactor, const std::string& conninfo, int size,
+                         std::chrono::milliseconds acquireTimeout, PgPool::ConnectHook onConnect)
+  : reactor(reactor), conninfo(conninfo), acquireTimeout(acquireTimeout), onConnect(std::move(onConnect)) {
+  timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timerFd < 0) {
+    perror("timerfd_create");
+    std::exit(1);
+  }
+  reactor.add(timerFd, EPOLLIN, [this](uint32_t) { onTimer(); });
+
+  int n = size > 0 ? size : 1;
+  for (int i = 0; i < n; ++i) {
+    auto s = std::make_unique<Slot>();
+    s->conn = PQconnectdb(conninfo.c_str());
+    if (PQstatus(s->conn) != CONNECTION_OK) {
+      std::cerr << "Ошибка подключения к БД: " << PQerrorMessage(s->conn);
+      std::exit(1);
+    }
+    if (this->onConnect && !this->onConnect(s->conn)) {
+      std::cerr << "Ошибка настройки соединения с БД: " << PQerrorMessage(s->conn);
+      std::exit(1);
+    }
+    PQsetnonblocking(s->conn, 1);
+    registerSocket(*s, EPOLLIN);
+    idle.push_back(s.get());
+    slots.push_back(std::move(s));
+  }
+}
+
+AsyncPgPool::~AsyncPgPool() {
+  //Реактор к этому моменту уже остановлен — только закрываем соединения
+  for (auto &s : slots) {
+    for (PGresult* r : s->results) PQclear(r);
+    if (s->conn) PQfinish(s->conn);
+  }
+  if (timerFd >= 0) close(timerFd);
+}
+
+//(Пере)регистрирует сокет соединения в реакторе
+//Снимаем и добавляем заново, даже если номер тот же: при переподключении libpq мог закрыть
+//старый сокет и открыть новый под тем же номером, а подписка epoll жила на старом
+void AsyncPgPool::registerSocket(Slot& s, uint32_t events) {
+  if (s.fd >= 0) reactor.remove(s.fd);
+  s.fd = PQsocket(s.conn);
+  s.events = events;
+  if (s.fd >= 0) reactor.add(s.fd, events, [this, sp = &s](uint32_t ev) { onSocket(*sp, ev); });
+}
+
+void AsyncPgPool::watch(Slot& s, uint32_t events) {
+  if (s.fd < 0 || s.events == events) return;
+  s.events = events;
+  reactor.modify(s.fd, events);
+}
+
+void AsyncPgPool::onSocket(Slot& s, uint32_t events) {
+  if (s.reconnecting) {
+    pollReconnect(s);
+    return;
+  }
+
+  if (!s.waiter) {
+    //Запроса нет: сервер прислал уведомление или закрыл соединение
+    if (PQconsumeInput(s.conn) && PQstatus(s.conn) == CONNECTION_OK) return;
+    s.broken = true;
+    reactor.remove(s.fd);
+    s.fd = -1;
+    if (!s.leased) {
+      idle.erase(std::find(idle.begin(), idle.end(), &s));
+      startReconnect(s);
+    }
+    return;
+  }
+
+  if (events & EPOLLOUT) {
+    int pending = PQflush(s.conn);
+    if (pending < 0) {
+      finishQuery(s, false);
+      return;
+    }
+    if (!pending) watch(s, EPOLLIN);
+  }
+  if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !PQconsumeInput(s.conn)) {
+    finishQuery(s, false);
+    return;
+  }
+  //Ответ может прийти частями — берём результаты, пока libpq не попросит ещё данных
+  while (!PQisBusy(s.conn)) {
+    PGresult* r = PQgetResult(s.conn);
+    if (s.pipelined) {
+      //В пакете NULL отделяет результаты одного запроса от следующего, а заканчивает его PIPELINE_SYNC
+      if (!r) {
+        s.queryStart = true;
+        continue;
+      }
+      if (PQresultStatus(r) == PGRES_PIPELINE_SYNC) {
+        PQclear(r);
+        finishQuery(s, PQexitPipelineMode(s.conn) == 1);
+        return;
+      }
+    } else if (!r) {
+      finishQuery(s, true);
+      return;
+    }
+    if (s.queryStart) s.results.push_back(r);
+    else PQclear(r);
+    s.queryStart = false;
+  }
+}
+
+//Ответ на запрос получен (или соединение сломалось) — продолжаем ждавшую его сопрограмму
+void AsyncPgPool::finishQuery(Slot& s, bool ok) {
+  if (ok) {
+    watch(s, EPOLLIN);
+  } else {
+    for (PGresult* r : s.results) PQclear(r);
+    s.results.clear();
+    s.broken = true;
+    reactor.remove(s.fd);
+    s.fd = -1;
+  }
+  std::exchange(s.waiter, {}).resume();
+}
+
+Task<AsyncPgPool::Lease> AsyncPgPool::acquire() {
+  if (!idle.empty()) {
+    Slot* s = idle.back();
+    idle.pop_back();
+    s->leased = true;
+    inUse++;
+    checkouts++;
+    co_return Lease(this, s);
+  }
+
+  //Свободных нет: ждём в очереди, поток тем временем работает дальше
+  auto start = Clock::now();
+  Waiter w;
+  w.timer = addTimer(start + acquireTimeout, [this, &w] {
+    waiters.erase(std::find(waiters.begin(), waiters.end(), &w));
+    w.handle.resume();
+  });
+  waiters.push_back(&w);
+  co_await Park{w.handle};
+
+  uint64_t waited = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+  totalWaitUs += waited;
+  if (waited > maxWaitUs.load()) maxWaitUs = waited;
+  if (!w.slot) {
+    failures++;
+    co_return Lease();
+  }
+  co_return Lease(this, w.slot);
+}
+
+void AsyncPgPool::release(Slot* s) {
+  s->leased = false;
+  inUse--;
+  //Сломанное соединение или незавершённая транзакция — сессии больше доверять нельзя
+  if (s->broken || PQstatus(s->conn) != CONNECTION_OK || PQtransactionStatus(s->conn) != PQTRANS_IDLE) {
+    startReconnect(*s);
+    return;
+  }
+  if (waiters.empty()) {
+    idle.push_back(s);
+    return;
+  }
+  //Отдаём первому ждущему; продолжится он задачей реактора, а не внутри освобождающего
+  Waiter* w = waiters.front();
+  waiters.pop_front();
+  cancelTimer(w->timer);
+  w->slot = s;
+  s->leased = true;
+  inUse++;
+  checkouts++;
+  std::coroutine_handle<> h = w->handle;
+  reactor.post([h] { h.resume(); });
+}
+
+//Переподключение без блокировки потока: PQresetStart, дальше PQresetPoll по событиям сокета
+void AsyncPgPool::startReconnect(Slot& s) {
+  if (s.fd >= 0) reactor.remove(s.fd);
+  s.fd = -1;
+  s.broken = false;
+  s.reconnecting = true;
+  if (!PQresetStart(s.conn)) {
+    std::cerr << "[DB] Не удалось переподключиться: " << PQerrorMessage(s.conn);
+    failures++;
+    addTimer(Clock::now() + RECONNECT_DELAY, [this, &s] { startReconnect(s); });
+    return;
+  }
+  //Как после PQconnectStart: первым делом ждём готовности сокета на запись
+  registerSocket(s, EPOLLOUT);
+}
+
+void AsyncPgPool::pollReconnect(Slot& s) {
+  switch (PQresetPoll(s.conn)) {
+  case PGRES_POLLING_READING:
+    registerSocket(s, EPOLLIN);
+    return;
+  case PGRES_POLLING_WRITING:
+    registerSocket(s, EPOLLOUT);
+    return;
+  case PGRES_POLLING_OK:
+    break;
+  default:
+    std::cerr << "[DB] Не удалось переподключиться: " << PQerrorMessage(s.conn);
+    failures++;
+    if (s.fd >= 0) reactor.remove(s.fd);
+    s.fd = -1;
+    addTimer(Clock::now() + RECONNECT_DELAY, [this, &s] { startReconnect(s); });
+    return;
+  }
+
+  //Новая серверная сессия ничего не знает о прежней настройке — повторяем её
+  //Настройка (PQprepare) идёт обычными блокирующими вызовами: это редкий и короткий случай
+  reconnects++;
+  s.reconnecting = false;
+  PQsetnonblocking(s.conn, 0);
+  bool ok = !onConnect || onConnect(s.conn);
+  PQsetnonblocking(s.conn, 1);
+  if (!ok) {
+    std::cerr << "[DB] Не удалось настроить соединение: " << PQerrorMessage(s.conn);
+    s.broken = true;
+  }
+  registerSocket(s, EPOLLIN);
+  //Возвращаем в пул как после аренды: ждущим или в свободные (сломанное — снова переподключится)
+  s.leased = true;
+  inUse++;
+  release(&s);
+}
+
+Task<void> AsyncPgPool::sleep(std::chrono::microseconds d) {
+  std::coroutine_handle<> h;
+  addTimer(Clock::now() + d, [&h] { h.resume(); });
+  co_await Park{h};
+}
+
+AsyncPgPool::TimerMap::iterator AsyncPgPool::addTimer(Clock::time_point at, std::function<void()> fire) {
+  auto it = timers.emplace(at, std::move(fire));
+  armTimer();
+  return it;
+}
+
+void AsyncPgPool::cancelTimer(TimerMap::iterator it) {
+  //timerFd не перевзводим: лишнее срабатывание просто ничего не найдёт
+  timers.erase(it);
+}
+
+//Взводит timerFd на ближайший срок, если он ещё не взведён на более ранний
+void AsyncPgPool::armTimer() {
+  if (timers.empty()) return;
+  Clock::time_point at = timers.begin()->first;
+  if (timerArmed != Clock::time_point{} && timerArmed <= at) return;
+  timerArmed = at;
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(at.time_since_epoch()).count();
+  itimerspec spec{};
+  spec.it_value.tv_sec = ns / 1000000000;
+  spec.it_value.tv_nsec = ns % 1000000000;
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1; //0 снял бы таймер
+  timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+void AsyncPgPool::onTimer() {
+  uint64_t ticks;
+  if (read(timerFd, &ticks, sizeof(ticks)) < 0) return;
+  timerArmed = {};
+  auto now = Clock::now();
+  //По одному: сработавший таймер может отменить или добавить другие
+  while (!timers.empty() && timers.begin()->first <= now) {
+    auto fire = std::move(timers.begin()->second);
+    timers.erase(timers.begin());
+    fire();
+  }
+  armTimer();
+}
+
+PoolStats AsyncPgPool::stats() const {
+  PoolStats st;
+  st.size = static_cast<int>(slots.size());
+  st.inUse = inUse.load();
+  st.checkouts = checkouts.load();
+  st.failures = failures.load();
+  st.reconnects = reconnects.load();
+  st.totalWaitUs = totalWaitUs.load();
+  st.maxWaitUs = maxWaitUs.load();
+  return st;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <postgresql/libpq-fe.h>
+
+#include "pgpool.h"
+#include "reactor.h"
+#include "task.h"
+
+//Неблокирующий пул соединений libpq, привязанный к одному реактору (потоку шарда)
+//Запрос уходит через PQsendQueryPrepared, сокет соединения (PQsocket) слушает реактор,
+//и сопрограмма, ждущая ответа, продолжается, когда ответ целиком пришёл — поток тем временем
+//обслуживает остальных клиентов. Все методы — только из потока реактора, поэтому без блокировок
+//Упавшее соединение переподключается в фоне (PQresetStart/PQresetPoll), не останавливая поток
+class AsyncPgPool {
+    struct Slot;
+    struct Waiter;
+
+public:
+    //Выданное соединение; при разрушении возвращается в пул
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(AsyncPgPool* pool, Slot* slot) : pool(pool), slot(slot) {}
+        Lease(Lease&& o) noexcept : pool(o.pool), slot(o.slot) { o.slot = nullptr; }
+        Lease& operator=(Lease&& o) noexcept;
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease() { reset(); }
+
+        PGconn* get() const;
+        explicit operator bool() const { return slot != nullptr; }
+
+        //Досрочно вернуть соединение в пул
+        void reset();
+
+        //Выполняет подготовленный запрос (аргументы как у PQsendQueryPrepared, ответ в двоичном формате)
+        //Массивы параметров должны жить до получения ответа
+        //nullptr — соединение сломалось (оно будет переподключено)
+        Task<PGresult*> exec(const char* stmt, int nParams, const char* const* values,
+                             const int* lengths, const int* formats);
+
+        //Подготовленный запрос пакета: аргументы PQsendQueryPrepared
+        struct Query {
+            const char* stmt;
+            int nParams;
+            const char* const* values;
+            const int* lengths;
+            const int* formats;
+        };
+
+        //Пакет запросов в pipeline mode libpq: уходят подряд одним сетевым проходом,
+        //ответы читаются после одного PQpipelineSync
+        //Пакет выполняется одной неявной транзакцией: ошибка одного запроса отменяет следующие
+        //(их результат — PGRES_PIPELINE_ABORTED)
+        //По результату на запрос (освобождает вызывающий); пустой — соединение сломалось
+        Task<std::vector<PGresult*>> execPipeline(const std::vector<Query>& queries);
+
+    private:
+        AsyncPgPool* pool = nullptr;
+        Slot* slot = nullptr;
+    };
+
+    //Открывает size соединений (блокирующе, при старте шарда) и регистрирует их в reactor
+    //При ошибке первого подключения завершает процесс, как и PgPool
+    AsyncPgPool(Reactor& reactor, const std::string& conninfo, int size,
+                std::chrono::milliseconds acquireTimeout, PgPool::ConnectHook onConnect = nullptr);
+    ~AsyncPgPool();
+
+    AsyncPgPool(const AsyncPgPool&) = delete;
+    AsyncPgPool& operator=(const AsyncPgPool&) = delete;
+
+    //Берёт свободное соединение; если все заняты — ждёт, не занимая поток, не дольше acquireTimeout
+    //Пустой Lease — таймаут или БД недоступна
+    Task<Lease> acquire();
+
+    //Приостанавливает сопрограмму на d (окно добора пачки group commit)
+    Task<void> sleep(std::chrono::microseconds d);
+
+    //Можно вызывать из любого потока
+    PoolStats stats() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+    using TimerMap = std::multimap<Clock::time_point, std::function<void()>>;
+
+    void release(Slot* slot);
+    void watch(Slot& s, uint32_t events);
+    void onSocket(Slot& s, uint32_t events);
+    void finishQuery(Slot& s, bool ok);
+    void startReconnect(Slot& s);
+    void pollReconnect(Slot& s);
+    void registerSocket(Slot& s, uint32_t events);
+
+    TimerMap::iterator addTimer(Clock::time_point at, std::function<void()> fire);
+    void cancelTimer(TimerMap::iterator it);
+    void armTimer();
+    void onTimer();
+
+    Reactor& reactor;
+    std::string conninfo;
+    std::chrono::milliseconds acquireTimeout;
+    PgPool::ConnectHook onConnect;
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::vector<Slot*> idle;
+    std::deque<Waiter*> waiters; //ждут соединение, по очереди
+
+    int timerFd = -1;
+    TimerMap timers;
+    Clock::time_point timerArmed; //на когда взведён timerFd, {} — не взведён
+
+    //Пишет только поток реактора, читает и поток статистики
+    std::atomic<int> inUse{0};
+    std::atomic<uint64_t> checkouts{0};
+    std::atomic<uint64_t> failures{0};
+    std::atomic<uint64_t> reconnects{0};
+    std::atomic<uint64_t> totalWaitUs{0};
+    std::atomic<uint64_t> maxWaitUs{0};
+};
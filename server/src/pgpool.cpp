@@ -0,0 +1,135 @@
+#include "pgpool.h"
+#include <iostream>
+
+PgPool::Lease& PgPool::Lease::operator=(Lease&& o) noexcept {
+  if (this != &o) {
+    reset();
+    pool = o.pool;
+    slot = o.slot;
+    o.slot = nullptr;
+  }
+  return *this;
+}
+
+void PgPool::Lease::reset() {
+  if (slot) {
+    pool->release(slot);
+    slot = nullptr;
+  }
+}
+
+PgPool::PgPool(const std::string& conninfo, const PoolConfig& cfg, ConnectHook onConnect)
+  : conninfo(conninfo), cfg(cfg), onConnect(std::move(onConnect)) {
+  int n = cfg.size > 0 ? cfg.size : 1;
+  for (int i = 0; i < n; ++i) {
+    auto s = std::make_unique<Slot>();
+    s->conn = PQconnectdb(conninfo.c_str());
+    if (PQstatus(s->conn) != CONNECTION_OK) {
+      std::cerr << "Ошибка подключения к БД: " << PQerrorMessage(s->conn);
+      std::exit(1);
+    }
+    if (this->onConnect && !this->onConnect(s->conn)) {
+      std::cerr << "Ошибка настройки соединения с БД: " << PQerrorMessage(s->conn);
+      std::exit(1);
+    }
+    s->lastUsed = std::chrono::steady_clock::now();
+    idle.push_back(s.get());
+    slots.push_back(std::move(s));
+  }
+}
+
+PgPool::~PgPool() {
+  for (auto &s : slots) {
+    if (s->conn) {
+      PQfinish(s->conn);
+      s->conn = nullptr;
+    }
+  }
+}
+
+//Проверяет соединение перед выдачей и при необходимости переподключает его
+bool PgPool::ensureHealthy(Slot& s) {
+  auto now = std::chrono::steady_clock::now();
+  bool ok = PQstatus(s.conn) == CONNECTION_OK && !s.broken;
+
+  //Долго простаивавшее соединение могло быть тихо закрыто сервером или сетью — проверяем запросом
+  if (ok && now - s.lastUsed > cfg.idleCheckAfter) {
+    PGresult* r = PQexec(s.conn, "SELECT 1");
+    ok = (PQresultStatus(r) == PGRES_TUPLES_OK);
+    PQclear(r);
+  }
+  if (ok) return true;
+
+  //Соединение упало — пробуем поднять его заново
+  PQreset(s.conn);
+  reconnects++;
+  s.broken = false;
+  if (PQstatus(s.conn) != CONNECTION_OK) {
+    std::cerr << "[DB] Не удалось переподключиться: " << PQerrorMessage(s.conn);
+    return false;
+  }
+  //Новая серверная сессия ничего не знает о прежней настройке — повторяем её
+  if (onConnect && !onConnect(s.conn)) {
+    std::cerr << "[DB] Не удалось настроить соединение: " << PQerrorMessage(s.conn);
+    return false;
+  }
+  return true;
+}
+
+PgPool::Lease PgPool::acquire() {
+  auto start = std::chrono::steady_clock::now();
+  Slot* s = nullptr;
+  {
+    std::unique_lock lk(mtx);
+    if (!cv.wait_for(lk, cfg.acquireTimeout, [this]{ return !idle.empty(); })) {
+      failures++;
+      return {};
+    }
+    s = idle.back();
+    idle.pop_back();
+  }
+
+  //Учитываем время ожидания
+  uint64_t waited = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start).count();
+  totalWaitUs += waited;
+  uint64_t prevMax = maxWaitUs.load();
+  while (waited > prevMax && !maxWaitUs.compare_exchange_weak(prevMax, waited)) {}
+
+  //Проверка и переподключение — уже без блокировки пула
+  if (!ensureHealthy(*s)) {
+    failures++;
+    {
+      std::lock_guard lk(mtx);
+      idle.push_back(s);
+    }
+    cv.notify_one();
+    return {};
+  }
+
+  inUse++;
+  checkouts++;
+  return Lease(this, s);
+}
+
+void PgPool::release(Slot* s) {
+  s->lastUsed = std::chrono::steady_clock::now();
+  inUse--;
+  {
+    std::lock_guard lk(mtx);
+    idle.push_back(s);
+  }
+  cv.notify_one();
+}
+
+PoolStats PgPool::stats() const {
+  PoolStats st;
+  st.size = static_cast<int>(slots.size());
+  st.inUse = inUse.load();
+  st.checkouts = checkouts.load();
+  st.failures = failures.load();
+  st.reconnects = reconnects.load();
+  st.totalWaitUs = totalWaitUs.load();
+  st.maxWaitUs = maxWaitUs.load();
+  return st;
+}
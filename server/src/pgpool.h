@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <postgresql/libpq-fe.h>
+
+//Настройки пула соединений с PostgreSQL
+struct PoolConfig {
+    int size = 8; //сколько соединений держим открытыми
+    std::chrono::milliseconds acquireTimeout{2000}; //сколько ждём свободное соединение
+    std::chrono::milliseconds idleCheckAfter{30000}; //простоявшее дольше соединение проверяем запросом перед выдачей
+};
+
+//Снимок метрик пула
+struct PoolStats {
+    int size = 0; //всего соединений
+    int inUse = 0; //выдано сейчас
+    uint64_t checkouts = 0; //успешных выдач
+    uint64_t failures = 0; //не дождались соединения или не смогли переподключиться
+    uint64_t reconnects = 0; //сколько раз поднимали упавшее соединение
+    uint64_t totalWaitUs = 0; //суммарное ожидание свободного соединения, мкс
+    uint64_t maxWaitUs = 0; //самое долгое ожидание, мкс
+};
+
+//Пул соединений libpq: выдача/возврат, проверка живости, переподключение и ограниченное ожидание
+class PgPool {
+    struct Slot {
+        PGconn* conn = nullptr;
+        std::chrono::steady_clock::time_point lastUsed;
+        bool broken = false; //состояние сессии неизвестно — переподключить перед следующей выдачей
+    };
+
+public:
+    //Выданное соединение; при разрушении возвращается в пул
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(PgPool* pool, Slot* slot) : pool(pool), slot(slot) {}
+        Lease(Lease&& o) noexcept : pool(o.pool), slot(o.slot) { o.slot = nullptr; }
+        Lease& operator=(Lease&& o) noexcept;
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease() { reset(); }
+
+        PGconn* get() const { return slot ? slot->conn : nullptr; }
+        explicit operator bool() const { return slot != nullptr; }
+
+        //Досрочно вернуть соединение в пул
+        void reset();
+
+        //Пометить соединение испорченным (например, запрос оборвался и сессии нельзя доверять):
+        //перед следующей выдачей оно переподключится
+        void markBroken() { if (slot) slot->broken = true; }
+
+    private:
+        PgPool* pool = nullptr;
+        Slot* slot = nullptr;
+    };
+
+    //Настройка свежего соединения (например, PQprepare); вызывается после подключения и каждого переподключения
+    //false — соединение непригодно
+    using ConnectHook = std::function<bool(PGconn*)>;
+
+    //Открывает cfg.size соединений; при ошибке первого подключения завершает процесс
+    PgPool(const std::string& conninfo, const PoolConfig& cfg, ConnectHook onConnect = nullptr);
+    ~PgPool();
+
+    PgPool(const PgPool&) = delete;
+    PgPool& operator=(const PgPool&) = delete;
+
+    //Берёт свободное исправное соединение, ждёт не дольше acquireTimeout
+    //Пустой Lease — таймаут или БД недоступна
+    Lease acquire();
+
+    PoolStats stats() const;
+
+private:
+    void release(Slot* slot);
+    bool ensureHealthy(Slot& slot);
+
+    std::string conninfo;
+    PoolConfig cfg;
+    ConnectHook onConnect;
+    std::vector<std::unique_ptr<Slot>> slots;
+
+    std::mutex mtx; //защищает только список свободных
+    std::condition_variable cv;
+    std::vector<Slot*> idle;
+
+    std::atomic<int> inUse{0};
+    std::atomic<uint64_t> checkouts{0};
+    std::atomic<uint64_t> failures{0};
+    std::atomic<uint64_t> reconnects{0};
+    std::atomic<uint64_t> totalWaitUs{0};
+    std::atomic<uint64_t> maxWaitUs{0};
+};
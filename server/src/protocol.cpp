@@ -0,0 +1,235 @@
+#include "protocol.h"
+#include "command.h"
+#include "varint.h"
+
+#include <charconv>
+#include <ctime>
+
+namespace {
+
+//Кадр бинарного протокола: тело собирается после места под длину, длина дописывается в finish
+class Frame {
+public:
+  explicit Frame(ReplyType type) {
+    buf.resize(VARINT_MAX_BYTES);
+    buf.push_back(static_cast<char>(type));
+  }
+  Frame& num(uint64_t v) {
+    putVarint(buf, v);
+    return *this;
+  }
+  Frame& flag(bool v) {
+    buf.push_back(v ? 1 : 0);
+    return *this;
+  }
+  Frame& time(std::string_view ts);
+  Frame& str(std::string_view s) {
+    putString(buf, s);
+    return *this;
+  }
+  //Длину ставим вплотную перед телом и отрезаем неиспользованный запас спереди
+  std::string finish() {
+    std::string len;
+    putVarint(len, buf.size() - VARINT_MAX_BYTES);
+    size_t start = VARINT_MAX_BYTES - len.size();
+    buf.replace(start, len.size(), len);
+    buf.erase(0, start);
+    return std::move(buf);
+  }
+
+private:
+  std::string buf;
+};
+
+int parseField(std::string_view ts, size_t pos, size_t len) {
+  int v = 0;
+  if (pos + len <= ts.size()) std::from_chars(ts.data() + pos, ts.data() + pos + len, v);
+  return v;
+}
+
+//"YYYY-MM-DD HH:MM" -> секунды, как если бы это было время UTC
+Frame& Frame::time(std::string_view ts) {
+  std::tm tm{};
+  tm.tm_year = parseField(ts, 0, 4) - 1900;
+  tm.tm_mon = parseField(ts, 5, 2) - 1;
+  tm.tm_mday = parseField(ts, 8, 2);
+  tm.tm_hour = parseField(ts, 11, 2);
+  tm.tm_min = parseField(ts, 14, 2);
+  putSignedVarint(buf, static_cast<int64_t>(timegm(&tm)));
+  return *this;
+}
+
+//Строковое поле текстового ответа: перевод строки внутри поля разорвал бы строку ответа,
+//а разделители записей списка (delims) — сам список; их заменяем, как в превью CHATS
+//Через него идут все строки из БД: имя или название, присланное бинарным кадром, может содержать что угодно
+void appendLine(std::string& out, std::string_view s, std::string_view delims = {}) {
+  for (char ch : s) {
+    if (ch == '\n' || ch == '\r') ch = ' ';
+    else if (delims.find(ch) != std::string_view::npos) ch = ',';
+    out.push_back(ch);
+  }
+}
+
+}  // namespace
+
+std::string encodeOk(Wire w, std::string_view what) {
+  if (w == Wire::Binary) return Frame(ReplyType::Ok).str(what).finish();
+  std::string out = "OK ";
+  out.append(what);
+  out += '\n';
+  return out;
+}
+
+std::string encodeError(Wire w, std::string_view code) {
+  if (w == Wire::Binary) return Frame(ReplyType::Error).str(code).finish();
+  std::string out = "ERROR";
+  if (!code.empty()) {
+    out += ' ';
+    out.append(code);
+  }
+  out += '\n';
+  return out;
+}
+
+std::string encodeSent(Wire w, int msgId) {
+  if (w == Wire::Binary) return Frame(ReplyType::Sent).num(msgId).finish();
+  return "OK SENT " + std::to_string(msgId) + "\n";
+}
+
+std::string encodeUserId(Wire w, int userId) {
+  if (w == Wire::Binary) return Frame(ReplyType::UserId).num(userId).finish();
+  return "USER_ID " + std::to_string(userId) + "\n";
+}
+
+std::string encodeChats(Wire w, const std::vector<ChatSummary>& chats) {
+  if (w == Wire::Binary) {
+    Frame f(ReplyType::Chats);
+    f.num(chats.size());
+    for (const auto& cs : chats) {
+      f.num(cs.chatId).flag(cs.isGroup).str(cs.name);
+      //Участники в БД склеены через запятую — в кадре это отдельные строки
+      std::string_view m = cs.members;
+      size_t n = m.empty() ? 0 : 1;
+      for (char ch : m) n += ch == ',';
+      f.num(n);
+      while (!m.empty()) {
+        size_t comma = m.find(',');
+        f.str(m.substr(0, comma));
+        m = comma == std::string_view::npos ? std::string_view() : m.substr(comma + 1);
+      }
+      f.num(cs.unread).str(cs.lastSender).str(cs.lastPreview);
+    }
+    return f.finish();
+  }
+
+  //<cid>:<is_group>:<name>:<участники через ,>:<непрочитанные>:<автор последнего>:<начало текста>;
+  std::string out = "CHATS ";
+  for (const auto& cs : chats) {
+    out += std::to_string(cs.chatId);
+    out += cs.isGroup ? ":1:" : ":0:";
+    appendLine(out, cs.name, ":;");
+    out += ':';
+    appendLine(out, cs.members, ":;");
+    out += ':';
+    out += std::to_string(cs.unread);
+    out += ':';
+    appendLine(out, cs.lastSender, ":;");
+    out += ':';
+    //Текст идёт последним полем, ':' в нём не мешает, а ';' разорвал бы список
+    appendLine(out, cs.lastPreview, ";");
+    out += ';'; //В конце ставим ; в качестве разделителя между чатами
+  }
+  out.back() = '\n'; //заменяем последний ';' (или пробел пустого списка) на '\n'
+  return out;
+}
+
+std::string encodeNewChat(Wire w, int chatId, bool isGroup, std::string_view title) {
+  if (w == Wire::Binary) return Frame(ReplyType::NewChat).num(chatId).flag(isGroup).str(title).finish();
+  std::string out = "NEW_CHAT " + std::to_string(chatId) + (isGroup ? " 1 " : " 0 ");
+  appendLine(out, title);
+  out += '\n';
+  return out;
+}
+
+std::string encodeNewMessage(Wire w, int chatId, int msgId, std::string_view ts,
+                             std::string_view from, std::string_view text) {
+  if (w == Wire::Binary) {
+    return Frame(ReplyType::NewMessage).num(chatId).num(msgId).time(ts).str(from).str(text).finish();
+  }
+  std::string out = "NEW_MESSAGE " + std::to_string(chatId) + " " + std::to_string(msgId) + " ";
+  out.append(ts);
+  out += ' ';
+  appendLine(out, from);
+  out += ' ';
+  appendLine(out, text);
+  out += '\n';
+  return out;
+}
+
+std::string encodeHistory(Wire w, int chatId, int before, bool hasMore,
+                          const std::vector<TimelineEntry>& entries) {
+  if (w == Wire::Binary) {
+    Frame f(ReplyType::History);
+    f.num(chatId).num(before).flag(hasMore).num(entries.size());
+    for (const auto& e : entries) f.num(e.msgId).time(e.ts).str(e.from).str(e.text);
+    return f.finish();
+  }
+
+  //HISTORY <chat_id> <before_msg_id> <has_more 0|1> <записи>
+  std::string out = "HISTORY " + std::to_string(chatId) + " " + std::to_string(before)
+                  + (hasMore ? " 1 " : " 0 ");
+  for (const auto& e : entries) {
+    out += '[';
+    out += e.ts;
+    if (e.msgId > 0) {
+      out += "] ";
+      appendLine(out, e.from, ";");
+      out += ": ";
+      appendLine(out, e.text);
+      out += " (id=" + std::to_string(e.msgId) + ");";
+    } else {
+      out += "] * ";
+      appendLine(out, e.from, ";");
+      out += ' ';
+      appendLine(out, e.text, ";");
+      out += ';';
+    }
+  }
+  out += '\n';
+  return out;
+}
+
+std::string encodeMsgDeleted(Wire w, int chatId, int msgId) {
+  if (w == Wire::Binary) return Frame(ReplyType::MsgDeleted).num(chatId).num(msgId).finish();
+  return "MSG_DELETED " + std::to_string(chatId) + " " + std::to_string(msgId) + "\n";
+}
+
+std::string encodeUserLeft(Wire w, int chatId, std::string_view username, std::string_view ts) {
+  if (w == Wire::Binary) return Frame(ReplyType::UserLeft).num(chatId).str(username).time(ts).finish();
+  std::string out = "USER_LEFT " + std::to_string(chatId) + " ";
+  appendLine(out, username);
+  out += ' ';
+  out.append(ts);
+  out += '\n';
+  return out;
+}
+
+std::string tagReply(Wire w, uint64_t tag, std::string_view encoded) {
+  std::string out;
+  if (w == Wire::Text) {
+    out = "#" + std::to_string(tag) + " ";
+    out.append(encoded);
+    return out;
+  }
+  //Кадр пересобираем: длина меняется на размер тега
+  uint64_t len = 0;
+  size_t pos = 0;
+  if (!getVarint(encoded, pos, len) || len == 0 || len > encoded.size() - pos) return std::string(encoded);
+  std::string body;
+  body.push_back(static_cast<char>(static_cast<uint8_t>(encoded[pos]) | TAG_FLAG));
+  putVarint(body, tag);
+  body.append(encoded.substr(pos + 1, len - 1));
+  putVarint(out, body.size());
+  out += body;
+  return out;
+}
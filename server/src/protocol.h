@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "db.h"
+#include "history_cache.h"
+
+//Ответы и уведомления сервера в обоих видах протокола
+//
+//Текстовый — строки, завершённые '\n' (исходный протокол, по умолчанию)
+//Бинарный включается командой "PROTO BIN" (ответ "OK PROTO BIN" ещё текстом), дальше
+//в обе стороны идут кадры <varint длина><u8 тип><поля>:
+//  число — varint; время — zigzag-varint секунд (время стены сервера, закодированное как UTC);
+//  строка — varint-длина и байты UTF-8, внутри допустимо что угодно
+//
+//  Ok          str что (REG/LOGIN/LEFT)
+//  Error       str код (пустой — просто ERROR)
+//  Sent        msg_id
+//  UserId      user_id
+//  Chats       n, n * {chat_id, u8 is_group, str name, m, m * str участник, unread, str last_from, str last_text}
+//  NewChat     chat_id, u8 is_group, str название (личный — "имя1,имя2")
+//  NewMessage  chat_id, msg_id, time, str from, str text
+//  History     chat_id, before_msg_id, u8 has_more, n, n * {msg_id (0 — событие), time, str from, str text}
+//  MsgDeleted  chat_id, msg_id
+//  UserLeft    chat_id, str username, time
+//
+//Ответ на команду с тегом запроса несёт тот же тег: текстом — префикс "#<тег> ",
+//в кадре — старший бит типа и varint-тег сразу за типом; уведомления тегов не имеют
+enum class Wire : uint8_t { Text, Binary };
+
+enum class ReplyType : uint8_t {
+    Ok = 1,
+    Error,
+    Sent,
+    UserId,
+    Chats,
+    NewChat,
+    NewMessage,
+    History,
+    MsgDeleted,
+    UserLeft,
+};
+
+std::string encodeOk(Wire w, std::string_view what);
+std::string encodeError(Wire w, std::string_view code = {});
+std::string encodeSent(Wire w, int msgId);
+std::string encodeUserId(Wire w, int userId);
+std::string encodeChats(Wire w, const std::vector<ChatSummary>& chats);
+std::string encodeNewChat(Wire w, int chatId, bool isGroup, std::string_view title);
+std::string encodeNewMessage(Wire w, int chatId, int msgId, std::string_view ts,
+                             std::string_view from, std::string_view text);
+std::string encodeHistory(Wire w, int chatId, int before, bool hasMore,
+                          const std::vector<TimelineEntry>& entries);
+std::string encodeMsgDeleted(Wire w, int chatId, int msgId);
+std::string encodeUserLeft(Wire w, int chatId, std::string_view username, std::string_view ts);
+
+//Помечает уже закодированный ответ тегом запроса
+std::string tagReply(Wire w, uint64_t tag, std::string_view encoded);
@@ -0,0 +1,112 @@
+#include "reactor.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+//Сколько событий забираем за один вызов epoll_wait
+static constexpr int MAX_EVENTS = 256;
+
+Reactor::Reactor() {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd < 0 || wakeFd < 0) {
+        perror("epoll/eventfd");
+        exit(1);
+    }
+
+    //eventfd слушаем как обычный fd, но обрабатываем отдельно в run()
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wakeFd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev);
+}
+
+Reactor::~Reactor() {
+    if (wakeFd >= 0) close(wakeFd);
+    if (epfd >= 0) close(epfd);
+}
+
+void Reactor::add(int fd, uint32_t events, Handler handler) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl ADD");
+        return;
+    }
+    handlers[fd] = std::move(handler);
+}
+
+void Reactor::modify(int fd, uint32_t events) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void Reactor::remove(int fd) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    handlers.erase(fd);
+}
+
+void Reactor::post(Task task) {
+    tasks.push(std::move(task));
+    //Будим поток только при первой задаче в пачке — остальные он заберёт вместе с ней
+    if (!wakePending.exchange(true)) {
+        uint64_t one = 1;
+        ssize_t n = write(wakeFd, &one, sizeof(one));
+        (void)n;
+    }
+}
+
+void Reactor::runTasks() {
+    //Сбрасываем флаг до разбора очереди: всё, что положат после, снова разбудит поток
+    wakePending.exchange(false);
+    Task t;
+    while (tasks.pop(t)) t();
+}
+
+void Reactor::run() {
+    loopThread = std::this_thread::get_id();
+    epoll_event events[MAX_EVENTS];
+
+    while (!stopping) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wakeFd) {
+                uint64_t v;
+                ssize_t r = read(wakeFd, &v, sizeof(v));
+                (void)r;
+                continue;
+            }
+            //fd мог быть снят с наблюдения обработчиком из этой же пачки
+            auto it = handlers.find(fd);
+            if (it == handlers.end()) continue;
+            //Копия: обработчик может удалить сам себя через remove()
+            Handler h = it->second;
+            h(events[i].events);
+        }
+
+        runTasks();
+    }
+    runTasks();
+}
+
+void Reactor::stop() {
+    stopping = true;
+    uint64_t one = 1;
+    ssize_t n = write(wakeFd, &one, sizeof(one));
+    (void)n;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+
+#include "mpsc_queue.h"
+
+//Цикл событий на epoll: один поток обслуживает много неблокирующих сокетов
+//Все обработчики fd вызываются только в потоке реактора, поэтому состояние,
+//принадлежащее реактору, не требует блокировок
+class Reactor {
+public:
+    //Обработчик событий fd (маска EPOLLIN/EPOLLOUT/...)
+    using Handler = std::function<void(uint32_t events)>;
+    //Задача, которую нужно выполнить в потоке реактора
+    using Task = std::function<void()>;
+
+    Reactor();
+    ~Reactor();
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    //Регистрирует fd с набором событий и обработчиком (только из потока реактора)
+    void add(int fd, uint32_t events, Handler handler);
+    //Меняет набор ожидаемых событий для fd
+    void modify(int fd, uint32_t events);
+    //Снимает fd с наблюдения (сам fd не закрывается)
+    void remove(int fd);
+
+    //Ставит задачу в очередь реактора, можно вызывать из любого потока
+    //Очередь без блокировок: производители не ждут друг друга и поток реактора
+    void post(Task task);
+
+    //true, если вызывающий поток — поток этого реактора
+    bool inLoop() const { return loopThread == std::this_thread::get_id(); }
+
+    //Крутит цикл событий до вызова stop()
+    void run();
+    //Просит цикл завершиться (из любого потока)
+    void stop();
+
+private:
+    void runTasks();
+
+    int epfd = -1; //дескриптор epoll
+    int wakeFd = -1; //eventfd для пробуждения из других потоков
+    std::atomic<bool> stopping{false};
+    std::thread::id loopThread;
+
+    std::unordered_map<int, Handler> handlers; //fd -> обработчик
+
+    MpscQueue<Task> tasks; //задачи от других потоков
+    std::atomic<bool> wakePending{false}; //eventfd уже взведён, повторно будить не нужно
+};
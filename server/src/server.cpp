@@ -1,50 +1,261 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include <thread>
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <atomic>
+#include <memory>
 #include <mutex>
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
 #include <tuple>
-#include <sstream>
+#include <iterator>
 #include <ctime>
+#include <cstdint>
+#include <chrono>
+#include <deque>
+#include <cerrno>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include "command.h"
+#include "compression.h"
 #include "db.h"
+#include "history_cache.h"
+#include "line_buffer.h"
+#include "protocol.h"
+#include "reactor.h"
+#include "subscriptions.h"
+#include "tls_session.h"
+#include "user_sessions.h"
 
 #define PORT 12345
-#define BACKLOG 10
+#define BACKLOG 1024
+
+//Сколько раз подряд читаем из одного сокета за событие, чтобы один клиент не занимал реактор
+#define READS_PER_EVENT 32
+//Сколько байт запрашиваем у SSL_read за раз (один TLS-record целиком)
+#define READ_CHUNK 16384
+//Максимальная длина одной команды клиента; длиннее — ошибка протокола, соединение закрывается
+#define MAX_LINE_LENGTH (64 * 1024)
+
+//Исходящая очередь соединения, байт: выше верхней отметки перестаём читать команды клиента,
+//ниже нижней — снова читаем; сверх жёсткого предела (или выше верхней отметки дольше таймаута)
+//считаем клиента медленным и отключаем, чтобы он не копил память сервера
+#define OUT_LOW_WATERMARK (256 * 1024)
+#define OUT_HIGH_WATERMARK (1024 * 1024)
+#define OUT_HARD_LIMIT (4 * 1024 * 1024)
+#define SLOW_CONSUMER_TIMEOUT_MS 10000
+
+//Склейка исходящих: уведомления (NEW_MESSAGE и т.п., но не ответы на команды клиента) копятся
+//до COALESCE_WINDOW_US после последнего, но не дольше COALESCE_MAX_DELAY_US после первого,
+//или пока не наберётся COALESCE_MAX_BYTES (полная TLS-запись), и уходят одним SSL_write;
+//окно 0 — отправлять сразу
+#define COALESCE_WINDOW_US 200
+#define COALESCE_MAX_DELAY_US 1000
+#define COALESCE_MAX_BYTES 16384
+
+//TLS-рукопожатия идут в отдельных потоках (с пониженным приоритетом), а не в шардах:
+//сколько потоков, сколько рукопожатий одновременно (сверх — соединение сразу закрывается),
+//за сколько рукопожатие должно завершиться и как часто это проверять
+#define HANDSHAKE_THREADS 2
+#define HANDSHAKE_NICE 5
+#define MAX_PENDING_HANDSHAKES 4096
+#define HANDSHAKE_TIMEOUT_MS 10000
+#define HANDSHAKE_SWEEP_MS 500
+
+//Kernel TLS: после рукопожатия записи шифрует ядро (если его поддерживают ядро, сборка OpenSSL
+//и согласованный шифр); исходящая очередь тогда уходит одним writev прямо из буферов ответов,
+//не более KTLS_IOV_MAX буферов за вызов; иначе — обычный SSL_write
+//Выигрыш против SSL_write пока не измерен: для этого нужно ядро с модулем tls (ULP)
+#define ENABLE_KTLS 1
+#define KTLS_IOV_MAX 64
+
+//Возобновление TLS-сессий: размер серверного кэша, время жизни сессии и период смены ключа билетов
+#define TLS_SESSION_CACHE_SIZE 20000
+#define TLS_SESSION_TIMEOUT_S 7200
+#define TLS_TICKET_KEY_ROTATION_S 3600
+
+//Пул соединений с БД: размер и сколько ждать свободное соединение
+//Обработчики команд ждут БД через неблокирующие соединения своего шарда (DB_ASYNC_CONNS_PER_SHARD
+//на поток), а общий блокирующий пул нужен только админским командам
+#define DB_POOL_SIZE 1
+#define DB_ASYNC_CONNS_PER_SHARD 8
+#define DB_ACQUIRE_TIMEOUT_MS 2000
+
+//Страница истории: сколько сообщений отдаём по умолчанию и максимум за один запрос
+#define HISTORY_PAGE_DEFAULT 50
+#define HISTORY_PAGE_MAX 200
+
+//Больше стольких непрочитанных в LIST_CHATS не считаем (клиент покажет "99+")
+#define UNREAD_CAP 100
+
+//Команды с тегом запроса выполняются параллельно (пока одна ждёт БД, разбирается следующая);
+//пока у клиента выполняется MAX_INFLIGHT_PER_CONN команд, его следующие команды не разбираются
+//и сокет не читается
+#define MAX_INFLIGHT_PER_CONN 32
+
+//Сжатие ответов (COMPRESS ZLIB): уровень zlib по умолчанию и с какого размера ответа сжимать;
+//мелкие ответы и уведомления уходят как есть
+//Уровень 1 сжимает историю в 4-5 раз вдвое быстрее уровня 6 (тот даёт лишь на 15-30% меньше)
+#define COMPRESS_LEVEL 1
+#define COMPRESS_MIN_BYTES 1024
+
+//Кэш истории: сколько последних записей ленты держим на чат и сколько всего на все чаты
+#define HISTORY_RING_SIZE 200
+#define HISTORY_CACHE_MAX_ENTRIES 200000
+
+//Group commit новых сообщений: полос, максимум сообщений в пачке, окно добора пачки (мкс, 0 — без ожидания)
+#define MSG_BATCH_LANES 4
+#define MSG_BATCH_MAX 64
+#define MSG_BATCH_WINDOW_US 0
 
 //Основной объект работы с БД
 static Database* db;
 
-//Флаг работы сервера и сокет слушателя
+//Последние записи ленты активных чатов — горячие страницы HISTORY без похода в БД
+static HistoryCache* historyCache;
+
+//Флаг работы сервера
 static std::atomic<bool> running{true};
-static int serverSock = -1;
 
-//Контекст и словарь SSL-сокетов
+//Контекст SSL
 static SSL_CTX* sslCtx = nullptr;
-static std::mutex sslMtx;
-static std::unordered_map<int, SSL*> sockToSsl;
 
-//Буферизация и подписчики для каждого клиента
-static std::mutex bufMtx;
-static std::unordered_map<int, std::string> sockBuf;
-static std::mutex subMtx;
-static std::unordered_map<int, std::vector<int>> subscribers;
+//Идентификатор соединения: номер шарда в старших 16 битах, порядковый номер внутри шарда в младших
+//В отличие от номера сокета не переиспользуется и сразу говорит, какой шард владеет соединением
+using ConnId = uint64_t;
+static constexpr int SHARD_SHIFT = 48;
+
+//Готовая к отправке строка протокола: собирается один раз и дальше только разделяется
+//Рассылка кладёт в очереди всех получателей один и тот же буфер — копируется лишь указатель
+using Payload = std::shared_ptr<const std::string>;
+
+static Payload makePayload(std::string msg) {
+    return std::make_shared<const std::string>(std::move(msg));
+}
+
+//Уведомление для рассылки в обоих видах протокола: каждый получатель берёт свой буфер
+struct Outgoing {
+    Payload text;
+    Payload binary;
+};
+
+//encode(Wire) -> std::string собирает сообщение в нужном виде протокола
+template <class Encode>
+static Outgoing makeOutgoing(Encode&& encode) {
+    return {makePayload(encode(Wire::Text)), makePayload(encode(Wire::Binary))};
+}
+
+struct Shard;
+struct Handshaker;
 
-//Отображение клиент <-> пользователь
-static std::mutex userMtx;
-static std::unordered_map<int, int> socketToUser;
-static std::unordered_map<int, std::vector<int>> userToSockets;
+//Состояние одного клиентского соединения
+//До конца TLS-рукопожатия его поля трогает только поток рукопожатий, затем — всю жизнь
+//только поток шарда-владельца (передача — через очередь реактора шарда)
+struct Connection {
+    ConnId id = 0;
+    int fd = -1;
+    Shard* shard = nullptr;
+    SSL* ssl = nullptr;
+    bool established = false; //TLS-рукопожатие завершено
+    bool closed = false; //соединение уже закрыто dropClient
+    uint32_t events = 0; //текущая подписка в epoll
+    Handshaker* handshaker = nullptr; //поток рукопожатий, пока сессия не установлена
+    std::chrono::steady_clock::time_point handshakeDeadline; //не успел — закрываем
+    bool handshakeWantsWrite = false; //SSL_accept ждёт готовности на запись
+    bool ktlsSend = false; //записи шифрует ядро: пишем в сокет напрямую, минуя SSL_write
+    bool readWantsWrite = false; //SSL_read ждёт готовности на запись
+    bool writeWantsRead = false; //SSL_write ждёт входящих данных
+    LineBuffer in{MAX_LINE_LENGTH}; //входящие байты, ещё не разобранные на строки
+    std::deque<Payload> out; //исходящие строки, ещё не принятые SSL_write
+    size_t outHead = 0; //сколько байт первой строки out уже отправлено
+    size_t outBytes = 0; //всего неотправленных байт в out
+    bool flushPending = false; //соединение уже стоит в очереди на отправку шарда
+    bool coalescing = false; //в очереди только уведомления, ждём окна склейки
+    std::chrono::steady_clock::time_point coalesceStart; //когда поставлено первое из них
+    std::chrono::steady_clock::time_point flushDeadline; //когда отправить, если ничего не изменится
+    bool congested = false; //очередь выше верхней отметки: чтение команд приостановлено
+    bool dropping = false; //признан медленным, закрытие уже запланировано
+    std::chrono::steady_clock::time_point congestedSince;
+    int userId = -1; //залогиненный пользователь
+    bool binary = false; //клиент перешёл на бинарный протокол (PROTO BIN)
+    int inFlight = 0; //команд с тегом ещё выполняется (ждут БД)
+    bool commandRunning = false; //команда без тега ждёт БД; её строка ещё во входном буфере
+    bool commandsPaused = false; //разбор команд остановлен до завершения выполняющихся
+    int compressLevel = 0; //уровень zlib для крупных ответов, 0 — без сжатия (COMPRESS ZLIB)
+};
+
+//Шард: свой слушающий сокет (SO_REUSEPORT), свой реактор и поток, закреплённый за ядром
+//Соединения шарда лежат в conns и доступны только его потоку, поэтому без блокировок
+//Другие шарды передают ему работу через очередь реактора (Reactor::post)
+struct Shard {
+    int index = 0;
+    Reactor reactor;
+    int listenSock = -1;
+    uint64_t nextSeq = 1; //0 зарезервирован под «нет соединения»
+    std::unordered_map<ConnId, std::shared_ptr<Connection>> conns;
+    //Соединения с новыми исходящими данными; отправляются задачей реактора,
+    //когда обработчик, поставивший данные, уже вернулся и не держит никаких блокировок
+    std::vector<std::shared_ptr<Connection>> flushQueue;
+    //Соединения, чьи уведомления ждут окна склейки, и таймер их отправки
+    std::vector<std::shared_ptr<Connection>> coalesceQueue;
+    int timerFd = -1;
+    std::chrono::steady_clock::time_point timerArmed; //на когда взведён таймер, {} — не взведён
+    //Вызовы SSL_write/writev и отправленные через них сообщения: сколько сообщений в среднем на запись
+    std::atomic<uint64_t> sendCalls{0};
+    std::atomic<uint64_t> sentMessages{0};
+    std::thread thread;
+};
+static std::vector<std::unique_ptr<Shard>> shards;
+static thread_local Shard* currentShard = nullptr; //шард, в потоке которого мы работаем
+
+//Поток рукопожатий: свой реактор, в котором идут неблокирующие SSL_accept новых соединений
+//Шарды заняты только установленными сессиями, поэтому волна переподключений не задерживает
+//доставку сообщений уже подключённым клиентам; готовое соединение передаётся шарду,
+//который его принял
+struct Handshaker {
+    Reactor reactor;
+    int timerFd = -1; //раз в HANDSHAKE_SWEEP_MS закрываем рукопожатия, не уложившиеся в срок
+    std::unordered_map<ConnId, std::shared_ptr<Connection>> pending; //рукопожатия этого потока
+    std::thread thread;
+};
+static std::vector<std::unique_ptr<Handshaker>> handshakers;
+static std::atomic<size_t> nextHandshaker{0};
+
+//Сколько клиентов отключено как медленные потребители
+static std::atomic<uint64_t> slowConsumerDrops{0};
+
+//Завершённые TLS-рукопожатия: полные и возобновлённые (по билету или кэшу сессий)
+static std::atomic<uint64_t> fullHandshakes{0};
+static std::atomic<uint64_t> resumedHandshakes{0};
+//Сколько установленных сессий отправляют через kernel TLS
+static std::atomic<uint64_t> ktlsSessions{0};
+//Рукопожатия: идут сейчас (не больше MAX_PENDING_HANDSHAKES), закрыты по сроку, отклонены сверх лимита
+static std::atomic<int> pendingHandshakes{0};
+static std::atomic<uint64_t> handshakeTimeouts{0};
+static std::atomic<uint64_t> handshakeRejects{0};
+
+//Подписчики на чаты (в обе стороны: chat -> соединения, соединение -> чаты)
+static SubscriptionRegistry subscriptions;
+
+//Отображение пользователь -> его соединения (с нескольких устройств)
+static UserSessions userSessions;
 
 //Инициализация OpenSSL: создаём контекст, загружаем сертификат/ключ
 void init_openssl()
@@ -73,610 +284,1200 @@ void init_openssl()
                 "Private key does not match the certificate public key\n";
         exit(1);
     }
+
+    //Неблокирующие сокеты: SSL_write может записать часть буфера и
+    //повторяться с другим адресом буфера (мы дописываем в std::string)
+    //RELEASE_BUFFERS освобождает буферы простаивающих соединений — их у нас большинство
+    SSL_CTX_set_mode(sslCtx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                             SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                             SSL_MODE_RELEASE_BUFFERS);
+
+    //Kernel TLS: OpenSSL сам передаст ключи ядру, если шифр и ядро это позволяют (модуль tls),
+    //иначе соединение молча остаётся на обычном SSL_write
+#ifdef SSL_OP_ENABLE_KTLS
+    if (ENABLE_KTLS) SSL_CTX_set_options(sslCtx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    //Переподключение клиента (смена сети, перезапуск) — сокращённое рукопожатие без подписи сертификатом
+    TlsSessionConfig tlsCfg;
+    tlsCfg.cacheSize = TLS_SESSION_CACHE_SIZE;
+    tlsCfg.timeout = std::chrono::seconds(TLS_SESSION_TIMEOUT_S);
+    tlsCfg.ticketKeyRotation = std::chrono::seconds(TLS_TICKET_KEY_ROTATION_S);
+    enableSessionResumption(sslCtx, tlsCfg);
 }
 
+static void dropClient(const std::shared_ptr<Connection>& c);
+static void doRead(const std::shared_ptr<Connection>& c);
 
-//Отправка строки по SSL — берём SSL* из sockToSsl по номеру сокета
-static void sendSSL(int sock, const std::string& msg) {
-    //Каждому клиентскому сокету мы при успешном рукопожатии сохраняем
-    //указатель SSL* в map<int,SSL*> sockToSsl
-    SSL* ssl = nullptr;
-    {
-        //Захватываем мьютекс, чтобы безопасно читать из общей структуры sockToSsl
-        std::lock_guard lk(sslMtx);
-        auto it = sockToSsl.find(sock);
-        if (it!=sockToSsl.end()) ssl = it->second;
+//Принимаем ли сейчас команды клиента: есть куда класть ответы, не исчерпан лимит команд с тегом
+//и не ждёт БД команда без тега (следующие идут строго после неё)
+static bool acceptsCommands(const Connection& c) {
+    return !c.congested && !c.commandRunning && c.inFlight < MAX_INFLIGHT_PER_CONN;
+}
+
+//Пересчитывает подписку соединения в epoll: EPOLLOUT, пока есть что отправить (и не ждём окна склейки),
+//EPOLLIN, пока принимаем команды (или TLS для записи нужно что-то прочитать)
+static void updateInterest(Connection& c) {
+    bool wantOut = (c.outBytes > 0 && !c.coalescing) || c.readWantsWrite;
+    bool wantIn = acceptsCommands(c) || c.writeWantsRead;
+    uint32_t ev = EPOLLRDHUP | (wantIn ? static_cast<uint32_t>(EPOLLIN) : 0u)
+                            | (wantOut ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    if (ev == c.events) return;
+    c.events = ev;
+    c.shard->reactor.modify(c.fd, ev);
+}
+
+//Снимает с начала исходящей очереди n отправленных байт
+static void consumeOut(Connection& c, size_t n) {
+    c.outBytes -= n;
+    while (!c.out.empty()) {
+        size_t left = c.out.front()->size() - c.outHead;
+        if (n < left) {
+            c.outHead += n;
+            return;
+        }
+        n -= left;
+        c.out.pop_front();
+        c.outHead = 0;
+        c.shard->sentMessages.fetch_add(1, std::memory_order_relaxed);
     }
+}
 
-    //Если SSL* не нашли, выходим, ничего не отправляя
-    if (!ssl) return;
+//Начало исходящей очереди для одного SSL_write: мелкие сообщения склеиваются в buf,
+//чтобы ушли одной TLS-записью (и обычно одним TCP-сегментом), а не записью на каждое;
+//крупное сообщение отдаётся как есть, без копии
+//При повторе после WANT_WRITE получится то же начало очереди, не короче, как и требует OpenSSL
+static std::string_view gatherOut(const Connection& c, std::string& buf) {
+    const std::string& front = *c.out.front();
+    std::string_view head(front.data() + c.outHead, front.size() - c.outHead);
+    if (c.out.size() == 1 || head.size() >= COALESCE_MAX_BYTES) return head;
+    buf.assign(head);
+    for (auto it = std::next(c.out.begin()); it != c.out.end() && buf.size() < COALESCE_MAX_BYTES; ++it) {
+        buf.append(**it, 0, COALESCE_MAX_BYTES - buf.size());
+    }
+    return buf;
+}
 
-    //Пишем в SSL: автоматически шифруется и отправляется по TCP
-    SSL_write(ssl, msg.data(), msg.size());
+//Kernel TLS: ядро само режет поток на записи и шифрует их, поэтому очередь уходит одним writev
+//прямо из разделяемых буферов ответов — без копии в буфер OpenSSL и шифрования в user space
+//Возвращает как write: отправлено байт или -1 с errno
+static ssize_t writeOutKtls(Connection& c) {
+    iovec iov[KTLS_IOV_MAX];
+    int n = 0;
+    size_t skip = c.outHead;
+    for (auto it = c.out.begin(); it != c.out.end() && n < KTLS_IOV_MAX; ++it, ++n) {
+        const std::string& msg = **it;
+        iov[n].iov_base = const_cast<char*>(msg.data() + skip);
+        iov[n].iov_len = msg.size() - skip;
+        skip = 0;
+    }
+    return writev(c.fd, iov, n);
 }
 
-//Корректно выкидываем клиента: SSL_shutdown, чистим буферы, подписки и закрываем TCP
-void dropClient(int s) {
-    //1) TLS: завершение и освобождение структуры SSL*
-    {
-        std::lock_guard lk(sslMtx);
-        if (sockToSsl.count(s)) {
-            SSL_shutdown(sockToSsl[s]);
-            SSL_free(sockToSsl[s]);
-            sockToSsl.erase(s);
+//Пытается отдать накопленные исходящие байты в SSL_write (или сразу в сокет при kernel TLS)
+//false — соединение сломано и его надо закрыть
+static bool flushOut(const std::shared_ptr<Connection>& c) {
+    static thread_local std::string gathered;
+    c->writeWantsRead = false;
+    c->coalescing = false; //уходит вся очередь, ждать окна склейки больше незачем
+    while (!c->out.empty()) {
+        c->shard->sendCalls.fetch_add(1, std::memory_order_relaxed);
+        if (c->ktlsSend) {
+            ssize_t n = writeOutKtls(*c);
+            if (n >= 0) {
+                consumeOut(*c, static_cast<size_t>(n));
+                continue;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break; //сокет заполнен — ждём EPOLLOUT
+            return false;
         }
+        std::string_view chunk = gatherOut(*c, gathered);
+        int n = SSL_write(c->ssl, chunk.data(), static_cast<int>(chunk.size()));
+        if (n > 0) {
+            consumeOut(*c, static_cast<size_t>(n));
+            continue;
+        }
+        int err = SSL_get_error(c->ssl, n);
+        if (err == SSL_ERROR_WANT_WRITE) break; //сокет заполнен — ждём EPOLLOUT
+        if (err == SSL_ERROR_WANT_READ) { //TLS нужно сначала что-то прочитать
+            c->writeWantsRead = true;
+            break;
+        }
+        return false;
     }
-    //2) Буфер входящих данных
-    {
-        std::lock_guard lk(bufMtx);
-        sockBuf.erase(s);
+
+    //Клиент разобрал очередь — снова читаем его команды
+    //Часть данных могла остаться внутри SSL, epoll о них не сообщит — дочитываем задачей
+    bool resumed = c->congested && c->outBytes <= OUT_LOW_WATERMARK;
+    if (resumed) c->congested = false;
+    updateInterest(*c);
+    if (resumed) c->shard->reactor.post([c]{ if (!c->closed) doRead(c); });
+    return true;
+}
+
+//Отправляет всё, что накопилось у соединений шарда за проход цикла событий
+static void flushShard(Shard* sh) {
+    std::vector<std::shared_ptr<Connection>> batch;
+    batch.swap(sh->flushQueue);
+    for (auto &c : batch) {
+        c->flushPending = false;
+        if (!c->closed && !flushOut(c)) dropClient(c);
     }
-    //3) Отписываем из подписок на чаты
-    {
-        std::lock_guard lk(subMtx);
-        for (auto &kv : subscribers)
-            kv.second.erase(std::remove(kv.second.begin(), kv.second.end(), s),
-                            kv.second.end());
+}
+
+//Взводит таймер склейки шарда на deadline, если он не взведён на более ранний срок
+static void armCoalesceTimer(Shard* sh, std::chrono::steady_clock::time_point deadline) {
+    if (sh->timerArmed != std::chrono::steady_clock::time_point{} && sh->timerArmed <= deadline) return;
+    sh->timerArmed = deadline;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+    itimerspec at{};
+    at.it_value.tv_sec = ns / 1000000000;
+    at.it_value.tv_nsec = ns % 1000000000;
+    timerfd_settime(sh->timerFd, TFD_TIMER_ABSTIME, &at, nullptr);
+}
+
+//Отправка по окончании окна склейки: соединения, чей срок вышел, отправляем,
+//остальные (срок сдвинули новые уведомления) ждут следующего срабатывания таймера
+static void onCoalesceTimer(Shard* sh) {
+    uint64_t ticks;
+    if (read(sh->timerFd, &ticks, sizeof(ticks)) < 0) return;
+    sh->timerArmed = {};
+    auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+    std::vector<std::shared_ptr<Connection>> due, waiting;
+    for (auto &c : sh->coalesceQueue) {
+        if (c->closed || !c->coalescing) continue; //уже отправлено другим путём
+        if (c->flushDeadline <= now) {
+            c->coalescing = false; //одно соединение могло попасть в очередь дважды
+            due.push_back(c);
+        } else {
+            waiting.push_back(c);
+            next = std::min(next, c->flushDeadline);
+        }
     }
-    //4) Убираем связь socket->user и user->socket
-    {
-        std::lock_guard lk(userMtx);
-        if (socketToUser.count(s)) {
-            int u = socketToUser[s];
-            socketToUser.erase(s);
-            auto &v = userToSockets[u];
-            v.erase(std::remove(v.begin(),v.end(),s),v.end());
+    sh->coalesceQueue.swap(waiting);
+    for (auto &c : due) {
+        if (!c->closed && !flushOut(c)) dropClient(c);
+    }
+    if (!sh->coalesceQueue.empty()) armCoalesceTimer(sh, next);
+}
+
+//Откладывает отправку уведомления до конца окна склейки
+static void deferFlush(const std::shared_ptr<Connection>& c) {
+    auto now = std::chrono::steady_clock::now();
+    Shard* sh = c->shard;
+    if (!c->coalescing) {
+        c->coalescing = true;
+        c->coalesceStart = now;
+        sh->coalesceQueue.push_back(c);
+    }
+    c->flushDeadline = std::min(now + std::chrono::microseconds(COALESCE_WINDOW_US),
+                                c->coalesceStart + std::chrono::microseconds(COALESCE_MAX_DELAY_US));
+    armCoalesceTimer(sh, c->flushDeadline);
+}
+
+//Отключает клиента, который не успевает забирать свои данные
+static void dropSlowConsumer(const std::shared_ptr<Connection>& c) {
+    slowConsumerDrops++;
+    std::cerr << "[SERVER] Slow consumer dropped, queued " << c->outBytes << " bytes\n";
+    //Очередь больше не нужна — освобождаем память сразу
+    c->dropping = true;
+    c->out.clear();
+    c->outHead = 0;
+    c->outBytes = 0;
+    //Закрываем не здесь: вызывающий ещё работает с этим соединением (например, посреди рассылки)
+    c->shard->reactor.post([c]{ dropClient(c); });
+}
+
+//Ставит строку в исходящую очередь соединения (только в потоке владельца)
+//Сам сокет здесь не трогаем: запись выполнит задача шарда после текущего обработчика,
+//поэтому вызывающий может держать любые блокировки
+//coalesce — уведомление, которое можно придержать на окно склейки; ответ клиенту уходит сразу
+//(вместе со всем, что уже ждёт в очереди)
+static void queueOut(const std::shared_ptr<Connection>& c, const Payload& msg, bool coalesce = false) {
+    if (c->closed || c->dropping || !c->established) return;
+    bool idle = (c->outBytes == 0 || c->coalescing) && !c->writeWantsRead;
+    c->out.push_back(msg);
+    c->outBytes += msg->size();
+
+    //Ограничение очереди: сверх жёсткого предела или слишком долго выше верхней отметки — отключаем
+    if (c->outBytes > OUT_HIGH_WATERMARK) {
+        auto now = std::chrono::steady_clock::now();
+        if (!c->congested) {
+            c->congested = true;
+            c->congestedSince = now;
+            updateInterest(*c);
+        } else if (now - c->congestedSince > std::chrono::milliseconds(SLOW_CONSUMER_TIMEOUT_MS)) {
+            dropSlowConsumer(c);
+            return;
+        }
+        if (c->outBytes > OUT_HARD_LIMIT) {
+            dropSlowConsumer(c);
+            return;
+        }
+    }
+
+    //Если уже ждём EPOLLOUT, байты уйдут по событию
+    if (!idle || c->flushPending) return;
+    if (coalesce && COALESCE_WINDOW_US > 0 && c->outBytes < COALESCE_MAX_BYTES) {
+        deferFlush(c);
+        return;
+    }
+    c->flushPending = true;
+    Shard* sh = c->shard;
+    if (sh->flushQueue.empty()) sh->reactor.post([sh]{ flushShard(sh); });
+    sh->flushQueue.push_back(c);
+}
+
+//Выполняемая команда клиента: соединение и его состояние на момент разбора команды
+//Команда может ждать БД, пока шард разбирает следующие команды (с тегом) и обслуживает других клиентов
+struct CommandContext {
+    std::shared_ptr<Connection> conn;
+    int userId = -1; //залогиненный пользователь
+    Wire wire = Wire::Text; //протокол, в котором отвечать
+    bool tagged = false; //тег запроса повторяется в ответе
+    uint64_t tag = 0;
+    int compressLevel = 0; //сжимать ли крупный ответ
+};
+
+//Ответ клиенту на выполняемую команду
+//Сообщение кодируется только в протоколе этого клиента (и сжимается, если он просил)
+//Команды выполняются в потоке шарда-владельца, поэтому ответ сразу кладётся в его очередь
+template <class Encode>
+static void reply(const CommandContext& ctx, Encode&& encode) {
+    std::string msg = encode(ctx.wire);
+    if (ctx.tagged) msg = tagReply(ctx.wire, ctx.tag, msg);
+    if (ctx.compressLevel > 0 && msg.size() >= COMPRESS_MIN_BYTES) compressMessage(msg, ctx.compressLevel, msg);
+    queueOut(ctx.conn, makePayload(std::move(msg)));
+}
+
+static void replyOk(const CommandContext& ctx, std::string_view what) {
+    reply(ctx, [&](Wire w) { return encodeOk(w, what); });
+}
+
+static void replyError(const CommandContext& ctx, std::string_view code = {}) {
+    reply(ctx, [&](Wire w) { return encodeError(w, code); });
+}
+
+//Доставка соединению своего шарда (только в потоке этого шарда)
+static void deliverLocal(Shard* sh, ConnId id, const Outgoing& msg) {
+    auto it = sh->conns.find(id);
+    if (it != sh->conns.end()) queueOut(it->second, it->second->binary ? msg.binary : msg.text, true);
+}
+
+//Рассылка одного уведомления списку соединений (кроме except)
+//Шард-владелец определяется прямо по идентификатору соединения; запись выполняет только его поток
+//Получателей группируем по шардам: одна задача в очередь шарда, а не по задаче на получателя
+//Всем достаётся один и тот же буфер своего протокола
+static void broadcast(const std::vector<ConnId>& ids, const Outgoing& msg, ConnId except = 0) {
+    std::vector<std::vector<ConnId>> byShard(shards.size());
+    for (ConnId id : ids) {
+        if (id != except) byShard[id >> SHARD_SHIFT].push_back(id);
+    }
+    for (size_t i = 0; i < byShard.size(); ++i) {
+        if (byShard[i].empty()) continue;
+        Shard* sh = shards[i].get();
+        if (sh == currentShard) {
+            for (ConnId id : byShard[i]) deliverLocal(sh, id, msg);
+        } else {
+            sh->reactor.post([sh, ids = std::move(byShard[i]), msg]{
+                for (ConnId id : ids) deliverLocal(sh, id, msg);
+            });
         }
     }
+}
+
+//Подписка и отписка соединений — в потоке шарда-владельца, как и отписка от всего в dropClient,
+//поэтому они идут в одной очереди шарда и не обгоняют друг друга
+//Соединение, успевшее закрыться после userSessions.collect, уже убрано из conns и не подписывается:
+//иначе его подписку после dropClient было бы некому снять
+static void subscribeLocal(Shard* sh, int chatId, const std::vector<ConnId>& ids, bool subscribe) {
+    for (ConnId id : ids) {
+        if (!subscribe) subscriptions.unsubscribe(chatId, id);
+        else if (sh->conns.count(id)) subscriptions.subscribe(chatId, id);
+    }
+}
+
+static void setSubscription(int chatId, const std::vector<ConnId>& ids, bool subscribe) {
+    std::vector<std::vector<ConnId>> byShard(shards.size());
+    for (ConnId id : ids) byShard[id >> SHARD_SHIFT].push_back(id);
+    for (size_t i = 0; i < byShard.size(); ++i) {
+        if (byShard[i].empty()) continue;
+        Shard* sh = shards[i].get();
+        if (sh == currentShard) {
+            subscribeLocal(sh, chatId, byShard[i], subscribe);
+        } else {
+            sh->reactor.post([sh, chatId, ids = std::move(byShard[i]), subscribe]{
+                subscribeLocal(sh, chatId, ids, subscribe);
+            });
+        }
+    }
+}
+
+//Корректно выкидываем клиента: SSL_shutdown, чистим буферы, подписки и закрываем TCP
+//Вызывается только в потоке шарда-владельца
+static void dropClient(const std::shared_ptr<Connection>& c) {
+    if (c->closed) return;
+    c->closed = true;
+    ConnId s = c->id;
+
+    //1) Снимаем сокет с epoll и завершаем TLS (без ожидания ответа клиента)
+    c->shard->reactor.remove(c->fd);
+    if (c->ssl) {
+        if (c->established) SSL_shutdown(c->ssl);
+        SSL_free(c->ssl);
+        c->ssl = nullptr;
+    }
+    //Строку ждущей БД команды без тега ещё читает её сопрограмма — буфер освободит она сама
+    if (!c->commandRunning) c->in.clear();
+    c->out.clear();
+    c->outBytes = 0;
+    //2) Убираем из соединений шарда
+    c->shard->conns.erase(s);
+    //3) Отписываем из подписок на чаты — только из своих
+    subscriptions.dropConnection(s);
+    //4) Убираем связь user->connection
+    if (c->userId > 0) userSessions.remove(c->userId, s);
     //5) Закрываем TCP‑сокет
-    close(s);
+    close(c->fd);
+}
+
+//Склеивает сообщения и события (оба списка по возрастанию времени) в одну ленту
+static Task<std::vector<TimelineEntry>> mergeTimeline(std::vector<TimelineEntry> messages,
+        std::vector<std::tuple<std::string, int, std::string>> events) {
+    std::vector<TimelineEntry> merged; //итоговый список из сообщений и событий
+    merged.reserve(messages.size() + events.size());
+
+    size_t i = 0, j = 0;
+    while (i < messages.size() || j < events.size()) {
+        bool takeMsg = false;
+        if (i < messages.size() && j < events.size()) {
+            //Сравниваем строки формата "YYYY-MM-DD HH:MM", чтобы выбрать нужный порядок сообщений и событий
+            takeMsg = messages[i].ts <= std::get<0>(events[j]);
+        } else {
+            takeMsg = (i < messages.size());
+        }
+
+        if (takeMsg) {
+            merged.push_back(std::move(messages[i]));
+            ++i;
+        } else {
+            //Событие: имя участника берём из справочника пользователей
+            TimelineEntry e;
+            e.ts = std::get<0>(events[j]);
+            e.from = co_await db->getUsername(std::get<1>(events[j]));
+            e.text = (std::get<2>(events[j]) == "LEFT"
+                       ? "покинул(а) чат" : "вошёл в чат");
+            merged.push_back(std::move(e));
+            ++j;
+        }
+    }
+    co_return merged;
+}
+
+//Заполняет кольцо кэша истории последними HISTORY_RING_SIZE сообщениями чата и их событиями
+static Task<void> seedHistory(int cid) {
+    uint64_t since = historyCache->epoch(cid);
+    bool complete = false;
+    auto tail = co_await db->getChatTail(cid, HISTORY_RING_SIZE, complete);
+    std::vector<TimelineEntry> msgs;
+    msgs.reserve(tail.size());
+    for (auto &m : tail) {
+        TimelineEntry e;
+        e.msgId = m.msgId;
+        e.ts = std::move(m.ts);
+        e.from = std::move(m.username);
+        e.text = std::move(m.content);
+        e.hiddenFor = std::move(m.hiddenFor);
+        msgs.push_back(std::move(e));
+    }
+    //Если хвост — не вся история, события старше его первого сообщения в кольцо не попадают
+    int from = (!complete && !msgs.empty()) ? msgs.front().msgId : 0;
+    auto events = co_await db->getChatEventsBetween(cid, from, 0);
+    historyCache->seed(cid, co_await mergeTimeline(std::move(msgs), std::move(events)), complete, since);
 }
 
-//Админ‑поток, читает из stdin строки RESET/SHUTDOWN
+//Админ‑поток, читает из stdin строки RESET/SHUTDOWN/STATS
 //RESET — чистит всё в БД и затем SHUTDOWN
-//SHUTDOWN — завершает основной accept‑цикл
+//SHUTDOWN — останавливает все шарды
+//STATS — печатает метрики пула соединений с БД, group commit, кэша истории, TLS, сжатия и сети
 static void adminThread() {
     std::string line;
     while (running && std::getline(std::cin,line)) {
+        if (line == "STATS") {
+            PoolStats st = db->poolStats();
+            std::cout << "[DB POOL] size=" << st.size
+                      << " in_use=" << st.inUse
+                      << " checkouts=" << st.checkouts
+                      << " failures=" << st.failures
+                      << " reconnects=" << st.reconnects
+                      << " avg_wait_us=" << (st.checkouts ? st.totalWaitUs / st.checkouts : 0)
+                      << " max_wait_us=" << st.maxWaitUs << std::endl;
+            PoolStats as = db->asyncPoolStats();
+            std::cout << "[DB ASYNC] size=" << as.size
+                      << " in_use=" << as.inUse
+                      << " checkouts=" << as.checkouts
+                      << " failures=" << as.failures
+                      << " reconnects=" << as.reconnects
+                      << " avg_wait_us=" << (as.checkouts ? as.totalWaitUs / as.checkouts : 0)
+                      << " max_wait_us=" << as.maxWaitUs << std::endl;
+            GroupCommitStats gc = db->groupCommitStats();
+            std::cout << "[DB BATCH] batches=" << gc.batches
+                      << " messages=" << gc.messages
+                      << " avg_batch=" << (gc.batches ? double(gc.messages) / gc.batches : 0.0)
+                      << std::endl;
+            HistoryCacheStats hc = historyCache->stats();
+            std::cout << "[HISTORY CACHE] hits=" << hc.hits
+                      << " misses=" << hc.misses
+                      << " seeds=" << hc.seeds
+                      << " evictions=" << hc.evictions
+                      << " chats=" << hc.chats
+                      << " entries=" << hc.entries << std::endl;
+            TlsSessionStats ts = tlsSessionStats(sslCtx);
+            std::cout << "[TLS] full_handshakes=" << fullHandshakes.load()
+                      << " resumed_handshakes=" << resumedHandshakes.load()
+                      << " pending_handshakes=" << pendingHandshakes.load()
+                      << " handshake_timeouts=" << handshakeTimeouts.load()
+                      << " handshake_rejects=" << handshakeRejects.load()
+                      << " ktls_sessions=" << ktlsSessions.load()
+                      << " cached_sessions=" << ts.cached
+                      << " cache_hits=" << ts.cacheHits
+                      << " cache_misses=" << ts.cacheMisses
+                      << " cache_full=" << ts.cacheFull
+                      << " ticket_key_rotations=" << ts.keyRotations
+                      << " tickets_renewed=" << ts.ticketsRenewed
+                      << " tickets_rejected=" << ts.ticketsRejected << std::endl;
+            CompressionStats cs = compressionStats();
+            std::cout << "[COMPRESS] messages=" << cs.messages
+                      << " skipped=" << cs.skipped
+                      << " raw_bytes=" << cs.rawBytes
+                      << " sent_bytes=" << cs.compressedBytes
+                      << " ratio=" << (cs.compressedBytes ? double(cs.rawBytes) / cs.compressedBytes : 0.0)
+                      << " cpu_us=" << cs.cpuUs << std::endl;
+            uint64_t sendCalls = 0, sentMessages = 0;
+            for (auto &sh : shards) {
+                sendCalls += sh->sendCalls.load();
+                sentMessages += sh->sentMessages.load();
+            }
+            std::cout << "[NET] online_users=" << userSessions.userCount()
+                      << " slow_consumer_drops=" << slowConsumerDrops.load()
+                      << " send_calls=" << sendCalls
+                      << " sent_messages=" << sentMessages
+                      << " messages_per_send=" << (sendCalls ? double(sentMessages) / sendCalls : 0.0) << std::endl;
+            continue;
+        }
+
         if (line == "RESET") {
             //Полная очистка БД
             bool ok = db->deleteEverything();
             if (!ok) std::cerr << "[SERVER] Error resetting\n";
+            historyCache->clear();
             line = "SHUTDOWN";
         }
 
         if (line == "SHUTDOWN") {
-            //Завершаем основной цикл: прерываем accept() и закрываем listen‑сокет
+            //Останавливаем реакторы всех шардов и потоков рукопожатий, main() дождётся их потоков
             running = false;
-            shutdown(serverSock,SHUT_RDWR);
-            close(serverSock);
+            for (auto &hs : handshakers) hs->reactor.stop();
+            for (auto &sh : shards) sh->reactor.stop();
             break;
         }
     }
 }
 
-//Обработчик одного клиентского соединения (каждому клиенту свой поток)
-static void clientHandler(int clientSock) {
-    //1) Обвёртка TCP в TLS
-    SSL* ssl = SSL_new(sslCtx);
-    SSL_set_fd(ssl, clientSock);
-    if (SSL_accept(ssl) <= 0) {
-        //Не удалось пройти TLS рукопожатие
-        ERR_print_errors_fp(stderr);
-        close(clientSock);
-        return;
+//Обработчики команд клиента: по одному на команду
+//Сопрограммы в потоке шарда-владельца: на время запроса к БД (co_await) поток обслуживает
+//других клиентов, а команды с тегом одного клиента перемежаются (см. clientHandler),
+//поэтому состояние соединения берут из ctx, а не из Connection; менять Connection могут
+//только команды, которые всегда выполняются по порядку (LOGIN, PROTO, COMPRESS)
+//args стоит сразу за именем команды; разбирать их нужно до первого co_await
+using CommandHandler = Task<void> (*)(CommandContext& ctx, CommandArgs& args);
+
+//Имена и названия уходят другим клиентам полями ответов, в том числе текстовых:
+//управляющие символы (переводы строк) в них не принимаем ни в каком протоколе,
+//а в имени пользователя — ещё пробелы и разделители списков (в тексте это отдельные токены)
+static bool validTitle(std::string_view s) {
+    for (unsigned char ch : s)
+        if (ch < 0x20 || ch == 0x7f) return false;
+    return true;
+}
+
+static bool validUsername(std::string_view s) {
+    return !s.empty() && validTitle(s) && s.find_first_of(" ,:;") == std::string_view::npos;
+}
+
+//Регистрация
+static Task<void> onRegister(CommandContext& ctx, CommandArgs& args) {
+    std::string_view u = args.word(), p = args.word();
+    if (!validUsername(u)) {
+        replyError(ctx, "BAD_NAME");
+        co_return;
     }
-    //Сохраняем SSL* для этого сокета
-    {
-        std::lock_guard lk(sslMtx);
-        sockToSsl[clientSock] = ssl;
+    bool ok = co_await db->registerUser(std::string(u), std::string(p));
+    if (ok) replyOk(ctx, "REG");
+    else replyError(ctx, "USER_EXISTS");
+}
+
+//Вход по логину и паролю
+static Task<void> onLogin(CommandContext& ctx, CommandArgs& args) {
+    std::string_view u = args.word(), p = args.word();
+    int id = co_await db->authenticateUser(std::string(u), std::string(p));
+    if (id > 0) {
+        //Сохраняем связь user->connection (повторный LOGIN на том же соединении не дублирует её)
+        Connection& c = *ctx.conn;
+        if (c.userId > 0 && c.userId != id) userSessions.remove(c.userId, c.id);
+        c.userId = id;
+        ctx.userId = id;
+        userSessions.add(id, c.id);
+        replyOk(ctx, "LOGIN");
+    } else {
+        replyError(ctx, "NOT_CORRECT");
+    }
+}
+
+//Список чатов
+static Task<void> onListChats(CommandContext& ctx, CommandArgs&) {
+    int userId = ctx.userId;
+    if (userId < 0) {
+        replyError(ctx, "NOT_LOGGED");
+        co_return;
     }
 
-    //Буфер приёма данных и идентификатор залогиненного пользователя
-    char buf[2048];
-    int userId = -1;
+    //Вся сводка по чатам одним запросом: участники, последнее сообщение, непрочитанные
+    auto chats = co_await db->listChatSummaries(userId, UNREAD_CAP);
+    //Подписки берём из индекса участия — он же проверяет доступ к чатам
+    auto chatIds = co_await db->userChatIds(userId);
 
-    //Основной цикл чтения от клиента
-    while (true) {
-        int r = SSL_read(ssl, buf, sizeof(buf));
-        if (r <= 0) break; //клиент отключился или ошибка
-
-        //Добавляем прочитанные байты в строковый буфер
-        {
-            std::lock_guard lk(bufMtx);
-            sockBuf[clientSock].append(buf, r);
-            //При чтении из SSL‑сокета (SSL_read) можно получить любую часть отправленного сообщения 
-            //возможно целую строку, а возможно только её кусок
-            //TCP (и TLS над ним) гарантирует, что байты придут в том же порядке, но не что придут одним куском
+    //Переподписываем клиента на актуальный набор chat_id
+    subscriptions.resubscribe(ctx.conn->id, chatIds);
+
+    reply(ctx, [&](Wire w) { return encodeChats(w, chats); });
+}
+
+//Создать новый чат (личный или групповой)
+static Task<void> onCreateChat(CommandContext& ctx, CommandArgs& args) {
+    int userId = ctx.userId;
+    if (userId < 0) {
+        //Если клиент не залогинен — ошибка
+        replyError(ctx, "NOT_LOGGED");
+        co_return;
+    }
+
+    //Прочитать флаг: 0 = личный, 1 = групповой
+    int isGroup = 0;
+    args.integer(isGroup);
+
+    if (!isGroup) {
+        //Личный чат
+        int peer = 0;
+        args.integer(peer);  // ID второго участника
+
+        //1) Проверка, нет ли уже личного чата между этими двумя пользователями
+        int existing = co_await db->findPrivateChat(userId, peer);
+        if (existing > 0) {
+            //Если чат уже существует — возвращаем ошибку
+            replyError(ctx, "CHAT_EXISTS");
+            co_return;
         }
 
-        //Разбираем буфер по строкам '\n'
-        while (true) {
-            std::string line;
-            {
-                //Берем только часть до \n
-                std::lock_guard lk(bufMtx);
-                auto &b = sockBuf[clientSock];
-                auto p = b.find('\n');
-                if (p == std::string::npos) break; //Выходим, если нет \n 
-                line = b.substr(0, p);
-                b.erase(0,p+1);
-            }
+        //2) Создаем новый чат без имени и сразу добавляем обоих пользователей в chat_members
+        std::vector<int> members = {userId, peer};
+        int chatId = co_await db->createChatWithMembers(false, "", members);
+        if (chatId < 0) {
+            replyError(ctx);
+            co_return;
+        }
 
-            //Убираем возможный '\r'
-            if (line.size() && line.back() == '\r') line.pop_back();
+        //3) Уведомляем обоих участников о новом чате (NEW_CHAT)
+        auto userName = co_await db->getUsername(userId);
+        auto peerName = co_await db->getUsername(peer);
 
-            //Парсим команду
-            std::istringstream iss(line);
-            std::string cmd; iss >> cmd;
+        //для личного чата вместо названия отдаём имена участников через запятую
+        std::string title = userName + "," + peerName;
 
-            //Обработка наборов команд...
+        //Соединения всех участников с их устройств
+        std::vector<ConnId> conns;
+        userSessions.collect(members, conns);
+        broadcast(conns, makeOutgoing([&](Wire w) { return encodeNewChat(w, chatId, false, title); }));
 
-            //Регистрация
-            if (cmd == "REGISTER") {
-                std::string u,p; iss >> u >> p;
-                bool ok = db->registerUser(u,p);
-                sendSSL(clientSock, ok ? "OK REG\n" : "ERROR USER_EXISTS\n");
-            }
-            //Вход по логину и паролю
-            else if (cmd == "LOGIN") {
-                std::string u,p; iss >> u >> p;
-                int id = db->authenticateUser(u,p);
-                if (id > 0) {
-                    userId = id;
-                    //Сохраняем связь socket->user и обратную
-                    {
-                        std::lock_guard ul(userMtx);
-                        socketToUser[clientSock] = id;
-                        userToSockets[id].push_back(clientSock);
-                    }
-                    sendSSL(clientSock,  "OK LOGIN\n");
-                } else {
-                    sendSSL(clientSock,  "ERROR NOT_CORRECT\n");
-                }
-            }
-            //Список чатов
-            else if (cmd == "LIST_CHATS") {
-                if (userId < 0) {
-                    sendSSL(clientSock, "ERROR NOT_LOGGED\n");
-                    continue;
-                }
-
-                //Получаем список (chat_id, is_group, chat_name)
-                auto chats = db->listUserChats(userId);
-
-                std::ostringstream out;
-                out << "CHATS ";
-                for (auto &t : chats) {
-                    int cid; bool isg; std::string name;
-                    std::tie(cid, isg, name) = t; //Берем из кортежа списка чатов
-                    out << cid << ":" << (isg ? "1" : "0") << ":" << name << ":";
-
-                    //Добавляем участников списка
-                    auto members = db->chatMembers(cid);
-                    for (int i = 0; i < members.size(); i++)
-                    {
-                        if (i != members.size() - 1) out << members[i] << ","; //Участники чата через ,
-                        else out << members[i];
-                    }
-                    out << ";"; //В конце ставим ; в качестве разделителя между чатами
-                }
-
-                //Переподписываем клиента на новые chat_id
-                {
-                    std::lock_guard ukl(subMtx);
-                    //Сначала очищаем все старые подписки
-                    for (auto &kv : subscribers)
-                        kv.second.erase(std::remove(kv.second.begin(),kv.second.end(), clientSock),
-                                        kv.second.end());
-
-                    //Затем добавляем в новые
-                    for (auto &t : chats) {
-                        int cid; bool isg; std::string name;
-                        std::tie(cid,isg,name)=t;
-                        subscribers[cid].push_back(clientSock);
-                    }
-                }
-
-                //Формируем и отправляем строку ответа
-                std::string res = out.str();
-                if (!res.empty()) {
-                    res.back() = '\n';  //заменяем последний ';' на '\n'
-                }
-
-                sendSSL(clientSock,  res);
-            }
-            else if (cmd == "CREATE_CHAT") {
-                //Создать новый чат (личный или групповой)
-                if (userId < 0) {
-                    //Если клиент не залогинен — ошибка
-                    sendSSL(clientSock, "ERROR NOT_LOGGED\n");
-                    continue;
-                }
-
-                //Прочитать флаг: 0 = личный, 1 = групповой
-                int isGroup;
-                iss >> isGroup;
-
-                if (!isGroup) {
-                    //Личный чат
-                    int peer;
-                    iss >> peer;  // ID второго участника
-
-                    //1) Проверка, нет ли уже личного чата между этими двумя пользователями
-                    int existing = db->findPrivateChat(userId, peer);
-                    if (existing > 0) {
-                        //Если чат уже существует — возвращаем ошибку
-                        sendSSL(clientSock, "ERROR CHAT_EXISTS\n");
-                        continue;
-                    }
-
-                    //2) Создаем новый чат без имени
-                    int chatId = db->createChat(false, "");
-                    //Добавляем обоих пользователей в chat_members
-                    db->addUserToChat(chatId, userId);
-                    db->addUserToChat(chatId, peer);
-
-                    //3) Уведомляем обоих участников о новом чате (NEW_CHAT)
-                    auto userName = db->getUsername(userId);
-                    auto peerName = db->getUsername(peer);
-
-                    std::ostringstream out;
-                    out << "NEW_CHAT "
-                        << chatId << " "                       //id чата
-                        << "0 ";    //флаг групповой
-
-                    //для личного чата можно отдать имена участников через запятую
-                    out << userName << "," << peerName;
-                    out << "\n";
-
-                    std::string push = out.str();
-
-                    std::lock_guard<std::mutex> ul(userMtx);
-                    for (int u : {userId, peer}) {
-                        for (int s2 : userToSockets[u]) {
-                            sendSSL(s2, push);
-                        }
-                    }
-
-                    //Подписываем все сокеты участников на этот чат,
-                    //чтобы им потом приходили NEW_MESSAGE
-                    {
-                        std::lock_guard<std::mutex> sl(subMtx);
-                        auto &subs = subscribers[chatId];
-                        for (int u : {userId, peer}) {
-                            for (int sock2 : userToSockets[u]) {
-                                //избегаем дублирования
-                                if (std::find(subs.begin(), subs.end(), sock2) == subs.end())
-                                    subs.push_back(sock2);
-                            }
-                        }
-                    }
-
-                } else {
-                    //Групповой чат
-
-                    //Считываем остаток строки (имя чата + список участников)
-                    std::string rest;
-                    iss >> std::ws;
-                    std::getline(iss, rest);
-                    std::istringstream is2(rest);
-
-                    //1) Имя группы
-                    std::string gname;
-                    is2 >> gname;
-
-                    //2) Состав участников (ID), первый всегда текущий пользователь
-                    std::vector<int> members = { userId };
-                    int x;
-                    while (is2 >> x) {
-                        members.push_back(x);
-                    }
-
-                    //3) Создаем чат с именем и добавляем всех участников
-                    int cid = db->createChat(true, gname);
-                    for (int u : members) {
-                        db->addUserToChat(cid, u);
-                    }
-
-                    //4) Уведомляем всех участников о новом групповом чате
-                    std::ostringstream out;
-                    out << "NEW_CHAT "
-                        << cid << " "                       //id чата
-                        << "1 " << gname;   //флаг групповой и имя группы
-                    out << "\n";
-
-                    std::string push = out.str();
-                    std::lock_guard ul(userMtx);
-                    for (int u : members) {
-                        for (int s2 : userToSockets[u]) {
-                            sendSSL(s2, push);
-                        }
-                    }
-
-                    //Подписываем все сокеты участников на этот чат,
-                    //чтобы им потом приходили NEW_MESSAGE
-                    {
-                        std::lock_guard<std::mutex> sl(subMtx);
-                        auto &subs = subscribers[cid];
-                        for (int u : members) {
-                            for (int sock2 : userToSockets[u]) {
-                                //избегаем дублирования
-                                if (std::find(subs.begin(), subs.end(), sock2) == subs.end())
-                                    subs.push_back(sock2);
-                            }
-                        }
-                    }
-                }
-            }
-            else if (cmd == "SEND") {
-                //Отправка сообщения в чат
-                if (userId < 0) {
-                    sendSSL(clientSock, "ERROR NOT_LOGGED\n");
-                    continue;
-                }
-                int cid;
-                iss >> cid; //ID чата
-                std::string msg;
-                std::getline(iss, msg); //Текст сообщения
-
-                //Проверка, что пользователь входит в этот чат
-                if (!db->isUserInChat(cid, userId)) {
-                    sendSSL(clientSock, "ERROR NO_CHAT_ACCESS\n");
-                    continue;
-                }
-
-                //Сохраняем сообщение в БД и получаем его msg_id
-                int id = db->storeMessage(cid, userId, msg);
-
-                //Отправляем ответ клиенту: OK SENT <msg_id> или ERROR
-                std::ostringstream out;
-                out << "OK SENT " << id << "\n";
-                sendSSL(clientSock, id ? out.str() : "ERROR\n");
-
-                //Если всё успешно, рассылаем другим подписчикам команду NEW_HISTORY
-                if (id) {
-                    auto now = std::chrono::system_clock::now();
-                    std::time_t t = std::chrono::system_clock::to_time_t(now);
-                    std::tm tm; localtime_r(&t, &tm);
-                    char buf[20];
-                    std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &tm);
-                    std::string timestamp(buf);
-                    std::string from = db->getUsername(userId);
-                    std::string content = msg; //без ведущего пробела
-
-                    std::ostringstream notif;
-                    notif << "NEW_MESSAGE "
-                        << cid << " "          //chat_id
-                        << id << " "           //msg_id
-                        << timestamp << " "    //timestamp
-                        << from << " "         //from
-                        << content << "\n";    //content
-
-                    std::lock_guard sl(subMtx);
-                    for (int sock2 : subscribers[cid]) {
-                        if (sock2 != clientSock)
-                            sendSSL(sock2, notif.str());
-                    }
-                }
-            }
-            else if (cmd == "HISTORY") {
-                //Запрос истории чата (сообщения + события входа/выхода)
-                if (userId < 0) {
-                    sendSSL(clientSock, "ERROR NOT_LOGGED\n");
-                    continue;
-                }
-                int cid;
-                iss >> cid; //ID чата
-
-                //Проверка доступа
-                if (!db->isUserInChat(cid, userId)) {
-                    sendSSL(clientSock, "ERROR NO_CHAT_ACCESS\n");
-                    continue;
-                }
-
-                //1) Получаем все сообщения для этого чата
-                auto messages = db->getChatHistory(cid, userId);
-                //2) Получаем все события
-                auto events = db->getChatEvents(cid);
-
-                //Объединяем оба списка по временному штампу
-                struct Item {
-                    std::string ts; //время и дата
-                    enum { MSG, EVT } type;
-                    int msg_id;  //только для MSG
-                    std::string from; //отправитель или пользователь события
-                    std::string text; //текст сообщения или тип события
-                };
-                std::vector<Item> merged; //итоговый список из сообщений и событий
-                merged.reserve(messages.size() + events.size());
-
-                int i = 0, j = 0;
-                //Лямбда функция, чтобы быстро получать имя пользователя
-                auto userNameById = [&](int uid) {
-                    return db->getUsername(uid);
-                };
-
-                while (i < messages.size() || j < events.size()) {
-                    bool takeMsg = false;
-                    if (i < messages.size() && j < events.size()) {
-                        //Сравниваем строки формата "YYYY-MM-DD HH:MM", чтобы выбрать нужный порядок сообщений и событий
-                        takeMsg = std::get<1>(messages[i]) <= std::get<0>(events[j]);
-                    } else {
-                        takeMsg = (i < messages.size());
-                    }
-
-                    if (takeMsg) {
-                        //Добавляем сообщение
-                        Item it;
-                        it.ts = std::get<1>(messages[i]);
-                        it.type = Item::MSG;
-                        it.msg_id = std::get<0>(messages[i]);
-                        it.from = std::get<2>(messages[i]);
-                        it.text = std::get<3>(messages[i]);
-                        merged.push_back(std::move(it));
-                        ++i;
-                    } else {
-                        //Добавляем событие
-                        Item it;
-                        it.ts = std::get<0>(events[j]);
-                        it.type = Item::EVT;
-                        it.from = userNameById(std::get<1>(events[j]));
-                        it.text = (std::get<2>(events[j]) == "LEFT"
-                                   ? "покинул(а) чат" : "вошёл в чат");
-                        merged.push_back(std::move(it));
-                        ++j;
-                    }
-                }
-
-                //Собираем единый ответ
-                std::ostringstream out;
-                out << "HISTORY ";
-                for (auto &it : merged) {
-                    if (it.type == Item::MSG) {
-                        out << "[" << it.ts << "] "
-                            << it.from << ": "
-                            << it.text
-                            << " (id=" << it.msg_id << ");";
-                    } else {
-                        out << "[" << it.ts << "] * "
-                            << it.from << " "
-                            << it.text << ";";
-                    }
-                }
-                out << "\n";
-
-                //Отправляем всю историю одним сообщением
-                sendSSL(clientSock, out.str());
-            }
-            //Удаление сообщения только у себя
-            else if (cmd == "DELETE") {
-                int msg_id;
-                iss >> msg_id;
-                //Проверяем, что пользователь — автор сообщения
-                int sender = db->getMessageSender(msg_id);
-                if (sender == userId) {
-                    bool ok = db->deleteMessageForUser(msg_id, userId);
-                    int chat_id = db->getChatIdByMessage(msg_id);
-                    std::ostringstream notif;
-                    notif << "MSG_DELETED " << chat_id << " " << msg_id << "\n";
-                    sendSSL(clientSock, ok ? notif.str() : "ERROR\n");
-                } else {
-                    sendSSL(clientSock, "ERROR NO_RIGHTS\n");
-                }
-            }
-            //Глобальное удаление (для всех)
-            else if (cmd == "DELETE_GLOBAL") {
-                int msg_id;
-                iss >> msg_id;
-                int sender = db->getMessageSender(msg_id);
-                //Проверяем, что пользователь — автор сообщения
-                if (sender != userId) {
-                    sendSSL(clientSock, "ERROR NO_RIGHTS\n");
-                    continue;
-                }
-
-                //Помечаем сообщение как удалённое во всех сессиях
-                bool ok = db->deleteMessageGlobal(msg_id);
-                if (!ok) {
-                    sendSSL(clientSock, "ERROR\n");
-                    continue;
-                }
-
-                //Уведомляем всех подписчиков чата
-                int chat_id = db->getChatIdByMessage(msg_id);
-                std::ostringstream notif;
-                notif << "MSG_DELETED " << chat_id << " " << msg_id << "\n";
-
-                //Лочим доступ, так как работаем с общей структурой
-                std::lock_guard<std::mutex> lk(subMtx);
-                auto it = subscribers.find(chat_id);
-                if (it != subscribers.end()) {
-                    for (int sock2 : it->second) {
-                        sendSSL(sock2, notif.str());
-                    }
-                }
-            }
-            //Пользователь покидает групповой чат
-            else if (cmd == "LEAVE_CHAT") {
-                int cid;
-                iss >> cid;
-                if (userId < 0 || !db->isUserInChat(cid, userId)) {
-                    sendSSL(clientSock, "ERROR\n");
-                } else {
-                    //Удаляем из участников
-                    bool ok = db->removeUserFromChat(cid, userId);
-                    sendSSL(clientSock, ok ? "OK LEFT\n" : "ERROR\n");
-                    if (ok) {
-                        //Формируем уведомление о выходе для других участников
-                        std::string name = db->getUsername(userId);
-                        auto now = std::chrono::system_clock::now();
-                        std::time_t t = std::chrono::system_clock::to_time_t(now);
-                        std::tm tm; localtime_r(&t, &tm);
-                        char buf[30];
-                        std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &tm);
-                        std::ostringstream nt;
-                        nt << "USER_LEFT " << cid << " " << name << " " << buf << "\n";
-
-                        //Рассылаем всем остальным участникам
-                        std::lock_guard<std::mutex> lk(subMtx);
-                        for (int sock2 : subscribers[cid]) {
-                            if (sock2 != clientSock) {
-                                sendSSL(sock2, nt.str());
-                            }
-                        }
-                        //Убираем клиента из подписчиков
-                        auto &vec = subscribers[cid];
-                        vec.erase(std::remove(vec.begin(), vec.end(), clientSock), vec.end());
-                    }
-                }
-            }
-            //Запрос ID пользователя по имени
-            else if (cmd == "GET_USER_ID") {
-                std::string nm;
-                iss >> nm;
-                int uid = db->getUserIdByName(nm);
-                sendSSL(clientSock,
-                        uid > 0 ? "USER_ID " + std::to_string(uid) + "\n"
-                                : "ERROR NO_SUCH_USER\n");
-            }
-            //Неизвестная команда
-            else {
-                sendSSL(clientSock, "ERROR UNKNOWN\n");
+        //Подписываем все сокеты участников на этот чат,
+        //чтобы им потом приходили NEW_MESSAGE
+        setSubscription(chatId, conns, true);
+        co_return;
+    }
+
+    //Групповой чат: имя чата + список участников
+
+    //1) Имя группы
+    std::string gname(args.word());
+    if (!validTitle(gname)) {
+        replyError(ctx, "BAD_NAME");
+        co_return;
+    }
+
+    //2) Состав участников (ID), первый всегда текущий пользователь
+    std::vector<int> members = { userId };
+    int x;
+    while (args.integer(x)) {
+        members.push_back(x);
+    }
+
+    //3) Создаем чат с именем и добавляем всех участников (один проход к БД)
+    int cid = co_await db->createChatWithMembers(true, gname, members);
+    if (cid < 0) {
+        replyError(ctx);
+        co_return;
+    }
+
+    //4) Уведомляем всех участников о новом групповом чате
+    //Соединения всех участников с их устройств
+    std::vector<ConnId> conns;
+    userSessions.collect(members, conns);
+    broadcast(conns, makeOutgoing([&](Wire w) { return encodeNewChat(w, cid, true, gname); }));
+
+    //Подписываем все сокеты участников на этот чат,
+    //чтобы им потом приходили NEW_MESSAGE
+    setSubscription(cid, conns, true);
+}
+
+//Отправка сообщения в чат
+static Task<void> onSend(CommandContext& ctx, CommandArgs& args) {
+    int userId = ctx.userId;
+    if (userId < 0) {
+        replyError(ctx, "NOT_LOGGED");
+        co_return;
+    }
+    int cid = 0;
+    args.integer(cid); //ID чата
+    std::string msg(args.rest()); //Текст сообщения
+
+    //Доступ проверяем по индексу участия в памяти: чужой чат отсекаем без БД
+    if (!co_await db->isUserInChat(cid, userId)) {
+        replyError(ctx, "NO_CHAT_ACCESS");
+        co_return;
+    }
+
+    //Сохраняем сообщение и получаем его msg_id и имя отправителя — одним проходом к БД
+    //(вставка повторно проверяет участие, на случай выхода из чата в этот момент)
+    std::string from;
+    int id = co_await db->sendMessage(cid, userId, msg, from);
+    if (id == 0) {
+        replyError(ctx, "NO_CHAT_ACCESS");
+        co_return;
+    }
+
+    //Отправляем ответ клиенту: OK SENT <msg_id> или ERROR (в том числе если БД недоступна)
+    if (id > 0) reply(ctx, [&](Wire w) { return encodeSent(w, id); });
+    else replyError(ctx);
+
+    //Если всё успешно, рассылаем другим подписчикам команду NEW_HISTORY
+    if (id > 0) {
+        auto now = std::chrono::system_clock::now();
+        std::time_t t = std::chrono::system_clock::to_time_t(now);
+        std::tm tm; localtime_r(&t, &tm);
+        char buf[20];
+        std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &tm);
+        std::string timestamp(buf);
+        std::string content = msg; //без ведущего пробела
+
+        TimelineEntry e;
+        e.msgId = id;
+        e.ts = timestamp;
+        e.from = from;
+        e.text = content;
+        historyCache->appendMessage(cid, std::move(e));
+
+        //NEW_MESSAGE <chat_id> <msg_id> <timestamp> <from> <content>
+        Outgoing notif = makeOutgoing([&](Wire w) {
+            return encodeNewMessage(w, cid, id, timestamp, from, content);
+        });
+
+        //Снимок подписчиков неизменяемый — рассылаем по нему без блокировок
+        broadcast(*subscriptions.subscribers(cid), notif, ctx.conn->id);
+    }
+}
+
+//Запрос страницы истории чата (сообщения + события входа/выхода)
+//HISTORY <chat_id> [before_msg_id] [limit]
+static Task<void> onHistory(CommandContext& ctx, CommandArgs& args) {
+    int userId = ctx.userId;
+    if (userId < 0) {
+        replyError(ctx, "NOT_LOGGED");
+        co_return;
+    }
+    int cid = 0;
+    args.integer(cid); //ID чата
+    int before = 0, limit = HISTORY_PAGE_DEFAULT;
+    bool hasBefore = args.integer(before);
+    if (!hasBefore || before < 0) before = 0; //0 — самые новые сообщения
+    if (!hasBefore || !args.integer(limit)) limit = HISTORY_PAGE_DEFAULT;
+    limit = std::clamp(limit, 1, HISTORY_PAGE_MAX);
+
+    //Проверка доступа
+    if (!co_await db->isUserInChat(cid, userId)) {
+        replyError(ctx, "NO_CHAT_ACCESS");
+        co_return;
+    }
+
+    //1) Страница из кэша истории; кольца чата ещё нет — заполняем его хвостом из БД
+    bool hasMore = false;
+    std::vector<TimelineEntry> merged;
+    if (before == 0 && !historyCache->contains(cid)) co_await seedHistory(cid);
+    if (!historyCache->page(cid, userId, before, limit, merged, hasMore)) {
+        //2) Промах: страница сообщений из БД (keyset pagination по индексу) и события
+        //в том же промежутке времени — от первого сообщения страницы (если раньше
+        //есть ещё сообщения) до курсора
+        auto messages = co_await db->getChatHistoryPage(cid, userId, before, limit, hasMore);
+        int from = (hasMore && !messages.empty()) ? std::get<0>(messages.front()) : 0;
+        std::vector<TimelineEntry> msgs;
+        msgs.reserve(messages.size());
+        for (auto &m : messages) {
+            TimelineEntry e;
+            std::tie(e.msgId, e.ts, e.from, e.text) = std::move(m);
+            msgs.push_back(std::move(e));
+        }
+        merged = co_await mergeTimeline(std::move(msgs), co_await db->getChatEventsBetween(cid, from, before));
+    }
+
+    //Последняя страница показана — чат прочитан до самого нового сообщения
+    if (before == 0) {
+        for (auto it = merged.rbegin(); it != merged.rend(); ++it) {
+            if (it->msgId > 0) {
+                co_await db->markChatRead(cid, userId, it->msgId);
+                break;
             }
         }
     }
 
-    //Клиент отключился — чистим ресурсы
-    dropClient(clientSock);
+    //Отправляем страницу истории одним сообщением
+    reply(ctx, [&](Wire w) { return encodeHistory(w, cid, before, hasMore, merged); });
+}
 
-    //Удаляем остатки socket->user
-    {
-        std::lock_guard ul(userMtx);
-        auto it = socketToUser.find(clientSock);
-        if (it!=socketToUser.end()) {
-            int u = it->second;
-            socketToUser.erase(it);
-            auto &v = userToSockets[u];
-            v.erase(std::remove(v.begin(),v.end(),clientSock),v.end());
+//Удаление сообщения только у себя
+static Task<void> onDelete(CommandContext& ctx, CommandArgs& args) {
+    int userId = ctx.userId;
+    int msg_id = 0;
+    args.integer(msg_id);
+    //Проверяем, что пользователь — автор сообщения
+    int sender = co_await db->getMessageSender(msg_id);
+    if (sender == userId) {
+        bool ok = co_await db->deleteMessageForUser(msg_id, userId);
+        int chat_id = co_await db->getChatIdByMessage(msg_id);
+        if (ok) {
+            historyCache->hideFor(chat_id, msg_id, userId);
+            reply(ctx, [&](Wire w) { return encodeMsgDeleted(w, chat_id, msg_id); });
+        } else {
+            replyError(ctx);
         }
+    } else {
+        replyError(ctx, "NO_RIGHTS");
     }
 }
 
-int main() {
-    //1) Инициализируем SSL
-    init_openssl();
+//Глобальное удаление (для всех)
+static Task<void> onDeleteGlobal(CommandContext& ctx, CommandArgs& args) {
+    int msg_id = 0;
+    args.integer(msg_id);
+    //Проверяем, что пользователь — автор сообщения, помечаем сообщение
+    //как удалённое во всех сессиях и узнаём его чат — одним запросом
+    int chat_id = co_await db->deleteOwnMessageGlobal(msg_id, ctx.userId);
+    if (chat_id == 0) {
+        replyError(ctx, "NO_RIGHTS");
+        co_return;
+    }
+    if (chat_id < 0) {
+        replyError(ctx);
+        co_return;
+    }
 
-    //2) Подключаемся к БД
-    db = new Database("host=localhost dbname=chatdb user=chatuser password=123");
+    historyCache->removeMessage(chat_id, msg_id);
+
+    //Уведомляем всех подписчиков чата
+    broadcast(*subscriptions.subscribers(chat_id),
+              makeOutgoing([&](Wire w) { return encodeMsgDeleted(w, chat_id, msg_id); }));
+}
+
+//Пользователь покидает групповой чат
+static Task<void> onLeaveChat(CommandContext& ctx, CommandArgs& args) {
+    int userId = ctx.userId;
+    int cid = 0;
+    args.integer(cid);
+    if (userId < 0 || !co_await db->isUserInChat(cid, userId)) {
+        replyError(ctx);
+        co_return;
+    }
+    //Удаляем из участников; событие выхода попадёт в кэш истории после записи в БД
+    historyCache->beginWrite(cid);
+    bool ok = co_await db->removeUserFromChat(cid, userId);
+    if (!ok) {
+        replyError(ctx);
+        co_return;
+    }
+    replyOk(ctx, "LEFT");
+
+    //Формируем уведомление о выходе для других участников
+    std::string name = co_await db->getUsername(userId);
+    auto now = std::chrono::system_clock::now();
+    std::time_t t = std::chrono::system_clock::to_time_t(now);
+    std::tm tm; localtime_r(&t, &tm);
+    char buf[30];
+    std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &tm);
+
+    TimelineEntry ev;
+    ev.ts = buf;
+    ev.from = name;
+    ev.text = "покинул(а) чат";
+    historyCache->appendEvent(cid, std::move(ev));
+
+    //Отписываем все сессии пользователя (с других устройств тоже) и рассылаем остальным участникам
+    std::vector<int> leaver = { userId };
+    std::vector<ConnId> sessions;
+    userSessions.collect(leaver, sessions);
+    setSubscription(cid, sessions, false);
+    broadcast(*subscriptions.subscribers(cid),
+              makeOutgoing([&](Wire w) { return encodeUserLeft(w, cid, name, buf); }));
+}
+
+//Запрос ID пользователя по имени
+static Task<void> onGetUserId(CommandContext& ctx, CommandArgs& args) {
+    int uid = co_await db->getUserIdByName(std::string(args.word()));
+    if (uid > 0) reply(ctx, [&](Wire w) { return encodeUserId(w, uid); });
+    else replyError(ctx, "NO_SUCH_USER");
+}
 
-    //3) Настраиваем TCP
-    serverSock = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSock < 0) {
+//Переход на бинарный протокол: PROTO BIN
+//Ответ уходит ещё текстом, всё после этой строки (в том числе уже принятое) — кадры
+//Пока выполняются команды с тегом, переключаться нельзя: их ответы уже закодированы текстом
+static Task<void> onProto(CommandContext& ctx, CommandArgs& args) {
+    Connection& c = *ctx.conn;
+    if (c.binary || args.word() != "BIN") {
+        replyError(ctx, "UNSUPPORTED");
+        co_return;
+    }
+    if (c.inFlight > 0) {
+        replyError(ctx, "BUSY");
+        co_return;
+    }
+    replyOk(ctx, "PROTO BIN");
+    c.binary = true;
+    c.in.setFramed();
+}
+
+//Сжатие крупных ответов: COMPRESS ZLIB [уровень 1..9]
+//Ответ на саму команду не сжимается; дальше ответы от COMPRESS_MIN_BYTES могут прийти сжатыми блоками
+static Task<void> onCompress(CommandContext& ctx, CommandArgs& args) {
+    if (args.word() != "ZLIB") {
+        replyError(ctx, "UNSUPPORTED");
+        co_return;
+    }
+    int level = COMPRESS_LEVEL;
+    if (args.integer(level)) level = std::clamp(level, 1, 9);
+    replyOk(ctx, "COMPRESS ZLIB");
+    ctx.conn->compressLevel = level;
+}
+
+//Неизвестная команда
+static Task<void> onUnknown(CommandContext& ctx, CommandArgs&) {
+    replyError(ctx, "UNKNOWN");
+    co_return;
+}
+
+//Таблица обработчиков в порядке enum Command
+static constexpr CommandHandler commandHandlers[] = {
+    onUnknown,
+    onRegister,
+    onLogin,
+    onListChats,
+    onCreateChat,
+    onSend,
+    onHistory,
+    onDelete,
+    onDeleteGlobal,
+    onLeaveChat,
+    onGetUserId,
+    onProto,
+    onCompress,
+};
+static_assert(std::size(commandHandlers) == static_cast<size_t>(Command::Count),
+              "commandHandlers must list a handler for every Command");
+
+//Может ли команда с тегом выполняться параллельно с остальными командами клиента
+//LOGIN, PROTO и COMPRESS меняют состояние соединения, поэтому всегда идут по порядку в потоке шарда
+static bool runsConcurrently(Command cmd) {
+    return cmd != Command::Unknown && cmd != Command::Login && cmd != Command::Proto
+        && cmd != Command::Compress;
+}
+
+static void clientHandler(const std::shared_ptr<Connection>& c);
+
+//Выполняет команду до конца (со всеми ожиданиями БД) и снимает её с учёта соединения
+//Строку команды без тега берёт прямо из входного буфера: пока она выполняется, сокет не читается;
+//команда с тегом выполняется вперемешку с чтением, поэтому берёт копию строки
+static Task<void> runCommand(CommandContext ctx, Command cmd, bool concurrent,
+                             std::string_view line, std::string copy) {
+    if (concurrent) line = copy;
+    CommandArgs args(line, ctx.wire == Wire::Binary);
+    args.command();
+    co_await commandHandlers[static_cast<size_t>(cmd)](ctx, args);
+
+    Connection& c = *ctx.conn;
+    if (concurrent) c.inFlight--;
+    else c.commandRunning = false;
+    //Соединение закрылось, пока команда выполнялась: снимаем подписки, которые она могла добавить
+    if (c.closed) {
+        subscriptions.dropConnection(c.id);
+        if (!c.commandRunning) c.in.clear();
+        co_return;
+    }
+    //Разбор стоял из-за этой команды: продолжаем с уже принятых команд и снова читаем сокет
+    //(если команда завершилась, не дождавшись БД, разбор и так продолжится в clientHandler)
+    if (c.commandsPaused && !c.commandRunning && c.inFlight < MAX_INFLIGHT_PER_CONN) {
+        clientHandler(ctx.conn);
+        if (!c.closed) doRead(ctx.conn);
+    }
+}
+
+//Разбирает накопленный буфер по строкам и выполняет каждую
+//Вызывается в потоке шарда-владельца после каждого чтения из сокета
+//Команды без тега выполняются строго по порядку: пока одна ждёт БД, следующие ждут в буфере;
+//команды с тегом выполняются параллельно, и их ответы (с тем же тегом) могут прийти в любом порядке
+static void clientHandler(const std::shared_ptr<Connection>& c) {
+    //Разбираем буфер по строкам '\n'
+    //При чтении из SSL‑сокета (SSL_read) можно получить любую часть отправленного сообщения
+    //возможно целую строку, а возможно только её кусок — он останется в буфере до следующего чтения
+    std::string_view line;
+    c->commandsPaused = false;
+    //На лимите команд с тегом или на ждущей команде без тега останавливаемся:
+    //остаток подождёт в буфере их завершения
+    while (!c->closed && !c->commandRunning && c->inFlight < MAX_INFLIGHT_PER_CONN && c->in.next(line)) {
+        //Имя команды и тег разбираем прямо по строке (кадру) в буфере, без копий
+        CommandArgs args(line, c->binary);
+        Command cmd = args.command();
+        CommandContext ctx{c, c->userId, c->binary ? Wire::Binary : Wire::Text, args.tagged(), args.tag(),
+                           c->compressLevel};
+        if (ctx.tagged && runsConcurrently(cmd)) {
+            c->inFlight++;
+            spawn(runCommand(std::move(ctx), cmd, true, {}, std::string(line)));
+            continue;
+        }
+        c->commandRunning = true;
+        spawn(runCommand(std::move(ctx), cmd, false, line, {}));
+    }
+    c->commandsPaused = !c->closed && (c->commandRunning || c->inFlight >= MAX_INFLIGHT_PER_CONN);
+}
+
+//Читает всё, что готово в сокете, и передаёт полные строки в clientHandler
+static void doRead(const std::shared_ptr<Connection>& c) {
+    c->readWantsWrite = false;
+
+    //Пока исходящая очередь переполнена, новых команд не читаем: ответы на них некуда класть
+    //(и пока клиент ждёт слишком много команд с тегом)
+    for (int i = 0; i < READS_PER_EVENT && !c->closed && acceptsCommands(*c); ++i) {
+        //Читаем прямо в свободный хвост входного буфера, без промежуточной копии
+        int r = SSL_read(c->ssl, c->in.prepare(READ_CHUNK), READ_CHUNK);
+        if (r > 0) {
+            //Выполняем готовые команды
+            c->in.commit(r);
+            clientHandler(c);
+            if (!c->closed && c->in.overflow()) {
+                //Строка без конца длиннее предела: сообщаем и закрываем, не копя её в памяти
+                std::cerr << "[SERVER] Line too long or bad frame, " << c->in.pending() << " bytes pending\n";
+                queueOut(c, makePayload(encodeError(c->binary ? Wire::Binary : Wire::Text, "LINE_TOO_LONG")));
+                flushOut(c);
+                dropClient(c);
+                return;
+            }
+            continue;
+        }
+        int err = SSL_get_error(c->ssl, r);
+        if (err == SSL_ERROR_WANT_READ) break; //данных больше нет
+        if (err == SSL_ERROR_WANT_WRITE) { //TLS нужно сначала что-то отправить
+            c->readWantsWrite = true;
+            break;
+        }
+        //Клиент отключился или ошибка
+        dropClient(c);
+        return;
+    }
+    if (!c->closed) updateInterest(*c);
+}
+
+//Обработчик событий epoll для клиентского сокета
+static void onConnectionEvent(const std::shared_ptr<Connection>& c, uint32_t ev) {
+    if (c->closed) return;
+    if ((ev & (EPOLLERR | EPOLLHUP)) && !(ev & EPOLLIN)) {
+        dropClient(c);
+        return;
+    }
+    //SSL_read и SSL_write могут ждать «чужое» направление — учитываем оба флага
+    if ((ev & (EPOLLIN | EPOLLRDHUP)) || ((ev & EPOLLOUT) && c->readWantsWrite))
+        doRead(c);
+    if (c->closed) return;
+    if ((ev & EPOLLOUT) || ((ev & EPOLLIN) && c->writeWantsRead)) {
+        if (!flushOut(c)) dropClient(c);
+    }
+}
+
+//Принимает установленную сессию от потока рукопожатий (в потоке шарда-владельца)
+static void adoptConnection(const std::shared_ptr<Connection>& c) {
+    Shard* sh = c->shard;
+    sh->conns[c->id] = c;
+    c->events = EPOLLIN | EPOLLRDHUP;
+    sh->reactor.add(c->fd, c->events, [c](uint32_t ev) { onConnectionEvent(c, ev); });
+    //Клиент мог прислать команды сразу за рукопожатием — они уже лежат внутри SSL, epoll о них не скажет
+    doRead(c);
+}
+
+//Подписка в epoll потока рукопожатий: SSL_accept ждёт либо чтения, либо записи
+static void updateHandshakeInterest(Connection& c) {
+    uint32_t ev = EPOLLRDHUP | (c.handshakeWantsWrite ? EPOLLOUT : EPOLLIN);
+    if (ev == c.events) return;
+    c.events = ev;
+    c.handshaker->reactor.modify(c.fd, ev);
+}
+
+//Соединение уходит из потока рукопожатий: снимаем с его epoll и из списка ожидающих
+static void releaseHandshake(Connection& c) {
+    c.handshaker->reactor.remove(c.fd);
+    c.handshaker->pending.erase(c.id);
+    c.handshaker = nullptr;
+    pendingHandshakes--;
+}
+
+//Рукопожатие не состоялось (ошибка, срок): шарду соединение так и не передавалось
+static void abortHandshake(const std::shared_ptr<Connection>& c) {
+    releaseHandshake(*c);
+    c->closed = true;
+    SSL_free(c->ssl);
+    c->ssl = nullptr;
+    close(c->fd);
+}
+
+//Продолжает неблокирующее TLS-рукопожатие (в потоке рукопожатий)
+//По завершении соединение передаётся шарду и готово к командам
+static void doHandshake(const std::shared_ptr<Connection>& c) {
+    c->handshakeWantsWrite = false;
+    int r = SSL_accept(c->ssl);
+    if (r == 1) {
+        c->established = true;
+        if (SSL_session_reused(c->ssl)) resumedHandshakes++;
+        else fullHandshakes++;
+        //Ключи уже у ядра — дальше записи можно отдавать прямо в сокет
+        //Сборки OpenSSL без kTLS (например, 1.1.1 с OPENSSL_NO_KTLS) не знают и BIO_get_ktls_send
+#if defined(SSL_OP_ENABLE_KTLS)
+        c->ktlsSend = ENABLE_KTLS && BIO_get_ktls_send(SSL_get_wbio(c->ssl));
+#else
+        c->ktlsSend = false;
+#endif
+        if (c->ktlsSend) ktlsSessions++;
+        releaseHandshake(*c);
+        c->shard->reactor.post([c]{ adoptConnection(c); });
+        return;
+    }
+    int err = SSL_get_error(c->ssl, r);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        c->handshakeWantsWrite = (err == SSL_ERROR_WANT_WRITE);
+        updateHandshakeInterest(*c);
+        return;
+    }
+    //Не удалось пройти TLS рукопожатие
+    ERR_print_errors_fp(stderr);
+    abortHandshake(c);
+}
+
+//Обработчик событий epoll для сокета, проходящего рукопожатие
+static void onHandshakeEvent(const std::shared_ptr<Connection>& c, uint32_t ev) {
+    if (c->closed || c->established) return;
+    if ((ev & (EPOLLERR | EPOLLHUP)) && !(ev & EPOLLIN)) {
+        abortHandshake(c);
+        return;
+    }
+    doHandshake(c);
+}
+
+//Начало рукопожатия в потоке рукопожатий
+static void beginHandshake(const std::shared_ptr<Connection>& c) {
+    Handshaker* hs = c->handshaker;
+    hs->pending[c->id] = c;
+    c->events = EPOLLIN | EPOLLRDHUP;
+    hs->reactor.add(c->fd, c->events, [c](uint32_t ev) { onHandshakeEvent(c, ev); });
+    doHandshake(c);
+}
+
+//Закрывает рукопожатия, не уложившиеся в HANDSHAKE_TIMEOUT_MS (медленные или злонамеренные клиенты)
+static void expireHandshakes(Handshaker* hs) {
+    uint64_t ticks;
+    if (read(hs->timerFd, &ticks, sizeof(ticks)) < 0) return;
+    auto now = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<Connection>> expired;
+    for (auto &[id, c] : hs->pending) {
+        if (now >= c->handshakeDeadline) expired.push_back(c);
+    }
+    for (auto &c : expired) {
+        handshakeTimeouts++;
+        abortHandshake(c);
+    }
+}
+
+//Принимает новый (уже неблокирующий) сокет: SSL* и передача рукопожатия в поток рукопожатий
+//Вызывается в потоке шарда, чей слушающий сокет принял соединение; он же станет владельцем
+static void startConnection(Shard* sh, int sock) {
+    //Сверх лимита одновременных рукопожатий соединение сразу закрываем: клиент переподключится позже
+    if (pendingHandshakes.fetch_add(1) >= MAX_PENDING_HANDSHAKES) {
+        pendingHandshakes--;
+        handshakeRejects++;
+        close(sock);
+        return;
+    }
+
+    //Склейкой исходящих занимаемся сами (см. COALESCE_WINDOW_US), Nagle только задержал бы
+    //короткий хвост до ACK клиента, а тот шлёт ACK с задержкой до 40 мс
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    auto c = std::make_shared<Connection>();
+    c->id = (static_cast<ConnId>(sh->index) << SHARD_SHIFT) | sh->nextSeq++;
+    c->fd = sock;
+    c->shard = sh;
+    //Обвёртка TCP в TLS, рукопожатие пойдёт по событиям epoll потока рукопожатий
+    c->ssl = SSL_new(sslCtx);
+    SSL_set_fd(c->ssl, sock);
+    SSL_set_accept_state(c->ssl);
+    c->handshakeDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HANDSHAKE_TIMEOUT_MS);
+    c->handshaker = handshakers[nextHandshaker++ % handshakers.size()].get();
+    c->handshaker->reactor.post([c]{ beginHandshake(c); });
+}
+
+//Слушающий сокет шарда готов: забираем все ожидающие соединения
+static void onAccept(Shard* sh) {
+    while (true) {
+        int clientSock = accept4(sh->listenSock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            //EAGAIN — очередь пуста; нехватка fd — попробуем на следующем событии
+            return;
+        }
+        startConnection(sh, clientSock);
+    }
+}
+
+//Создаёт слушающий сокет шарда с SO_REUSEPORT: ядро само распределяет входящие соединения между шардами
+static int openListener() {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
         perror("socket"); //выводим причину ошибки
         exit(1);
     }
 
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        close(sock);
+        exit(1);
+    }
+
     //Структура с адресом и портом:
     sockaddr_in addr{};
     addr.sin_family = AF_INET; //семейство адресов IPv4
@@ -684,32 +1485,123 @@ int main() {
     addr.sin_addr.s_addr = INADDR_ANY; //слушаем на всех локальных интерфейсах (0.0.0.0)
 
     //Привязываем сокет к адресу/порту:
-    if (bind(serverSock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    if (bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
         perror("bind");
-        close(serverSock);
+        close(sock);
         exit(1);
     }
 
     //Переводим сокет в состояние прослушивания:
     //BACKLOG — максимальная длина очереди входящих подключений
-    if (listen(serverSock, BACKLOG) < 0) {
+    if (listen(sock, BACKLOG) < 0) {
         perror("listen");
-        close(serverSock);
+        close(sock);
+        exit(1);
+    }
+    return sock;
+}
+
+//Поток шарда: закрепляемся за своим ядром и крутим реактор
+static void shardThread(Shard* sh, int cpu) {
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            std::cerr << "[SERVER] Cannot pin shard " << sh->index << " to CPU " << cpu << "\n";
+    }
+    currentShard = sh;
+    //Свои неблокирующие соединения с БД: их сокеты слушает реактор шарда
+    db->attach(sh->reactor, DB_ASYNC_CONNS_PER_SHARD);
+    sh->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (sh->timerFd < 0) {
+        perror("timerfd_create");
         exit(1);
     }
+    sh->reactor.add(sh->listenSock, EPOLLIN, [sh](uint32_t) { onAccept(sh); });
+    sh->reactor.add(sh->timerFd, EPOLLIN, [sh](uint32_t) { onCoalesceTimer(sh); });
+    sh->reactor.run();
+    close(sh->timerFd);
+}
+
+//Поток рукопожатий: пониженный приоритет (шарды с установленными сессиями важнее) и свой реактор
+static void handshakeThread(Handshaker* hs) {
+    if (setpriority(PRIO_PROCESS, static_cast<id_t>(gettid()), HANDSHAKE_NICE) != 0)
+        std::cerr << "[SERVER] Cannot lower handshake thread priority\n";
+    hs->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (hs->timerFd < 0) {
+        perror("timerfd_create");
+        exit(1);
+    }
+    itimerspec sweep{};
+    sweep.it_interval.tv_sec = HANDSHAKE_SWEEP_MS / 1000;
+    sweep.it_interval.tv_nsec = (HANDSHAKE_SWEEP_MS % 1000) * 1000000L;
+    sweep.it_value = sweep.it_interval;
+    timerfd_settime(hs->timerFd, 0, &sweep, nullptr);
+    hs->reactor.add(hs->timerFd, EPOLLIN, [hs](uint32_t) { expireHandshakes(hs); });
+    hs->reactor.run();
+    close(hs->timerFd);
+}
+
+//Поднимает лимит открытых файлов до жёсткого: каждое соединение — один fd
+static void raiseFdLimit() {
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main() {
+    //1) Инициализируем SSL
+    init_openssl();
+    //Запись в закрытый клиентом сокет не должна убивать весь процесс
+    signal(SIGPIPE, SIG_IGN);
+    raiseFdLimit();
+
+    //2) Подключаемся к БД
+    PoolConfig poolCfg;
+    poolCfg.size = DB_POOL_SIZE;
+    poolCfg.acquireTimeout = std::chrono::milliseconds(DB_ACQUIRE_TIMEOUT_MS);
+    GroupCommitConfig gcCfg;
+    gcCfg.lanes = MSG_BATCH_LANES;
+    gcCfg.maxBatch = MSG_BATCH_MAX;
+    gcCfg.window = std::chrono::microseconds(MSG_BATCH_WINDOW_US);
+    db = new Database("host=localhost dbname=chatdb user=chatuser password=123", poolCfg, gcCfg);
+    historyCache = new HistoryCache(HISTORY_RING_SIZE, HISTORY_CACHE_MAX_ENTRIES);
+
+    //3) Создаём шарды: по одному на каждое доступное процессу ядро
+    std::vector<int> cpus;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; ++i)
+            if (CPU_ISSET(i, &allowed)) cpus.push_back(i);
+    }
+    if (cpus.empty()) cpus.push_back(-1); //не удалось узнать ядра — один шард без закрепления
+
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        auto sh = std::make_unique<Shard>();
+        sh->index = static_cast<int>(i);
+        sh->listenSock = openListener();
+        shards.push_back(std::move(sh));
+    }
+
+    for (int i = 0; i < HANDSHAKE_THREADS; ++i) handshakers.push_back(std::make_unique<Handshaker>());
 
     //Выводим в консоль информацию о том, что сервер готов принимать подключения
-    std::cout << "Server listening on port " << PORT << '\n';
+    std::cout << "Server listening on port " << PORT
+              << " (" << shards.size() << " shards, " << handshakers.size() << " handshake threads)\n";
 
     //4) Запускаем админ‑поток для RESET/SHUTDOWN
     std::thread(adminThread).detach();
 
-    //5) Основной цикл: принимаем новые соединения
-    while (running) {
-        int clientSock = accept(serverSock, nullptr, nullptr);
-        if (clientSock < 0) break;
-        std::thread(clientHandler, clientSock).detach();
-    }
+    //5) Запускаем потоки рукопожатий и шардов и ждём их завершения (SHUTDOWN)
+    for (auto &hs : handshakers) hs->thread = std::thread(handshakeThread, hs.get());
+    for (size_t i = 0; i < shards.size(); ++i)
+        shards[i]->thread = std::thread(shardThread, shards[i].get(), cpus[i]);
+    for (auto &sh : shards) sh->thread.join();
+    for (auto &hs : handshakers) hs->thread.join();
+    for (auto &sh : shards) close(sh->listenSock);
 
     //6) Чистим ресурсы
     SSL_CTX_free(sslCtx);
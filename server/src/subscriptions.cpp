@@ -0,0 +1,72 @@
+#include "subscriptions.h"
+
+void SubscriptionRegistry::addToChat(int chat_id, ConnId conn) {
+  ChatStripe& s = chatStripe(chat_id);
+  std::lock_guard lk(s.mtx);
+  Chat& c = s.chats[chat_id];
+  if (c.conns.insert(conn).second) c.snapshot.reset();
+}
+
+void SubscriptionRegistry::removeFromChat(int chat_id, ConnId conn) {
+  ChatStripe& s = chatStripe(chat_id);
+  std::lock_guard lk(s.mtx);
+  auto it = s.chats.find(chat_id);
+  if (it == s.chats.end() || !it->second.conns.erase(conn)) return;
+  if (it->second.conns.empty()) s.chats.erase(it);
+  else it->second.snapshot.reset();
+}
+
+void SubscriptionRegistry::subscribe(int chat_id, ConnId conn) {
+  ConnStripe& s = connStripe(conn);
+  std::lock_guard lk(s.mtx);
+  if (s.conns[conn].insert(chat_id).second) addToChat(chat_id, conn);
+}
+
+void SubscriptionRegistry::unsubscribe(int chat_id, ConnId conn) {
+  ConnStripe& s = connStripe(conn);
+  std::lock_guard lk(s.mtx);
+  auto it = s.conns.find(conn);
+  if (it == s.conns.end() || !it->second.erase(chat_id)) return;
+  removeFromChat(chat_id, conn);
+}
+
+void SubscriptionRegistry::resubscribe(ConnId conn, const std::vector<int>& chats) {
+  ConnStripe& s = connStripe(conn);
+  std::lock_guard lk(s.mtx);
+  auto& own = s.conns[conn];
+  std::unordered_set<int> wanted(chats.begin(), chats.end());
+  //Трогаем только разницу между старым и новым набором
+  for (auto it = own.begin(); it != own.end();) {
+    if (wanted.count(*it)) {
+      ++it;
+      continue;
+    }
+    removeFromChat(*it, conn);
+    it = own.erase(it);
+  }
+  for (int chat_id : wanted) {
+    if (own.insert(chat_id).second) addToChat(chat_id, conn);
+  }
+}
+
+void SubscriptionRegistry::dropConnection(ConnId conn) {
+  ConnStripe& s = connStripe(conn);
+  std::lock_guard lk(s.mtx);
+  auto it = s.conns.find(conn);
+  if (it == s.conns.end()) return;
+  for (int chat_id : it->second) removeFromChat(chat_id, conn);
+  s.conns.erase(it);
+}
+
+SubscriptionRegistry::Snapshot SubscriptionRegistry::subscribers(int chat_id) {
+  static const Snapshot empty = std::make_shared<const std::vector<ConnId>>();
+  ChatStripe& s = chatStripe(chat_id);
+  std::lock_guard lk(s.mtx);
+  auto it = s.chats.find(chat_id);
+  if (it == s.chats.end()) return empty;
+  Chat& c = it->second;
+  if (!c.snapshot) {
+    c.snapshot = std::make_shared<const std::vector<ConnId>>(c.conns.begin(), c.conns.end());
+  }
+  return c.snapshot;
+}
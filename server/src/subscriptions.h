@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+//Реестр подписок на чаты: chat -> соединения и соединение -> chats
+//Подписка, отписка и отключение стоят O(своих подписок), а не O(всех чатов сервера)
+//Обе стороны разбиты на секции со своими мьютексами, поэтому разные чаты не мешают друг другу
+//Для рассылки чат отдаёт неизменяемый снимок списка получателей: он пересобирается
+//только после изменения подписок и читается уже без блокировки
+class SubscriptionRegistry {
+public:
+    using ConnId = uint64_t;
+    using Snapshot = std::shared_ptr<const std::vector<ConnId>>;
+
+    void subscribe(int chat_id, ConnId conn);
+    void unsubscribe(int chat_id, ConnId conn);
+    //Заменяет все подписки соединения на chats (LIST_CHATS)
+    void resubscribe(ConnId conn, const std::vector<int>& chats);
+    //Снимает все подписки закрытого соединения
+    void dropConnection(ConnId conn);
+
+    //Получатели рассылки в чат; никогда не nullptr
+    Snapshot subscribers(int chat_id);
+
+private:
+    static constexpr size_t STRIPES = 64;
+
+    struct Chat {
+        std::unordered_set<ConnId> conns;
+        Snapshot snapshot; //nullptr — устарел, пересобрать при следующей рассылке
+    };
+    struct ChatStripe {
+        std::mutex mtx;
+        std::unordered_map<int, Chat> chats;
+    };
+    struct ConnStripe {
+        std::mutex mtx;
+        std::unordered_map<ConnId, std::unordered_set<int>> conns;
+    };
+
+    ChatStripe& chatStripe(int chat_id) { return chatStripes[static_cast<unsigned>(chat_id) % STRIPES]; }
+    ConnStripe& connStripe(ConnId conn) { return connStripes[conn % STRIPES]; }
+    void addToChat(int chat_id, ConnId conn);
+    void removeFromChat(int chat_id, ConnId conn);
+
+    //Порядок блокировок: секция соединения, затем секция чата
+    ChatStripe chatStripes[STRIPES];
+    ConnStripe connStripes[STRIPES];
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+//Сопрограмма C++20 с результатом T: обработчик команды или запрос к БД, который может
+//приостановиться (co_await) в ожидании ответа и продолжиться позже в том же потоке реактора
+//Ленивая: начинает выполняться только при co_await, по завершении сразу продолжает ожидающего
+//(симметричная передача управления, без роста стека)
+//Исключения в сервере не используются — исключение из сопрограммы завершает процесс, как из потока
+template <typename T = void>
+class Task;
+
+namespace task_detail {
+
+//Общая часть обещания: кого продолжить по завершении
+struct PromiseBase {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) const noexcept {
+            return h.promise().continuation;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() const noexcept { std::terminate(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    template <typename U>
+    void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+    T take() { return std::move(*value); }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+    void return_void() const noexcept {}
+    void take() const noexcept {}
+};
+
+} // namespace task_detail
+
+template <typename T>
+class Task {
+public:
+    using promise_type = task_detail::Promise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    Task() = default;
+    explicit Task(Handle h) : handle(h) {}
+    Task(Task&& o) noexcept : handle(std::exchange(o.handle, {})) {}
+    Task& operator=(Task&& o) noexcept {
+        if (this != &o) {
+            if (handle) handle.destroy();
+            handle = std::exchange(o.handle, {});
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { if (handle) handle.destroy(); }
+
+    //co_await task: запускает сопрограмму и ждёт её результата
+    auto operator co_await() && noexcept {
+        struct Awaiter {
+            Handle h;
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                h.promise().continuation = awaiting;
+                return h;
+            }
+            T await_resume() { return h.promise().take(); }
+        };
+        return Awaiter{handle};
+    }
+
+private:
+    Handle handle;
+};
+
+namespace task_detail {
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+//Сопрограмма без владельца: стартует сразу и сама освобождает свой кадр по завершении
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+inline Detached runDetached(Task<void> task) {
+    co_await std::move(task);
+}
+
+} // namespace task_detail
+
+//Запускает сопрограмму верхнего уровня (команду клиента): выполняется до первого ожидания
+//прямо здесь, дальше — по мере готовности того, чего она ждёт; результат никто не ждёт
+inline void spawn(Task<void> task) {
+    task_detail::runDetached(std::move(task));
+}
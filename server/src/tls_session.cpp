@@ -0,0 +1,123 @@
+#include "tls_session.h"
+
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+
+namespace {
+
+//Ключ билетов: имя (по нему находим ключ при расшифровке), AES-256 и HMAC-SHA256
+struct TicketKey {
+  unsigned char name[16];
+  unsigned char aes[32];
+  unsigned char hmac[32];
+  std::chrono::steady_clock::time_point created;
+};
+
+//Колбэк OpenSSL вызывается из потоков всех шардов, поэтому ключи под мьютексом;
+//рукопожатие и так дорогое, короткая блокировка в нём незаметна
+std::mutex keysMtx;
+std::deque<TicketKey> keys; //новейший — первый
+size_t keysKept = 1;
+std::chrono::seconds rotation{3600};
+
+std::atomic<uint64_t> keyRotations{0};
+std::atomic<uint64_t> ticketsRenewed{0};
+std::atomic<uint64_t> ticketsRejected{0};
+
+void newKey(std::chrono::steady_clock::time_point now) {
+  TicketKey k;
+  if (RAND_bytes(k.name, sizeof(k.name)) != 1 || RAND_bytes(k.aes, sizeof(k.aes)) != 1 ||
+      RAND_bytes(k.hmac, sizeof(k.hmac)) != 1) {
+    fprintf(stderr, "[TLS] Cannot generate ticket key\n");
+    exit(1);
+  }
+  k.created = now;
+  keys.push_front(k);
+  while (keys.size() > keysKept) keys.pop_back();
+  keyRotations++;
+}
+
+//Ротация ленивая: первый билет после истечения периода выпускается уже новым ключом
+void rotateIfDue() {
+  auto now = std::chrono::steady_clock::now();
+  if (keys.empty() || now - keys.front().created >= rotation) newKey(now);
+}
+
+bool initMac(EVP_MAC_CTX* hctx, const TicketKey& k) {
+  char digest[] = "SHA256";
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+    OSSL_PARAM_construct_end(),
+  };
+  return EVP_MAC_init(hctx, k.hmac, sizeof(k.hmac), params) == 1;
+}
+
+//enc=1 — выпустить билет текущим ключом; enc=0 — найти ключ билета клиента
+//Возврат: 1 — годится, 2 — годится, но выпустить новый билет, 0 — неизвестный ключ, <0 — ошибка
+int ticketKeyCallback(SSL*, unsigned char keyName[16], unsigned char* iv,
+                      EVP_CIPHER_CTX* cctx, EVP_MAC_CTX* hctx, int enc) {
+  std::lock_guard lk(keysMtx);
+  rotateIfDue();
+  if (enc) {
+    const TicketKey& k = keys.front();
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) return -1;
+    memcpy(keyName, k.name, sizeof(k.name));
+    if (EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, k.aes, iv) != 1 || !initMac(hctx, k)) return -1;
+    return 1;
+  }
+  for (size_t i = 0; i < keys.size(); ++i) {
+    const TicketKey& k = keys[i];
+    if (memcmp(keyName, k.name, sizeof(k.name)) != 0) continue;
+    if (!initMac(hctx, k) || EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, k.aes, iv) != 1) return -1;
+    if (i == 0) return 1;
+    ticketsRenewed++;
+    return 2;
+  }
+  ticketsRejected++;
+  return 0;
+}
+
+}  // namespace
+
+void enableSessionResumption(SSL_CTX* ctx, const TlsSessionConfig& cfg) {
+  //Кэш сессий на сервере, ограниченный по размеру; сессии одного приложения
+  static const unsigned char sidContext[] = "chat-server";
+  SSL_CTX_set_session_id_context(ctx, sidContext, sizeof(sidContext) - 1);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, static_cast<long>(cfg.cacheSize));
+  SSL_CTX_set_timeout(ctx, static_cast<long>(cfg.timeout.count()));
+  //Обрыв TCP без close_notify (мобильный клиент сменил сеть) OpenSSL считает фатальной ошибкой
+  //и выкидывает сессию из кэша — ровно тот случай, ради которого кэш нужен
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+  //Билеты: ключей держим столько, чтобы билет оставался действительным всё время жизни сессии
+  {
+    std::lock_guard lk(keysMtx);
+    rotation = cfg.ticketKeyRotation.count() > 0 ? cfg.ticketKeyRotation : std::chrono::seconds(1);
+    keysKept = static_cast<size_t>(cfg.timeout / rotation) + 1;
+    rotateIfDue();
+  }
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticketKeyCallback);
+  //Клиент хранит один билет — второй, выдаваемый TLS 1.3 по умолчанию, лишняя работа на рукопожатие
+  SSL_CTX_set_num_tickets(ctx, 1);
+}
+
+TlsSessionStats tlsSessionStats(SSL_CTX* ctx) {
+  TlsSessionStats st;
+  st.cached = SSL_CTX_sess_number(ctx);
+  st.cacheHits = SSL_CTX_sess_hits(ctx);
+  st.cacheMisses = SSL_CTX_sess_misses(ctx);
+  st.cacheFull = SSL_CTX_sess_cache_full(ctx);
+  st.keyRotations = keyRotations.load();
+  st.ticketsRenewed = ticketsRenewed.load();
+  st.ticketsRejected = ticketsRejected.load();
+  return st;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include <openssl/ssl.h>
+
+//Возобновление TLS-сессий: переподключившийся клиент проходит сокращённое рукопожатие без
+//асимметричной криптографии
+//
+//Два механизма сразу:
+//  - билеты сессий (RFC 5077 / TLS 1.3 PSK): состояние сессии у клиента, зашифровано ключом
+//    сервера; ключи живут только в памяти и сменяются каждые ticketKeyRotation, старые ещё
+//    принимаются, пока не истечёт timeout (такой билет сервер сразу заменяет новым)
+//  - ограниченный кэш сессий на сервере для клиентов TLS 1.2 без поддержки билетов
+struct TlsSessionConfig {
+    size_t cacheSize = 20000; //сессий в серверном кэше
+    std::chrono::seconds timeout{7200}; //сколько живёт сессия (и билет)
+    std::chrono::seconds ticketKeyRotation{3600}; //как часто выпускать новый ключ билетов
+};
+
+struct TlsSessionStats {
+    uint64_t cached = 0; //сессий сейчас в кэше
+    uint64_t cacheHits = 0; //возобновлено по кэшу
+    uint64_t cacheMisses = 0; //клиент предъявил неизвестный идентификатор сессии
+    uint64_t cacheFull = 0; //вытеснено из-за размера кэша
+    uint64_t keyRotations = 0; //выпущено ключей билетов
+    uint64_t ticketsRenewed = 0; //билет на старом ключе принят и заменён
+    uint64_t ticketsRejected = 0; //ключ билета уже неизвестен — полное рукопожатие
+};
+
+//Включает кэш сессий и билеты с ротацией ключей для контекста (один раз при старте)
+void enableSessionResumption(SSL_CTX* ctx, const TlsSessionConfig& cfg);
+
+TlsSessionStats tlsSessionStats(SSL_CTX* ctx);
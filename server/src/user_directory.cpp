@@ -0,0 +1,102 @@
+#include "user_directory.h"
+
+#include <cstdint>
+#include <functional>
+
+//Начальная ёмкость таблицы; расширяем вдвое при заполнении наполовину
+static constexpr size_t INITIAL_CAPACITY = 1024;
+
+UserDirectory::Table::Table(size_t capacity)
+  : mask(capacity - 1),
+    byId(new std::atomic<const Entry*>[capacity]),
+    byName(new std::atomic<const Entry*>[capacity]) {
+  for (size_t i = 0; i < capacity; ++i) {
+    byId[i].store(nullptr, std::memory_order_relaxed);
+    byName[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+UserDirectory::UserDirectory() {
+  tables.push_back(std::make_unique<Table>(INITIAL_CAPACITY));
+  current.store(tables.back().get(), std::memory_order_release);
+}
+
+size_t UserDirectory::hashId(int id) {
+  //Перемешиваем биты: последовательные id не должны ложиться подряд
+  uint64_t x = static_cast<uint32_t>(id);
+  x *= 0x9E3779B97F4A7C15ull;
+  return static_cast<size_t>(x ^ (x >> 32));
+}
+
+size_t UserDirectory::hashName(const std::string& name) {
+  return std::hash<std::string>{}(name);
+}
+
+bool UserDirectory::findName(int id, std::string& name) const {
+  const Table* t = current.load(std::memory_order_acquire);
+  for (size_t i = hashId(id) & t->mask;; i = (i + 1) & t->mask) {
+    const Entry* e = t->byId[i].load(std::memory_order_acquire);
+    if (!e) return false;
+    if (e->id == id) {
+      name = e->name;
+      return true;
+    }
+  }
+}
+
+int UserDirectory::findId(const std::string& name) const {
+  const Table* t = current.load(std::memory_order_acquire);
+  for (size_t i = hashName(name) & t->mask;; i = (i + 1) & t->mask) {
+    const Entry* e = t->byName[i].load(std::memory_order_acquire);
+    if (!e) return -1;
+    if (e->name == name) return e->id;
+  }
+}
+
+//Вставка без проверки дубликатов; release публикует уже заполненную запись
+void UserDirectory::insert(Table& t, const Entry* e) {
+  size_t i = hashId(e->id) & t.mask;
+  while (t.byId[i].load(std::memory_order_relaxed)) i = (i + 1) & t.mask;
+  t.byId[i].store(e, std::memory_order_release);
+
+  i = hashName(e->name) & t.mask;
+  while (t.byName[i].load(std::memory_order_relaxed)) i = (i + 1) & t.mask;
+  t.byName[i].store(e, std::memory_order_release);
+
+  t.used++;
+}
+
+void UserDirectory::put(int id, const std::string& name) {
+  if (id <= 0 || name.empty()) return;
+
+  std::lock_guard lk(writeMtx);
+  Table* t = current.load(std::memory_order_relaxed);
+  std::string known;
+  if (findName(id, known)) return;
+
+  entries.push_back(std::make_unique<Entry>(Entry{id, name}));
+  const Entry* e = entries.back().get();
+
+  //Заполнена наполовину — строим таблицу вдвое больше и публикуем её целиком
+  //Читатели, успевшие взять старую, дочитают её (максимум пропустят новую запись и сходят в БД)
+  if ((t->used + 1) * 2 > t->mask + 1) {
+    auto bigger = std::make_unique<Table>((t->mask + 1) * 2);
+    for (size_t i = 0; i <= t->mask; ++i) {
+      if (const Entry* old = t->byId[i].load(std::memory_order_relaxed)) insert(*bigger, old);
+    }
+    insert(*bigger, e);
+    current.store(bigger.get(), std::memory_order_release);
+    tables.push_back(std::move(bigger));
+  } else {
+    insert(*t, e);
+  }
+  count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void UserDirectory::clear() {
+  std::lock_guard lk(writeMtx);
+  //Старые таблицы и записи не освобождаем — их ещё могут читать
+  tables.push_back(std::make_unique<Table>(INITIAL_CAPACITY));
+  current.store(tables.back().get(), std::memory_order_release);
+  count.store(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//Справочник пользователей в памяти: user_id <-> username
+//Имена не меняются и пользователи не удаляются (кроме админского RESET), поэтому записи неизменяемы
+//Чтение без блокировок: открытая адресация, ячейки — атомарные указатели на записи
+//Писатель один (под мьютексом); при расширении публикуется новая таблица, а старые
+//и все записи живут до разрушения справочника — читатель никогда не увидит освобождённую память
+//Промах — не ошибка: справочник заполняется лениво, источником истины остаётся БД
+class UserDirectory {
+public:
+    UserDirectory();
+    ~UserDirectory() = default;
+
+    UserDirectory(const UserDirectory&) = delete;
+    UserDirectory& operator=(const UserDirectory&) = delete;
+
+    //Имя по id; false — в справочнике нет
+    bool findName(int id, std::string& name) const;
+    //id по имени; -1 — в справочнике нет
+    int findId(const std::string& name) const;
+
+    //Добавляет пару (повторное добавление того же id игнорируется)
+    void put(int id, const std::string& name);
+    //Забывает всех (после очистки БД)
+    void clear();
+
+    size_t size() const { return count.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry {
+        int id;
+        std::string name;
+    };
+    struct Table {
+        explicit Table(size_t capacity);
+        size_t mask; //ёмкость - 1, ёмкость — степень двойки
+        std::unique_ptr<std::atomic<const Entry*>[]> byId;
+        std::unique_ptr<std::atomic<const Entry*>[]> byName;
+        size_t used = 0; //занятых ячеек (меняет только писатель)
+    };
+
+    static size_t hashId(int id);
+    static size_t hashName(const std::string& name);
+    static void insert(Table& t, const Entry* e);
+
+    std::atomic<Table*> current;
+    std::atomic<size_t> count{0};
+
+    std::mutex writeMtx; //один писатель за раз
+    std::vector<std::unique_ptr<Entry>> entries; //все записи, включая забытые после clear()
+    std::vector<std::unique_ptr<Table>> tables; //все таблицы, включая вытесненные
+};
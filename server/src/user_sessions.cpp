@@ -0,0 +1,39 @@
+#include "user_sessions.h"
+
+#include <algorithm>
+
+void UserSessions::add(int user_id, ConnId conn) {
+  Stripe& s = stripe(user_id);
+  std::lock_guard lk(s.mtx);
+  auto& v = s.conns[user_id];
+  if (std::find(v.begin(), v.end(), conn) == v.end()) v.push_back(conn);
+}
+
+void UserSessions::remove(int user_id, ConnId conn) {
+  Stripe& s = stripe(user_id);
+  std::lock_guard lk(s.mtx);
+  auto it = s.conns.find(user_id);
+  if (it == s.conns.end()) return;
+  auto& v = it->second;
+  v.erase(std::remove(v.begin(), v.end(), conn), v.end());
+  //Пользователь отключился со всех устройств — запись больше не нужна
+  if (v.empty()) s.conns.erase(it);
+}
+
+void UserSessions::collect(const std::vector<int>& users, std::vector<ConnId>& out) const {
+  for (int u : users) {
+    const Stripe& s = stripe(u);
+    std::lock_guard lk(s.mtx);
+    auto it = s.conns.find(u);
+    if (it != s.conns.end()) out.insert(out.end(), it->second.begin(), it->second.end());
+  }
+}
+
+size_t UserSessions::userCount() const {
+  size_t n = 0;
+  for (const auto& s : stripes) {
+    std::lock_guard lk(s.mtx);
+    n += s.conns.size();
+  }
+  return n;
+}
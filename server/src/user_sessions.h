@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+//Индекс пользователь -> его соединения (с нескольких устройств)
+//Пользователи разложены по секциям со своими мьютексами: LOGIN и отключение одного клиента
+//не блокируют поиск соединений других пользователей
+class UserSessions {
+public:
+    using ConnId = uint64_t;
+
+    //Привязывает соединение к пользователю (повторная привязка не дублирует его)
+    void add(int user_id, ConnId conn);
+    void remove(int user_id, ConnId conn);
+
+    //Дописывает в out соединения всех users
+    void collect(const std::vector<int>& users, std::vector<ConnId>& out) const;
+
+    size_t userCount() const;
+
+private:
+    static constexpr size_t STRIPES = 64;
+
+    struct Stripe {
+        mutable std::mutex mtx;
+        std::unordered_map<int, std::vector<ConnId>> conns;
+    };
+
+    Stripe& stripe(int user_id) { return stripes[static_cast<unsigned>(user_id) % STRIPES]; }
+    const Stripe& stripe(int user_id) const { return stripes[static_cast<unsigned>(user_id) % STRIPES]; }
+
+    Stripe stripes[STRIPES];
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+//Целые переменной длины (LEB128): по 7 бит в байте, старший бит — «дальше есть ещё байт»
+//Используются бинарным протоколом для длин кадров, идентификаторов и времени
+static constexpr size_t VARINT_MAX_BYTES = 10;
+
+inline void putVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+//Читает varint из s начиная с pos и сдвигает pos за него
+//false — данные кончились раньше varint или он длиннее 10 байт (pos тогда не меняется)
+inline bool getVarint(std::string_view s, size_t& pos, uint64_t& v) {
+    uint64_t r = 0;
+    for (size_t i = 0; i < VARINT_MAX_BYTES && pos + i < s.size(); ++i) {
+        uint8_t b = static_cast<uint8_t>(s[pos + i]);
+        r |= static_cast<uint64_t>(b & 0x7f) << (7 * i);
+        if (!(b & 0x80)) {
+            pos += i + 1;
+            v = r;
+            return true;
+        }
+    }
+    return false;
+}
+
+//Знаковые значения (время) кодируются zigzag: маленькие по модулю — короткие
+inline void putSignedVarint(std::string& out, int64_t v) {
+    putVarint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+}
+
+//Строка: varint-длина и байты UTF-8 как есть (переводы строк, ';' и ':' внутри допустимы)
+inline void putString(std::string& out, std::string_view s) {
+    putVarint(out, s.size());
+    out.append(s.data(), s.size());
+}
@@ -20,6 +20,7 @@ CREATE TABLE chat_members (
     REFERENCES chats(chat_id) ON DELETE CASCADE,
   user_id INT NOT NULL
     REFERENCES users(user_id) ON DELETE CASCADE,
+  last_read_msg_id INT NOT NULL DEFAULT 0,  -- до какого сообщения чат прочитан (для счётчика непрочитанных)
   PRIMARY KEY(chat_id, user_id)
 );
 
@@ -52,6 +53,11 @@ CREATE TABLE chat_events (
 );
 
 -- Индексы
-CREATE INDEX idx_messages_chat     ON messages(chat_id);
+-- Постраничная история (HISTORY): keyset-пагинация по msg_id внутри чата,
+-- и непрочитанные в LIST_CHATS: сообщения чата после last_read_msg_id
+-- Заменяет отдельный индекс по chat_id — он является его префиксом
+CREATE INDEX idx_messages_chat_msg  ON messages(chat_id, msg_id);
 CREATE INDEX idx_messages_sender   ON messages(sender_id);
-CREATE INDEX idx_chat_members_user ON chat_members(user_id);
\ No newline at end of file
+CREATE INDEX idx_chat_members_user ON chat_members(user_id);
+-- События чата за промежуток времени (склейка со страницей истории)
+CREATE INDEX idx_chat_events_chat_ts ON chat_events(chat_id, event_ts);
@@ -0,0 +1,31 @@
+-- Обновление уже существующей базы до схемы init_schema.sql
+-- Повторный запуск безопасен: каждое изменение применяется, только если его ещё нет
+-- psql -d <база> -f sql/upgrade_schema.sql — до запуска нового сервера: без этих столбцов
+-- и индексов подготовка запросов (PQprepare) не проходит и сервер не стартует
+
+BEGIN;
+
+-- Отметка прочитанного для счётчика непрочитанных в LIST_CHATS
+-- Старые участники считаются прочитавшими всё, что уже было в чате, — иначе после обновления
+-- вся накопленная история разом стала бы непрочитанной
+DO $$
+BEGIN
+  IF NOT EXISTS (SELECT 1 FROM information_schema.columns
+                  WHERE table_name = 'chat_members' AND column_name = 'last_read_msg_id') THEN
+    ALTER TABLE chat_members ADD COLUMN last_read_msg_id INT NOT NULL DEFAULT 0;
+    UPDATE chat_members cm
+       SET last_read_msg_id = COALESCE((SELECT max(m.msg_id) FROM messages m WHERE m.chat_id = cm.chat_id), 0);
+  END IF;
+END
+$$;
+
+-- Постраничная история и непрочитанные: (chat_id, msg_id)
+-- Заменяет индекс по chat_id (он её префикс) и промежуточный индекс по (chat_id, created_at, msg_id)
+CREATE INDEX IF NOT EXISTS idx_messages_chat_msg ON messages(chat_id, msg_id);
+DROP INDEX IF EXISTS idx_messages_chat;
+DROP INDEX IF EXISTS idx_messages_chat_time;
+
+-- События чата за промежуток времени (склейка со страницей истории)
+CREATE INDEX IF NOT EXISTS idx_chat_events_chat_ts ON chat_events(chat_id, event_ts);
+
+COMMIT;